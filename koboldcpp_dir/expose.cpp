@@ -221,18 +221,20 @@ extern "C"
         return sdtype_generate(inputs);
     }
 
-    const char * new_token(int idx) {
-        if (generated_tokens.size() <= idx || idx < 0) return nullptr;
+    const char * new_token(int slot, int idx) {
+        return gpttype_get_stream_token(slot, idx);
+    }
 
-        return generated_tokens[idx].c_str();
+    int get_stream_count(int slot) {
+        return gpttype_get_stream_count(slot);
     }
 
-    int get_stream_count() {
-        return generated_tokens.size();
+    bool has_finished(int slot) {
+        return gpttype_has_finished(slot);
     }
 
-    bool has_finished() {
-        return generation_finished;
+    int get_slot_count() {
+        return gpttype_get_slot_count();
     }
 
     float get_last_eval_time() {
@@ -255,12 +257,12 @@ extern "C"
         return (int)last_stop_reason;
     }
 
-    const char* get_pending_output() {
-       return gpttype_get_pending_output().c_str();
+    const char* get_pending_output(int slot) {
+       return gpttype_get_pending_output(slot).c_str();
     }
 
-    bool abort_generate() {
-        return gpttype_generate_abort();
+    bool abort_generate(int slot) {
+        return gpttype_generate_abort(slot);
     }
 
     static std::vector<int> toks; //just share a static object for token counting
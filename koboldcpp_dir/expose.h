@@ -57,6 +57,10 @@ struct load_model_inputs
     const float rope_freq_base = 10000.0f;
     const char * banned_tokens[ban_token_max];
     const float tensor_split[tensor_split_max];
+    const int slots = 1;
+    const int prefix_cache = 0;
+    const char * prefix_cache_dir;
+    const int prefix_cache_disk_mb = 0;
 };
 struct generation_inputs
 {
@@ -91,7 +95,7 @@ struct generation_inputs
     const float dynatemp_exponent = 1.0f;
     const float smoothing_factor = 0.0f;
     const logit_bias logit_biases[logit_bias_max];
-
+    const int slot = 0;
 };
 struct generation_outputs
 {
@@ -135,8 +139,6 @@ extern std::string executable_path;
 extern std::string lora_filename;
 extern std::string lora_base;
 extern std::string mmproj_filename;
-extern std::vector<std::string> generated_tokens;
-extern bool generation_finished;
 extern float last_eval_time;
 extern float last_process_time;
 extern int last_token_count;
@@ -9,6 +9,10 @@
 
 #include <time.h>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <chrono>
 #include "model_adapter.h"
 #include "otherarch.h"
 #include "grammar-parser.h"
@@ -43,18 +47,12 @@ std::string executable_path = "";
 std::string lora_filename = "";
 std::string lora_base = "";
 std::string mmproj_filename = "";
-bool generation_finished;
 float last_process_time = 0;
 float last_eval_time = 0;
 int last_token_count = 0;
 int last_seed = -1;
 int total_gens = 0;
 stop_reason last_stop_reason = stop_reason::INVALID;
-std::vector<std::string> generated_tokens;
-
-llama_grammar *  grammar = nullptr; //currently used grammar
-grammar_parser::parse_state parsed_grammar;
-static std::string current_grammar = "";
 
 //return val: 0=fail, 1=(original ggml, alpaca), 2=(ggmf), 3=(ggjt)
 static FileFormat file_format = FileFormat::BADFORMAT;
@@ -85,33 +83,164 @@ static llama_context * llama_ctx_v4;
 
 static clip_ctx * clp_ctx = nullptr; //for llava
 static clip_image_u8 * clp_img_data = nullptr; //most recent image
-static std::vector<llava_image> llava_images;
-static std::string llava_composite_image_signature = ""; //for identifying when the llava images change, we need to invalidate the cache
-static int current_llava_identifier = LLAVA_TOKEN_IDENTIFIER_A;
 
 static gpt_params * kcpp_params = nullptr;
 static int max_context_limit_at_load = 0;
-static int n_past = 0;
 static bool useSmartContext = false;
 static bool useContextShift = false;
 static int debugmode = 0; //-1 = hide all, 0 = normal, 1 = showall
 static std::string modelname;
-static std::vector<gpt_vocab::id> last_n_tokens;
-static std::vector<gpt_vocab::id> current_context_tokens;
 static size_t mem_per_token = 0;
 static std::vector<float> logits;
-static std::vector<int> smartcontext;
-static std::vector<std::string> stop_sequence;
 static std::vector<std::string> banned_tokens;
 static std::vector<int> banned_token_ids;
-static std::vector<llama_token_data> top_picks;
-static int remaining_tokens = 0;
-static int stopper_unused_tokens = 0;
-static std::mutex concat_output_mtx;
-static std::string concat_output = "";
-static std::string concat_output_reader_copy_poll = ""; //for streaming
-static std::string concat_output_reader_copy_res = ""; //for gen response
-static std::vector<logit_bias> logit_biases;
+static thread_local std::vector<llama_token_data> top_picks; //of the generation running on this thread
+static std::mutex llama_ctx_mtx; //the slots share llama_ctx_v4, only one of them can use it at a time
+
+//how often each token occurs inside the repetition penalty window, updated as tokens enter and leave it
+struct kcpp_rep_pen_window
+{
+    int n_repeat = 0; //window length, counted from the end of last_n_tokens
+    std::vector<int> counts; //by token id
+    std::vector<int> index; //where each counted token sits in ids
+    std::vector<gpt_vocab::id> ids; //every token with a nonzero count
+
+    void add(gpt_vocab::id id)
+    {
+        if(id < 0 || id >= counts.size())
+        {
+            return; //llava placeholders and other out of vocab ids never match a candidate
+        }
+        if(counts[id]++ == 0)
+        {
+            index[id] = ids.size();
+            ids.push_back(id);
+        }
+    }
+    void remove(gpt_vocab::id id)
+    {
+        if(id < 0 || id >= counts.size() || counts[id] == 0)
+        {
+            return;
+        }
+        if(--counts[id] == 0)
+        {
+            gpt_vocab::id moved = ids.back();
+            ids[index[id]] = moved;
+            index[moved] = index[id];
+            ids.pop_back();
+        }
+    }
+    void reset(const std::vector<gpt_vocab::id> & last_n_tokens, int repeat, int n_vocab)
+    {
+        for(auto id : ids)
+        {
+            counts[id] = 0;
+        }
+        ids.clear();
+        counts.resize(n_vocab, 0);
+        index.resize(n_vocab, 0);
+        n_repeat = std::min(repeat, (int)last_n_tokens.size());
+        for(int i=last_n_tokens.size()-n_repeat;i<last_n_tokens.size();++i)
+        {
+            add(last_n_tokens[i]);
+        }
+    }
+    //appends to last_n_tokens the same way the generation loop does, dropping the oldest token
+    void push(std::vector<gpt_vocab::id> & last_n_tokens, gpt_vocab::id id)
+    {
+        if(n_repeat > 0)
+        {
+            remove(last_n_tokens[last_n_tokens.size()-n_repeat]);
+            add(id);
+        }
+        last_n_tokens.erase(last_n_tokens.begin());
+        last_n_tokens.push_back(id);
+    }
+};
+
+//everything about one conversation. GGUF models can hold several of them at once, each slot has its own sequence in the KV cache
+struct kcpp_slot
+{
+    llama_seq_id seq_id = 0;
+    gpt_params params;
+    int n_past = 0;
+    std::vector<gpt_vocab::id> last_n_tokens;
+    std::vector<gpt_vocab::id> current_context_tokens;
+    std::vector<int> smartcontext;
+    std::vector<float> logits; //copied out of llama_ctx_v4 after each decode, before another slot overwrites them
+    std::vector<llama_token_data> candidates; //sampler buffer, reused for every token
+    kcpp_rep_pen_window rep_pen_window;
+    float mirostat_mu = 0;
+    bool mirostat_mu_set = false;
+
+    std::vector<std::string> stop_sequence;
+    std::vector<logit_bias> logit_biases;
+    int remaining_tokens = 0;
+    int stopper_unused_tokens = 0;
+    stop_reason last_stop_reason = stop_reason::INVALID;
+
+    llama_grammar * grammar = nullptr; //currently used grammar
+    grammar_parser::parse_state parsed_grammar;
+    std::string current_grammar = "";
+
+    std::vector<llava_image> llava_images;
+    std::string llava_composite_image_signature = ""; //for identifying when the llava images change, we need to invalidate the cache
+    int current_llava_identifier = LLAVA_TOKEN_IDENTIFIER_A;
+
+    bool generation_finished = true;
+    std::vector<std::string> generated_tokens;
+    std::mutex concat_output_mtx;
+    std::string concat_output = "";
+    std::string concat_output_reader_copy_poll = ""; //for streaming
+    std::string concat_output_reader_copy_res = ""; //for gen response
+};
+static std::vector<kcpp_slot> slots;
+
+//tokens of one slot waiting to be evaluated. whichever waiting thread runs the next batch fills in the result
+struct kcpp_decode_job
+{
+    kcpp_slot * slot = nullptr;
+    const gpt_vocab::id * tokens = nullptr;
+    int n_tokens = 0;
+    int n_past = 0;
+    int n_done = 0; //tokens already evaluated, prompts larger than a batch go in over several batches
+    bool finished = false;
+    bool ok = true;
+};
+static std::mutex batch_mtx;
+static std::condition_variable batch_cv;
+static std::deque<kcpp_decode_job *> batch_queue;
+static bool batch_running = false;
+static int batch_active_slots = 0; //slots inside their generation loop, a batch waits a moment for all of them to queue
+static llama_batch shared_batch = {};
+static int shared_batch_size = 0;
+
+//prompt prefix cache. processed prompts are copied into spare KV cache sequences numbered after the slots,
+//so a slot getting a prompt that starts like an earlier one (a shared system prompt, or a conversation that
+//moved to another slot) takes over those cells instead of processing the tokens again.
+//entries pushed out of memory go to disk when a directory is set, and are read back from there
+struct kcpp_prefix_entry
+{
+    std::vector<gpt_vocab::id> tokens;
+    uint64_t key = 0; //hash of the first prefix_cache_min tokens, only prompts starting the same way can use the entry
+    llama_seq_id seq_id = -1; //sequence holding the entry, -1 if it is only on disk
+    int disk_index = -1; //file number in prefix_cache_dir, -1 if it is only in memory
+    size_t disk_bytes = 0; //size of that file
+    int write_id = 0; //nonzero while the file is still being written in the background
+    int64_t last_used = 0;
+};
+static std::vector<kcpp_prefix_entry> prefix_cache;
+static int prefix_cache_seqs = 0;
+static std::string prefix_cache_dir = "";
+static std::string prefix_cache_identity = "";
+static int64_t prefix_cache_clock = 0;
+const int prefix_cache_min = 64; //shorter prefixes are not worth keeping
+const int prefix_cache_disk_files = 64;
+static size_t prefix_cache_disk_limit = 0; //bytes all the files together may take
+const int prefix_cache_write_queue = 2; //spills waiting for the disk, more are not written
+const uint32_t prefix_cache_magic = 0x5850434b; //KCPX
+const uint32_t prefix_cache_version = 1;
 
 inline bool IsNanCheck(float f)
 {
@@ -283,8 +412,8 @@ static void print_tok_vec_str(std::vector<int> &vec)
 llama_token sample_token(llama_token_data_array * candidates, std::mt19937 & rng)
 {
     llama_sample_softmax(nullptr, candidates);
-    std::vector<float> probs;
-    probs.reserve(candidates->size);
+    static thread_local std::vector<float> probs;
+    probs.clear();
     top_picks.clear();
     for (size_t i = 0; i < candidates->size; ++i) {
         probs.push_back(candidates->data[i].p);
@@ -398,42 +527,98 @@ void sample_top_a(llama_token_data_array * candidates, float a, size_t min_keep)
     candidates->size = last_idx;
 }
 
-void sample_rep_pen(int n_ctx, int rep_pen_range, float rep_pen, float presence_penalty, llama_token_data_array * candidates_p)
+static inline void apply_rep_pen(llama_token_data & cand, float penalty, float presence_penalty)
 {
-    auto last_n_repeat = std::min(std::min((int)last_n_tokens.size(), rep_pen_range), n_ctx);
+    // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
+    // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
+    if (cand.logit <= 0) {
+        cand.logit *= penalty;
+    } else {
+        cand.logit /= penalty;
+    }
 
-    const llama_token * last_tokens =  last_n_tokens.data() + last_n_tokens.size() - last_n_repeat;
-    size_t last_tokens_size = last_n_repeat;
+    cand.logit -= presence_penalty;
+}
+
+//only the tokens counted in the window are touched, not every candidate
+void sample_rep_pen(const kcpp_rep_pen_window & window, float rep_pen, float presence_penalty, llama_token_data_array * candidates_p)
+{
     llama_token_data_array * candidates = candidates_p;
     float penalty = rep_pen;
 
-    if (last_tokens_size == 0 || (penalty == 1.0f && presence_penalty==0)) {
+    if (window.ids.empty() || (penalty == 1.0f && presence_penalty==0)) {
         return;
     }
 
-    const int64_t t_start_sample_us = ggml_time_us();
-
-    for (size_t i = 0; i < candidates->size; ++i) {
-        const auto * token_iter = std::find(last_tokens, last_tokens + last_tokens_size, candidates->data[i].id);
-        if (token_iter == last_tokens + last_tokens_size) {
-            continue;
-        }
-
-        // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
-        // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (candidates->data[i].logit <= 0) {
-            candidates->data[i].logit *= penalty;
+    //candidates are still indexed by token id unless an earlier sampler has sorted or cut them
+    bool needs_scan = false;
+    for (auto id : window.ids) {
+        if (id < (llama_token)candidates->size && candidates->data[id].id == id) {
+            apply_rep_pen(candidates->data[id], penalty, presence_penalty);
         } else {
-            candidates->data[i].logit /= penalty;
+            needs_scan = true;
+        }
+    }
+    if (needs_scan) {
+        for (size_t i = 0; i < candidates->size; ++i) {
+            llama_token id = candidates->data[i].id;
+            if (id != (llama_token)i && window.counts[id] > 0) { //the ones in their own slot were done above
+                apply_rep_pen(candidates->data[i], penalty, presence_penalty);
+            }
         }
-
-        candidates->data[i].logit -= presence_penalty;
     }
 
     candidates->sorted = false;
 
 }
 
+//same cut as llama_sample_top_p, but unsorted candidates are only partially sorted,
+//growing the sorted front until it holds the wanted probability mass
+void sample_top_p(llama_token_data_array * candidates, float p, size_t min_keep)
+{
+    if (p >= 1.0f || candidates->sorted || candidates->size == 0) {
+        llama_sample_top_p(nullptr, candidates, p, min_keep);
+        return;
+    }
+
+    float max_l = candidates->data[0].logit;
+    for (size_t i = 1; i < candidates->size; ++i) {
+        max_l = std::max(max_l, candidates->data[i].logit);
+    }
+    float sum = 0.0f;
+    for (size_t i = 0; i < candidates->size; ++i) {
+        candidates->data[i].p = expf(candidates->data[i].logit - max_l);
+        sum += candidates->data[i].p;
+    }
+    for (size_t i = 0; i < candidates->size; ++i) {
+        candidates->data[i].p /= sum;
+    }
+
+    auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+    size_t sorted_n = 0;
+    size_t want = std::min(candidates->size, std::max((size_t)64, min_keep));
+    float cum_sum = 0.0f;
+    while (true) {
+        std::partial_sort(candidates->data + sorted_n, candidates->data + want, candidates->data + candidates->size, comp);
+        for (size_t i = sorted_n; i < want; ++i) {
+            cum_sum += candidates->data[i].p;
+            if (cum_sum >= p && i + 1 >= min_keep) {
+                candidates->size = i + 1;
+                candidates->sorted = true;
+                return;
+            }
+        }
+        if (want == candidates->size) {
+            break;
+        }
+        sorted_n = want;
+        want = std::min(candidates->size, want * 4);
+    }
+    candidates->sorted = true;
+}
+
 void sample_temperature(llama_token_data_array * candidates_p, float temp, float smoothing_factor)
 {
     if (temp <= 0)
@@ -488,19 +673,19 @@ void sample_grammar(FileFormat file_format, int32_t n_vocab, llama_token_data_ar
 
 }
 
-int SampleLogits(const float * logits, int n_ctx, int n_vocab, int rep_pen_range, float rep_pen, float presence_penalty, float top_k, float top_a, float top_p, float min_p, float typical_p, float tfs, float temp, std::mt19937 & rng,
+int SampleLogits(kcpp_slot & slot, const float * logits, int n_vocab, float rep_pen, float presence_penalty, float top_k, float top_a, float top_p, float min_p, float typical_p, float tfs, float temp, std::mt19937 & rng,
 int mirostat, float mirostat_tau, float mirostat_eta, const std::vector<samplers> & sampler_order, llama_grammar * grammar, float dynatemp_range, float dynatemp_exponent, float smoothing_factor)
 {
     int id = 0;
-    std::vector<llama_token_data> candidates;
-    candidates.reserve(n_vocab);
+    std::vector<llama_token_data> & candidates = slot.candidates;
+    candidates.resize(n_vocab);
     for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+        candidates[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
     }
 
-    for(int i=0;i<logit_biases.size();++i)
+    for(int i=0;i<slot.logit_biases.size();++i)
     {
-        auto & itm = logit_biases[i];
+        auto & itm = slot.logit_biases[i];
         candidates[itm.token_id].logit += itm.bias;
     }
 
@@ -512,17 +697,21 @@ int mirostat, float mirostat_tau, float mirostat_eta, const std::vector<samplers
 
     if (mirostat == 1 || mirostat == 2)
     {
-        static float mirostat_mu = 2.0f * mirostat_tau;
+        if (!slot.mirostat_mu_set)
+        {
+            slot.mirostat_mu = 2.0f * mirostat_tau;
+            slot.mirostat_mu_set = true;
+        }
         const int mirostat_m = 100;
-        sample_rep_pen(n_ctx, rep_pen_range, rep_pen, presence_penalty, &candidates_p);
+        sample_rep_pen(slot.rep_pen_window, rep_pen, presence_penalty, &candidates_p);
         sample_temperature(&candidates_p, temp, smoothing_factor);
         if (mirostat == 1)
         {
-            id = sample_token_mirostat(n_vocab, &candidates_p, rng, mirostat_tau, mirostat_eta, mirostat_m, &mirostat_mu);
+            id = sample_token_mirostat(n_vocab, &candidates_p, rng, mirostat_tau, mirostat_eta, mirostat_m, &slot.mirostat_mu);
         }
         else
         {
-            id = sample_token_mirostat_v2(&candidates_p, rng, mirostat_tau, mirostat_eta, &mirostat_mu);
+            id = sample_token_mirostat_v2(&candidates_p, rng, mirostat_tau, mirostat_eta, &slot.mirostat_mu);
         }
     }
     else
@@ -532,13 +721,16 @@ int mirostat, float mirostat_tau, float mirostat_eta, const std::vector<samplers
             switch (sampler_order[i])
             {
                 case KCPP_SAMPLER_TOP_K:
-                    llama_sample_top_k(nullptr, &candidates_p, top_k,1);
+                    if (top_k < candidates_p.size) //keeping everything would only sort the whole vocab
+                    {
+                        llama_sample_top_k(nullptr, &candidates_p, top_k,1);
+                    }
                     break;
                 case KCPP_SAMPLER_TOP_A:
                     sample_top_a(&candidates_p,top_a,1);
                     break;
                 case KCPP_SAMPLER_TOP_P:
-                    llama_sample_top_p(nullptr, &candidates_p, top_p,1);
+                    sample_top_p(&candidates_p, top_p,1);
                     llama_sample_min_p(nullptr, &candidates_p, min_p,1);
                     break;
                 case KCPP_SAMPLER_TFS:
@@ -564,7 +756,7 @@ int mirostat, float mirostat_tau, float mirostat_eta, const std::vector<samplers
                     }
                     break;
                 case KCPP_SAMPLER_REP_PEN:
-                    sample_rep_pen(n_ctx, rep_pen_range, rep_pen, presence_penalty, &candidates_p);
+                    sample_rep_pen(slot.rep_pen_window, rep_pen, presence_penalty, &candidates_p);
                     break;
                 default:
                     printf("\nSampleLogits: Unknown Sampler : %d",sampler_order[i]);
@@ -600,14 +792,15 @@ static void grammar_accept_token(FileFormat file_format, int32_t n_vocab, struct
     GGML_ASSERT(!grammar->stacks.empty());
 }
 
-static void load_grammar(const std::string & gammarstr)
+static void load_grammar(kcpp_slot & slot, const std::string & gammarstr)
 {
-    if(grammar!=nullptr) //on demand free when next grammar is loaded
+    if(slot.grammar!=nullptr) //on demand free when next grammar is loaded
     {
-        llama_grammar_free(grammar);
-        grammar = nullptr;
+        llama_grammar_free(slot.grammar);
+        slot.grammar = nullptr;
     }
 
+    grammar_parser::parse_state & parsed_grammar = slot.parsed_grammar;
     if (!gammarstr.empty()) {
         parsed_grammar = grammar_parser::parse(gammarstr.c_str());
         // will be empty (default) if there are parse errors
@@ -620,11 +813,11 @@ static void load_grammar(const std::string & gammarstr)
             grammar_parser::print_grammar(stderr, parsed_grammar);
         }
         std::vector<const llama_grammar_element *> grammar_rules(parsed_grammar.c_rules());
-        grammar = llama_grammar_init(grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
+        slot.grammar = llama_grammar_init(grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
     }
 }
 
-static bool kcpp_eval_image(llama_context * ctx_llama, float * img_embd, int num_img_tokens, int n_batch, int * n_past) {
+static bool kcpp_eval_image(llama_context * ctx_llama, llama_seq_id seq_id, float * img_embd, int num_img_tokens, int n_batch, int * n_past) {
     int n_embd  = llama_n_embd(llama_get_model(ctx_llama));
 
     for (int i = 0; i < num_img_tokens; i += n_batch) {
@@ -632,7 +825,7 @@ static bool kcpp_eval_image(llama_context * ctx_llama, float * img_embd, int num
         if (n_eval > n_batch) {
             n_eval = n_batch;
         }
-        llama_batch batch = {int32_t(n_eval), nullptr, (img_embd+i*n_embd), nullptr, nullptr, nullptr, nullptr, *n_past, 1, 0, };
+        llama_batch batch = {int32_t(n_eval), nullptr, (img_embd+i*n_embd), nullptr, nullptr, nullptr, nullptr, *n_past, 1, seq_id, };
         if (llama_decode(ctx_llama, batch)) {
             fprintf(stderr, "\n%s : failed to eval image\n", __func__);
             return false;
@@ -642,9 +835,937 @@ static bool kcpp_eval_image(llama_context * ctx_llama, float * img_embd, int num
     return true;
 }
 
+//evaluate one batch made of the next tokens of every queued slot. runs on the thread that built it
+static void kcpp_run_batch(std::vector<std::pair<kcpp_decode_job *,int>> & parts)
+{
+    std::lock_guard<std::mutex> lock(llama_ctx_mtx);
+    int n_total = 0;
+    for(auto & part : parts)
+    {
+        n_total += part.second;
+    }
+    if(n_total > shared_batch_size)
+    {
+        if(shared_batch_size > 0)
+        {
+            llama_batch_free(shared_batch);
+        }
+        shared_batch = llama_batch_init(n_total, 0, 1);
+        shared_batch_size = n_total;
+    }
+
+    llama_batch & batch = shared_batch;
+    int ret = 0;
+    while(true)
+    {
+        batch.n_tokens = 0;
+        for(auto & part : parts)
+        {
+            kcpp_decode_job * job = part.first;
+            for(int i=job->n_done;i<job->n_done+part.second;++i)
+            {
+                int n = batch.n_tokens;
+                batch.token[n] = job->tokens[i];
+                batch.pos[n] = job->n_past + i;
+                batch.n_seq_id[n] = 1;
+                batch.seq_id[n][0] = job->slot->seq_id;
+                batch.logits[n] = (i == job->n_tokens-1); //only the last token of a job gets sampled
+                ++batch.n_tokens;
+            }
+        }
+
+        ret = llama_decode(llama_ctx_v4, batch);
+        if(ret != 1 || batch.n_tokens <= 1)
+        {
+            break;
+        }
+
+        //no free run of cells is long enough for the whole batch, the sequences of the slots have fragmented the KV cache.
+        //retry with half of the tokens, single tokens are first in line. whatever is left out stays queued for the next batch
+        int budget = batch.n_tokens / 2;
+        for(auto & part : parts)
+        {
+            part.second = std::min(part.second, budget);
+            budget -= part.second;
+        }
+        parts.erase(std::remove_if(parts.begin(), parts.end(), [](const std::pair<kcpp_decode_job *,int> & part){ return part.second == 0; }), parts.end());
+        if(debugmode==1)
+        {
+            printf("\n[KV cache fragmented, retrying with %d tokens]", batch.n_tokens / 2);
+        }
+    }
+
+    bool ok = (ret == 0);
+    int n = 0;
+    for(auto & part : parts)
+    {
+        kcpp_decode_job * job = part.first;
+        n += part.second;
+        job->n_done += part.second;
+        if(!ok)
+        {
+            job->ok = false;
+            job->n_done = job->n_tokens;
+        }
+        else if(job->n_done == job->n_tokens)
+        {
+            const float * ctx_logits = llama_get_logits_ith(llama_ctx_v4, n-1);
+            job->slot->logits.assign(ctx_logits, ctx_logits + n_vocab);
+        }
+    }
+}
+
+//counts a slot as generating for as long as it is in scope
+struct kcpp_active_slot
+{
+    bool counted = false;
+    kcpp_active_slot(bool count) : counted(count)
+    {
+        if(counted)
+        {
+            std::lock_guard<std::mutex> lock(batch_mtx);
+            ++batch_active_slots;
+        }
+    }
+    ~kcpp_active_slot()
+    {
+        if(counted)
+        {
+            std::lock_guard<std::mutex> lock(batch_mtx);
+            --batch_active_slots;
+            batch_cv.notify_all();
+        }
+    }
+};
+
+//evaluate the tokens of a slot in its own sequence and keep the logits of the last one.
+//concurrent calls from different slots are combined into a single llama_batch, so every
+//generating slot advances by one token per forward pass and pending prompts fill the rest of it
+static bool kcpp_decode(kcpp_slot & slot, std::vector<gpt_vocab::id> & embd, int n_past)
+{
+    kcpp_decode_job job;
+    job.slot = &slot;
+    job.tokens = embd.data();
+    job.n_tokens = embd.size();
+    job.n_past = n_past;
+
+    std::unique_lock<std::mutex> lock(batch_mtx);
+    batch_queue.push_back(&job);
+    batch_cv.notify_all();
+    while(!job.finished)
+    {
+        if(batch_running)
+        {
+            batch_cv.wait(lock);
+            continue;
+        }
+
+        //nobody is decoding, so this thread builds and runs the next batch for everyone.
+        //give the other generating slots a moment to queue their next token first
+        batch_running = true;
+        batch_cv.wait_for(lock, std::chrono::milliseconds(5), []{ return (int)batch_queue.size() >= batch_active_slots; });
+
+        //single tokens from generating slots go first, prompt chunks fill whatever space is left
+        std::stable_partition(batch_queue.begin(), batch_queue.end(), [](kcpp_decode_job * j){ return j->n_tokens - j->n_done == 1; });
+        int budget = llama_n_batch(llama_ctx_v4);
+        std::vector<std::pair<kcpp_decode_job *,int>> parts;
+        for(auto * j : batch_queue)
+        {
+            if(budget <= 0)
+            {
+                break;
+            }
+            int take = std::min(j->n_tokens - j->n_done, budget);
+            parts.push_back(std::make_pair(j, take));
+            budget -= take;
+        }
+        lock.unlock();
+        kcpp_run_batch(parts);
+        lock.lock();
+
+        for(auto & part : parts)
+        {
+            kcpp_decode_job * j = part.first;
+            if(j->n_done == j->n_tokens)
+            {
+                j->finished = true;
+                batch_queue.erase(std::find(batch_queue.begin(), batch_queue.end(), j));
+            }
+        }
+        batch_running = false;
+        batch_cv.notify_all();
+    }
+    return job.ok;
+}
+
+static uint64_t prefix_cache_hash(const gpt_vocab::id * tokens, int count)
+{
+    uint64_t hash = 14695981039346656037ULL; //fnv-1a
+    for(int i=0;i<count;++i)
+    {
+        hash = (hash ^ (uint32_t)tokens[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+//image embeddings belong to the images of one slot rather than to their placeholder ids, so prefixes end before them
+static int prefix_cache_usable(const std::vector<gpt_vocab::id> & tokens)
+{
+    int count = 0;
+    while(count<tokens.size() && tokens[count]>=0)
+    {
+        ++count;
+    }
+    return count;
+}
+
+static int prefix_cache_match(const std::vector<gpt_vocab::id> & a, const std::vector<gpt_vocab::id> & b)
+{
+    size_t count = std::min(a.size(), b.size());
+    return std::mismatch(a.begin(), a.begin() + count, b.begin()).first - a.begin();
+}
+
+static std::string prefix_cache_path(int disk_index)
+{
+    return prefix_cache_dir + "/prefix_" + std::to_string(disk_index) + ".kcppkv";
+}
+
+//the cell holding each position of a sequence, empty if some position below count is missing
+static std::vector<int> prefix_cache_cells(const llama_kv_cache & kv, llama_seq_id seq_id, int count)
+{
+    std::vector<int> cells(count, -1);
+    for(uint32_t i=0;i<kv.size;++i)
+    {
+        const llama_kv_cell & cell = kv.cells[i];
+        if(cell.pos>=0 && cell.pos<count && cell.has_seq_id(seq_id))
+        {
+            cells[cell.pos] = i;
+        }
+    }
+    if(std::find(cells.begin(), cells.end(), -1) != cells.end())
+    {
+        cells.clear();
+    }
+    return cells;
+}
+
+//moves the rows of some cells between a KV tensor and a packed buffer, one copy per run of neighbouring cells
+static void prefix_cache_rows(ggml_tensor * tensor, uint8_t * packed, const std::vector<int> & cells, size_t row_size, size_t offset, bool to_tensor)
+{
+    for(size_t i=0;i<cells.size();)
+    {
+        size_t run = 1;
+        while(i+run<cells.size() && cells[i+run]==cells[i]+(int)run)
+        {
+            ++run;
+        }
+        if(to_tensor)
+        {
+            ggml_backend_tensor_set(tensor, packed + i*row_size, offset + cells[i]*row_size, run*row_size);
+        }
+        else
+        {
+            ggml_backend_tensor_get(tensor, packed + i*row_size, offset + cells[i]*row_size, run*row_size);
+        }
+        i += run;
+    }
+}
+
+//the size of a file holding some tokens, see prefix_cache_serialize for the layout
+static size_t prefix_cache_file_bytes(size_t n_tokens)
+{
+    const llama_kv_cache & kv = llama_ctx_v4->kv_self;
+    const llama_hparams & hparams = llama_ctx_v4->model.hparams;
+    size_t bytes = 9*sizeof(uint32_t) + prefix_cache_identity.size() + n_tokens*sizeof(gpt_vocab::id);
+    for(uint32_t il=0;il<hparams.n_layer;++il)
+    {
+        bytes += ggml_row_size(kv.k_l[il]->type, hparams.n_embd_k_gqa()) * n_tokens;
+        bytes += ggml_type_size(kv.v_l[il]->type) * n_tokens * hparams.n_embd_v_gqa();
+    }
+    return bytes;
+}
+
+//copies an entry out of the KV cache into the bytes of its file, so that writing them needs no lock.
+//file layout: header, identity, tokens, then per layer all K rows, then per layer all V rows with the tokens of each row together
+static bool prefix_cache_serialize(const kcpp_prefix_entry & entry, std::vector<uint8_t> & data)
+{
+    llama_kv_cache & kv = llama_ctx_v4->kv_self;
+    const llama_hparams & hparams = llama_ctx_v4->model.hparams;
+    const uint32_t n_tokens = entry.tokens.size();
+    const uint32_t n_embd_k = hparams.n_embd_k_gqa();
+    const uint32_t n_embd_v = hparams.n_embd_v_gqa();
+    std::vector<int> cells = prefix_cache_cells(kv, entry.seq_id, n_tokens);
+    if(cells.empty() || ggml_blck_size(kv.type_v)!=1)
+    {
+        return false;
+    }
+
+    data.resize(prefix_cache_file_bytes(n_tokens));
+    uint8_t * out = data.data();
+    const uint32_t header[] = {prefix_cache_magic, prefix_cache_version, hparams.n_layer, n_embd_k, n_embd_v,
+    (uint32_t)kv.type_k, (uint32_t)kv.type_v, (uint32_t)prefix_cache_identity.size(), n_tokens};
+    memcpy(out, header, sizeof(header));
+    out += sizeof(header);
+    memcpy(out, prefix_cache_identity.data(), prefix_cache_identity.size());
+    out += prefix_cache_identity.size();
+    memcpy(out, entry.tokens.data(), n_tokens*sizeof(gpt_vocab::id));
+    out += n_tokens*sizeof(gpt_vocab::id);
+    for(uint32_t il=0;il<hparams.n_layer;++il)
+    {
+        const size_t k_row = ggml_row_size(kv.k_l[il]->type, n_embd_k);
+        prefix_cache_rows(kv.k_l[il], out, cells, k_row, 0, false);
+        out += k_row * n_tokens;
+    }
+    for(uint32_t il=0;il<hparams.n_layer;++il)
+    {
+        //V is stored transposed, every embedding dimension is a row over all the cells
+        const size_t v_elem = ggml_type_size(kv.v_l[il]->type);
+        for(uint32_t ir=0; ir<n_embd_v; ++ir)
+        {
+            prefix_cache_rows(kv.v_l[il], out, cells, v_elem, (size_t)ir*kv.size*v_elem, false);
+            out += v_elem * n_tokens;
+        }
+    }
+    return true;
+}
+
+//spilled entries are written by a background thread, so that generation does not wait for the disk.
+//an entry cannot be read back until its write_id is cleared, which happens once the file is complete
+struct kcpp_prefix_write
+{
+    int write_id = 0;
+    std::string path;
+    std::vector<uint8_t> data;
+};
+static std::mutex prefix_write_mtx;
+static std::condition_variable prefix_write_cv;
+static std::deque<kcpp_prefix_write> prefix_write_queue;
+static bool prefix_writer_started = false;
+static bool prefix_writer_busy = false;
+static int prefix_write_counter = 0;
+
+static void prefix_cache_writer()
+{
+    while(true)
+    {
+        kcpp_prefix_write job;
+        {
+            std::unique_lock<std::mutex> lock(prefix_write_mtx);
+            prefix_write_cv.wait(lock, []{ return !prefix_write_queue.empty(); });
+            job = std::move(prefix_write_queue.front());
+            prefix_write_queue.pop_front();
+            prefix_writer_busy = true;
+        }
+
+        //write next to the old file and swap it in at the end, so a crash leaves no half written file behind
+        const std::string temp = job.path + ".tmp";
+        FILE * file = fopen(temp.c_str(), "wb");
+        bool ok = (file && fwrite(job.data.data(), 1, job.data.size(), file)==job.data.size());
+        if(file)
+        {
+            ok = (fclose(file)==0) && ok;
+        }
+        remove(job.path.c_str());
+        ok = ok && (rename(temp.c_str(), job.path.c_str())==0);
+        if(!ok)
+        {
+            remove(temp.c_str());
+        }
+        std::vector<uint8_t>().swap(job.data);
+
+        {
+            std::lock_guard<std::mutex> lock(llama_ctx_mtx);
+            int idx = -1;
+            for(int i=0;i<prefix_cache.size();++i)
+            {
+                if(prefix_cache[i].write_id==job.write_id)
+                {
+                    idx = i;
+                }
+            }
+            if(idx>=0 && ok)
+            {
+                prefix_cache[idx].write_id = 0;
+            }
+            else
+            {
+                //the entry gave up its file while it was being written, or the write failed
+                remove(job.path.c_str());
+                if(idx>=0)
+                {
+                    printf("\n[Prefix Cache: Could not write %s]", job.path.c_str());
+                    prefix_cache[idx].disk_index = -1;
+                    prefix_cache[idx].disk_bytes = 0;
+                    prefix_cache[idx].write_id = 0;
+                    if(prefix_cache[idx].seq_id<0)
+                    {
+                        prefix_cache.erase(prefix_cache.begin() + idx);
+                    }
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(prefix_write_mtx);
+            prefix_writer_busy = false;
+        }
+        prefix_write_cv.notify_all();
+    }
+}
+
+//waits for the writes still in flight, so that a reload does not see half written files
+static void prefix_cache_flush()
+{
+    std::unique_lock<std::mutex> lock(prefix_write_mtx);
+    prefix_write_cv.wait(lock, []{ return prefix_write_queue.empty() && !prefix_writer_busy; });
+}
+
+//opens a file written for this model and reads its tokens, nullptr if the file cannot be used
+static FILE * prefix_cache_open(int disk_index, std::vector<gpt_vocab::id> & tokens)
+{
+    FILE * file = fopen(prefix_cache_path(disk_index).c_str(), "rb");
+    if(!file)
+    {
+        return nullptr;
+    }
+    const llama_kv_cache & kv = llama_ctx_v4->kv_self;
+    const llama_hparams & hparams = llama_ctx_v4->model.hparams;
+    const uint32_t expected[] = {prefix_cache_magic, prefix_cache_version, hparams.n_layer, hparams.n_embd_k_gqa(), hparams.n_embd_v_gqa(),
+    (uint32_t)kv.type_k, (uint32_t)kv.type_v, (uint32_t)prefix_cache_identity.size()};
+    uint32_t header[9];
+    bool ok = (fread(header, sizeof(header), 1, file)==1 && std::equal(expected, expected + 8, header));
+    if(ok)
+    {
+        std::string identity(header[7], '\0');
+        ok = (fread(&identity[0], 1, identity.size(), file)==identity.size() && identity==prefix_cache_identity);
+    }
+    if(ok)
+    {
+        tokens.resize(header[8]);
+        ok = (fread(tokens.data(), sizeof(gpt_vocab::id), tokens.size(), file)==tokens.size());
+    }
+    if(!ok)
+    {
+        fclose(file);
+        return nullptr;
+    }
+    return file;
+}
+
+//reads the file of an entry into free cells for a sequence.
+//0 on success, 1 if the KV cache has no run of free cells for them, -1 if the file cannot be used
+static int prefix_cache_read(const kcpp_prefix_entry & entry, llama_seq_id seq_id)
+{
+    std::vector<gpt_vocab::id> tokens;
+    FILE * file = prefix_cache_open(entry.disk_index, tokens);
+    if(!file || tokens!=entry.tokens)
+    {
+        if(file)
+        {
+            fclose(file);
+        }
+        return -1;
+    }
+    llama_kv_cache & kv = llama_ctx_v4->kv_self;
+    const llama_hparams & hparams = llama_ctx_v4->model.hparams;
+    const int n_tokens = tokens.size();
+    const uint32_t n_embd_k = hparams.n_embd_k_gqa();
+    const uint32_t n_embd_v = hparams.n_embd_v_gqa();
+
+    //claim the cells in one piece, the same way a batch of these tokens would have
+    llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+    batch.n_tokens = n_tokens;
+    for(int i=0;i<n_tokens;++i)
+    {
+        batch.pos[i] = i;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = seq_id;
+    }
+    bool ok = llama_kv_cache_find_slot(kv, batch);
+    llama_batch_free(batch);
+    if(!ok)
+    {
+        fclose(file);
+        return 1;
+    }
+    std::vector<int> cells(n_tokens);
+    for(int i=0;i<n_tokens;++i)
+    {
+        cells[i] = kv.head + i;
+    }
+    kv.head += n_tokens;
+    if(kv.head >= kv.size)
+    {
+        kv.head = 0;
+    }
+
+    std::vector<uint8_t> packed;
+    for(uint32_t il=0; ok && il<hparams.n_layer; ++il)
+    {
+        const size_t k_row = ggml_row_size(kv.k_l[il]->type, n_embd_k);
+        packed.resize(k_row * n_tokens);
+        ok = (fread(packed.data(), 1, packed.size(), file)==packed.size());
+        if(ok)
+        {
+            prefix_cache_rows(kv.k_l[il], packed.data(), cells, k_row, 0, true);
+        }
+    }
+    for(uint32_t il=0; ok && il<hparams.n_layer; ++il)
+    {
+        const size_t v_elem = ggml_type_size(kv.v_l[il]->type);
+        packed.resize(v_elem * n_tokens * n_embd_v);
+        ok = (fread(packed.data(), 1, packed.size(), file)==packed.size());
+        for(uint32_t ir=0; ok && ir<n_embd_v; ++ir)
+        {
+            prefix_cache_rows(kv.v_l[il], packed.data() + (size_t)ir*n_tokens*v_elem, cells, v_elem, (size_t)ir*kv.size*v_elem, true);
+        }
+    }
+    fclose(file);
+    if(!ok)
+    {
+        llama_kv_cache_seq_rm(llama_ctx_v4, seq_id, -1, -1);
+    }
+    return (ok ? 0 : -1);
+}
+
+//picks up the entries an earlier run with the same model left on disk, as many as fit under the size limit
+static void prefix_cache_load_index()
+{
+    size_t total = 0;
+    for(int i=0;i<prefix_cache_disk_files;++i)
+    {
+        kcpp_prefix_entry entry;
+        FILE * file = prefix_cache_open(i, entry.tokens);
+        if(!file)
+        {
+            continue;
+        }
+        fclose(file);
+        entry.disk_bytes = prefix_cache_file_bytes(entry.tokens.size());
+        if(entry.tokens.size()<prefix_cache_min || total+entry.disk_bytes>prefix_cache_disk_limit)
+        {
+            remove(prefix_cache_path(i).c_str());
+            continue;
+        }
+        total += entry.disk_bytes;
+        entry.key = prefix_cache_hash(entry.tokens.data(), prefix_cache_min);
+        entry.disk_index = i;
+        prefix_cache.push_back(entry);
+    }
+    if(prefix_cache.size()>0)
+    {
+        printf("Found %zu cached prompt prefixes in %s\n", prefix_cache.size(), prefix_cache_dir.c_str());
+    }
+}
+
+//frees the sequence of an entry. it stays known if it has a file on disk
+static void prefix_cache_release(int idx)
+{
+    llama_kv_cache_seq_rm(llama_ctx_v4, prefix_cache[idx].seq_id, -1, -1);
+    if(prefix_cache[idx].disk_index>=0)
+    {
+        prefix_cache[idx].seq_id = -1;
+    }
+    else
+    {
+        prefix_cache.erase(prefix_cache.begin() + idx);
+    }
+}
+
+//deletes the file of an entry, together with its write if that has not started yet. the entry goes too unless it is in memory
+static void prefix_cache_drop_file(int idx)
+{
+    kcpp_prefix_entry & entry = prefix_cache[idx];
+    if(entry.write_id!=0)
+    {
+        std::lock_guard<std::mutex> lock(prefix_write_mtx);
+        for(auto it=prefix_write_queue.begin(); it!=prefix_write_queue.end(); ++it)
+        {
+            if(it->write_id==entry.write_id)
+            {
+                prefix_write_queue.erase(it);
+                break;
+            }
+        }
+    }
+    remove(prefix_cache_path(entry.disk_index).c_str());
+    entry.disk_index = -1;
+    entry.disk_bytes = 0;
+    entry.write_id = 0;
+    if(entry.seq_id<0)
+    {
+        prefix_cache.erase(prefix_cache.begin() + idx);
+    }
+}
+
+//copies an entry in memory out for the writer if there is a directory for it, then frees its sequence.
+//room is made by dropping the file of an older copy of the same conversation, then the least recently used files
+static void prefix_cache_evict(int idx)
+{
+    if(prefix_cache_dir=="" || prefix_cache[idx].disk_index>=0)
+    {
+        prefix_cache_release(idx);
+        return;
+    }
+    kcpp_prefix_entry entry = prefix_cache[idx];
+    kcpp_prefix_write job;
+    bool queue_full = false;
+    {
+        std::lock_guard<std::mutex> lock(prefix_write_mtx);
+        queue_full = (prefix_write_queue.size()>=prefix_cache_write_queue);
+    }
+    entry.disk_bytes = prefix_cache_file_bytes(entry.tokens.size());
+    //the KV data is copied out here, under the context lock, and written to disk without it
+    const bool spill = (!queue_full && entry.disk_bytes<=prefix_cache_disk_limit && prefix_cache_serialize(entry, job.data));
+    llama_kv_cache_seq_rm(llama_ctx_v4, entry.seq_id, -1, -1);
+    prefix_cache.erase(prefix_cache.begin() + idx);
+    if(!spill)
+    {
+        return;
+    }
+
+    for(int i=0;i<prefix_cache.size();++i)
+    {
+        const kcpp_prefix_entry & other = prefix_cache[i];
+        if(other.disk_index>=0 && other.key==entry.key && prefix_cache_match(other.tokens, entry.tokens)==other.tokens.size())
+        {
+            prefix_cache_drop_file(i);
+            break;
+        }
+    }
+    while(true)
+    {
+        std::vector<bool> taken(prefix_cache_disk_files, false);
+        size_t total = entry.disk_bytes;
+        int oldest = -1;
+        for(int i=0;i<prefix_cache.size();++i)
+        {
+            const kcpp_prefix_entry & other = prefix_cache[i];
+            if(other.disk_index>=0)
+            {
+                taken[other.disk_index] = true;
+                total += other.disk_bytes;
+                if(oldest<0 || other.last_used<prefix_cache[oldest].last_used)
+                {
+                    oldest = i;
+                }
+            }
+        }
+        entry.disk_index = std::find(taken.begin(), taken.end(), false) - taken.begin();
+        if(entry.disk_index<prefix_cache_disk_files && total<=prefix_cache_disk_limit)
+        {
+            break;
+        }
+        prefix_cache_drop_file(oldest);
+    }
+
+    entry.seq_id = -1;
+    entry.write_id = ++prefix_write_counter;
+    job.write_id = entry.write_id;
+    job.path = prefix_cache_path(entry.disk_index);
+    prefix_cache.push_back(entry);
+    {
+        std::lock_guard<std::mutex> lock(prefix_write_mtx);
+        prefix_write_queue.push_back(std::move(job));
+        if(!prefix_writer_started)
+        {
+            prefix_writer_started = true;
+            std::thread(prefix_cache_writer).detach();
+        }
+    }
+    prefix_write_cv.notify_all();
+}
+
+//a free spare sequence, made by evicting the least recently used entry in memory if there is none
+static llama_seq_id prefix_cache_take_seq()
+{
+    const llama_seq_id first_seq = slots.size();
+    std::vector<bool> taken(prefix_cache_seqs, false);
+    int oldest = -1;
+    for(int i=0;i<prefix_cache.size();++i)
+    {
+        if(prefix_cache[i].seq_id>=0)
+        {
+            taken[prefix_cache[i].seq_id - first_seq] = true;
+            if(oldest<0 || prefix_cache[i].last_used<prefix_cache[oldest].last_used)
+            {
+                oldest = i;
+            }
+        }
+    }
+    int free_seq = std::find(taken.begin(), taken.end(), false) - taken.begin();
+    if(free_seq<prefix_cache_seqs)
+    {
+        return first_seq + free_seq;
+    }
+    llama_seq_id seq_id = prefix_cache[oldest].seq_id;
+    prefix_cache_evict(oldest);
+    return seq_id;
+}
+
+//keeps the prompt a slot has just processed in a spare sequence. the cells are shared, not copied
+static void prefix_cache_store(kcpp_slot & slot)
+{
+    const int count = prefix_cache_usable(slot.current_context_tokens);
+    if(prefix_cache_seqs<=0 || count<prefix_cache_min)
+    {
+        return;
+    }
+    std::vector<gpt_vocab::id> tokens(slot.current_context_tokens.begin(), slot.current_context_tokens.begin() + count);
+    const uint64_t key = prefix_cache_hash(tokens.data(), prefix_cache_min);
+    int replace = -1;
+    for(int i=0;i<prefix_cache.size();++i)
+    {
+        kcpp_prefix_entry & entry = prefix_cache[i];
+        if(entry.seq_id<0 || entry.key!=key)
+        {
+            continue;
+        }
+        int shared = prefix_cache_match(entry.tokens, tokens);
+        if(shared==count)
+        {
+            entry.last_used = ++prefix_cache_clock; //already cached, maybe as the start of a longer prompt
+            return;
+        }
+        if(shared==entry.tokens.size())
+        {
+            replace = i; //the same conversation went on, the longer prompt takes its place
+        }
+    }
+
+    llama_seq_id seq_id;
+    if(replace>=0)
+    {
+        seq_id = prefix_cache[replace].seq_id;
+        prefix_cache_release(replace);
+    }
+    else
+    {
+        seq_id = prefix_cache_take_seq();
+    }
+    llama_kv_cache_seq_cp(llama_ctx_v4, slot.seq_id, seq_id, 0, count);
+
+    kcpp_prefix_entry entry;
+    entry.tokens.swap(tokens);
+    entry.key = key;
+    entry.seq_id = seq_id;
+    entry.last_used = ++prefix_cache_clock;
+    prefix_cache.push_back(entry);
+}
+
+//before a prompt is processed: if a cached prefix covers more of it than the slot can keep from its own
+//context, the slot drops its context and takes the cached cells instead
+static void prefix_cache_restore(kcpp_slot & slot, const std::vector<gpt_vocab::id> & embd_inp)
+{
+    //the last prompt token is always processed, its logits are needed for sampling
+    const int usable = std::min(prefix_cache_usable(embd_inp), (int)embd_inp.size() - 1);
+    if(prefix_cache.empty() || usable<prefix_cache_min)
+    {
+        return;
+    }
+
+    //the common start, plus the run context shifting or smart context could still recover
+    std::vector<gpt_vocab::id> & current = slot.current_context_tokens;
+    int own = prefix_cache_match(current, embd_inp);
+    if(useContextShift && own<current.size() && own<embd_inp.size())
+    {
+        own += LongestCommonSubstring(current.data() + own, current.size() - own, embd_inp.data() + own, embd_inp.size() - own).length;
+    }
+    if(useSmartContext && slot.smartcontext.size()>0)
+    {
+        own = std::max(own, LongestCommonSubstring(slot.smartcontext.data(), slot.smartcontext.size(), embd_inp.data(), embd_inp.size()).length);
+    }
+
+    const uint64_t key = prefix_cache_hash(embd_inp.data(), prefix_cache_min);
+    auto find_best = [&](int & best_len)
+    {
+        int best = -1;
+        best_len = 0;
+        for(int i=0;i<prefix_cache.size();++i)
+        {
+            const kcpp_prefix_entry & entry = prefix_cache[i];
+            if(entry.key!=key || (entry.seq_id<0 && entry.write_id!=0))
+            {
+                continue;
+            }
+            const int len = std::min(prefix_cache_match(entry.tokens, embd_inp), usable);
+            const int needed = own + (entry.seq_id>=0 ? 1 : prefix_cache_min); //reading from disk has to be worth it
+            if(len>=needed && (len>best_len || (len==best_len && entry.seq_id>=0)))
+            {
+                best = i;
+                best_len = len;
+            }
+        }
+        return best;
+    };
+    int best_len = 0;
+    int best = find_best(best_len);
+    if(best<0)
+    {
+        return;
+    }
+
+    llama_seq_id seq_id = -1;
+    if(prefix_cache[best].seq_id<0)
+    {
+        //a file is read into a spare sequence first, so that a failed read leaves the slot as it was.
+        //making room for it can drop files and hand their numbers to new spills, so the entry is chosen again
+        prefix_cache[best].last_used = ++prefix_cache_clock;
+        seq_id = prefix_cache_take_seq();
+        best = find_best(best_len);
+        if(best<0)
+        {
+            return;
+        }
+    }
+
+    prefix_cache[best].last_used = ++prefix_cache_clock;
+    const bool from_disk = (prefix_cache[best].seq_id<0);
+    if(from_disk)
+    {
+        //the entry stays in memory afterwards, like any other recently used one
+        const int disk_index = prefix_cache[best].disk_index;
+        int res = prefix_cache_read(prefix_cache[best], seq_id);
+        if(res!=0)
+        {
+            printf("\n[Prefix Cache: %s %s]", (res<0 ? "Could not read" : "No room in the KV cache for"), prefix_cache_path(disk_index).c_str());
+            if(res<0)
+            {
+                prefix_cache_drop_file(best);
+            }
+            return;
+        }
+        prefix_cache[best].seq_id = seq_id;
+    }
+
+    llama_kv_cache_seq_rm(llama_ctx_v4, slot.seq_id, -1, -1);
+    llama_kv_cache_seq_cp(llama_ctx_v4, prefix_cache[best].seq_id, slot.seq_id, 0, best_len);
+    current.assign(embd_inp.begin(), embd_inp.begin() + best_len);
+    slot.smartcontext.clear();
+    printf("\n[Prefix Cache: Reused %d tokens%s]", best_len, (from_disk ? " from disk" : ""));
+}
+
+//a context shift moves the cells of a slot to new positions. cached prefixes sharing those cells would be
+//moved along with them, so they are cut off where the shifted part begins
+static void prefix_cache_unshare(llama_seq_id seq_id, int pos)
+{
+    const llama_kv_cache & kv = llama_ctx_v4->kv_self;
+    for(int i=0;i<prefix_cache.size();)
+    {
+        kcpp_prefix_entry & entry = prefix_cache[i];
+        bool shared = false;
+        for(uint32_t c=0; entry.seq_id>=0 && pos<entry.tokens.size() && c<kv.size && !shared; ++c)
+        {
+            const llama_kv_cell & cell = kv.cells[c];
+            shared = (cell.pos>=pos && cell.has_seq_id(seq_id) && cell.has_seq_id(entry.seq_id));
+        }
+        if(shared)
+        {
+            if(entry.disk_index>=0)
+            {
+                //the file keeps the whole prompt, only the copy in memory is cut
+                kcpp_prefix_entry on_disk = entry;
+                on_disk.seq_id = -1;
+                entry.disk_index = -1;
+                entry.disk_bytes = 0;
+                entry.write_id = 0;
+                prefix_cache.push_back(on_disk);
+            }
+            kcpp_prefix_entry & cut = prefix_cache[i];
+            llama_kv_cache_seq_rm(llama_ctx_v4, cut.seq_id, pos, -1);
+            cut.tokens.resize(pos);
+            if(pos<prefix_cache_min)
+            {
+                prefix_cache_release(i);
+                continue;
+            }
+        }
+        ++i;
+    }
+}
+
+//gives a slot its own copy of the cells from position p0 on that it still shares with other sequences, so that a
+//context shift of this slot leaves the positions and keys of the others alone. false if there is no room for the copy
+static bool kcpp_kv_detach(llama_seq_id seq_id, int p0)
+{
+    llama_kv_cache & kv = llama_ctx_v4->kv_self;
+    const llama_hparams & hparams = llama_ctx_v4->model.hparams;
+    std::vector<int> src;
+    for(uint32_t i=0;i<kv.size;++i)
+    {
+        const llama_kv_cell & cell = kv.cells[i];
+        if(cell.pos>=p0 && cell.seq_id.size()>1 && cell.has_seq_id(seq_id))
+        {
+            src.push_back(i);
+        }
+    }
+    if(src.empty())
+    {
+        return true;
+    }
+    if(ggml_blck_size(kv.type_v)!=1)
+    {
+        return false;
+    }
+
+    //claim free cells in one piece, the same way a batch of these tokens would have
+    const int count = src.size();
+    llama_batch batch = llama_batch_init(count, 0, 1);
+    batch.n_tokens = count;
+    for(int i=0;i<count;++i)
+    {
+        batch.pos[i] = kv.cells[src[i]].pos;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = seq_id;
+    }
+    bool ok = llama_kv_cache_find_slot(kv, batch);
+    llama_batch_free(batch);
+    if(!ok)
+    {
+        return false;
+    }
+    std::vector<int> dst(count);
+    for(int i=0;i<count;++i)
+    {
+        dst[i] = kv.head + i;
+        kv.cells[dst[i]].delta = kv.cells[src[i]].delta;
+    }
+    kv.head += count;
+    if(kv.head >= kv.size)
+    {
+        kv.head = 0;
+    }
+
+    const uint32_t n_embd_k = hparams.n_embd_k_gqa();
+    const uint32_t n_embd_v = hparams.n_embd_v_gqa();
+    std::vector<uint8_t> packed;
+    for(uint32_t il=0; il<hparams.n_layer; ++il)
+    {
+        const size_t k_row = ggml_row_size(kv.k_l[il]->type, n_embd_k);
+        packed.resize(k_row * count);
+        prefix_cache_rows(kv.k_l[il], packed.data(), src, k_row, 0, false);
+        prefix_cache_rows(kv.k_l[il], packed.data(), dst, k_row, 0, true);
+
+        const size_t v_elem = ggml_type_size(kv.v_l[il]->type);
+        packed.resize(v_elem * count * n_embd_v);
+        for(uint32_t ir=0; ir<n_embd_v; ++ir)
+        {
+            prefix_cache_rows(kv.v_l[il], packed.data() + (size_t)ir*count*v_elem, src, v_elem, (size_t)ir*kv.size*v_elem, false);
+        }
+        for(uint32_t ir=0; ir<n_embd_v; ++ir)
+        {
+            prefix_cache_rows(kv.v_l[il], packed.data() + (size_t)ir*count*v_elem, dst, v_elem, (size_t)ir*kv.size*v_elem, true);
+        }
+    }
+    for(int i=0;i<count;++i)
+    {
+        kv.cells[src[i]].seq_id.erase(seq_id); //the other sequences still hold these cells
+    }
+    return true;
+}
+
 //given an old GGUF context and a new context that has some middle portion removed,
 //find and remove the middle portion from the old context from the KV. Does not fast forward after this destructive action
-void PurgeMissingTokens(llama_context * ctx, std::vector<int> &current_context_tokens, std::vector<int> &new_context_tokens, const int genamt, const int nctx)
+void PurgeMissingTokens(llama_context * ctx, llama_seq_id seq_id, std::vector<int> &current_context_tokens, std::vector<int> &new_context_tokens, const int genamt, const int nctx)
 {
     //scan from start old and new ctx, until first mismatch found, save as p0
     //check remaining old and new ctx for longest common subseq, which needs to be at 256 tokens
@@ -684,21 +1805,31 @@ void PurgeMissingTokens(llama_context * ctx, std::vector<int> &current_context_t
     //at least this many tokens need to match, otherwise don't bother trimming
     const int LCSTokThreshold = std::max(std::min((new_tokens_len - trimstart) - (genamt+SlackAllowance), (int)(nctx*0.45)), ShortfallThreshold-SlackAllowance);
 
-    auto curr_ctx_without_memory = std::vector<int>(current_context_tokens.begin() + trimstart, current_context_tokens.end());
-    auto new_ctx_without_memory = std::vector<int>(new_context_tokens.begin() + trimstart, new_context_tokens.end());
+    //compare both contexts past the memory in place, without copying them
+    common_span shared = LongestCommonSubstring(current_context_tokens.data() + trimstart, current_context_tokens.size() - trimstart,
+    new_context_tokens.data() + trimstart, new_tokens_len - trimstart);
 
-    auto shared = LongestCommonSubseq(curr_ctx_without_memory, new_ctx_without_memory);
-
-    if (shared.size() > LCSTokThreshold && ArrStartWith(new_ctx_without_memory, shared)) // enough tokens in common
+    if (shared.length > LCSTokThreshold && shared.b_start == 0) // enough tokens in common, right after the memory of the new context
     {
-        int found = ArrFindIndexOf(current_context_tokens,shared);
+        //first place the shared run appears in the old context, it cannot be later than the match itself
+        auto shared_begin = current_context_tokens.begin() + trimstart + shared.a_start;
+        int found = std::search(current_context_tokens.begin(), shared_begin + shared.length, shared_begin, shared_begin + shared.length) - current_context_tokens.begin();
         if(found>=0 && found > trimstart)
         {
 
             //extract the unwanted tokens out from context and KV
             int diff = found - trimstart;
-            llama_kv_cache_seq_rm(llama_ctx_v4, 0, trimstart, trimstart + diff);
-            llama_kv_cache_seq_add(llama_ctx_v4, 0, trimstart + diff, -1, -diff);
+
+            //the shift moves every sequence in the shifted cells. cached prefixes give up that part, other slots keep
+            //it and this slot takes a copy. without room for the copy the tokens are processed again instead
+            prefix_cache_unshare(seq_id, trimstart + diff);
+            if(!kcpp_kv_detach(seq_id, trimstart + diff))
+            {
+                printf("\n[Context Shifting: Skipped, no room to copy the KV cells shared with another slot]");
+                return;
+            }
+            llama_kv_cache_seq_rm(ctx, seq_id, trimstart, trimstart + diff);
+            llama_kv_cache_seq_add(ctx, seq_id, trimstart + diff, -1, -diff);
 
             for (size_t i = trimstart + diff; i < current_context_tokens.size() - 1; i++)
             {
@@ -753,6 +1884,34 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
     useContextShift = inputs.use_contextshift;
     debugmode = inputs.debugmode;
 
+    int n_slots = (inputs.slots < 1 ? 1 : inputs.slots);
+    if(n_slots > 1 && (!isGguf || file_format_meta.model_architecture==GGUFArch::ARCH_MAMBA))
+    {
+        printf("Warning: Only GGUF transformer models can generate in multiple slots. Using a single slot.\n");
+        n_slots = 1;
+    }
+    slots = std::vector<kcpp_slot>(n_slots);
+    for(int i=0;i<n_slots;++i)
+    {
+        slots[i].seq_id = i;
+    }
+    prefix_cache_flush();
+    prefix_cache.clear();
+    prefix_cache_seqs = 0;
+    prefix_cache_dir = "";
+    if(inputs.prefix_cache > 0)
+    {
+        if(!isGguf || file_format_meta.model_architecture==GGUFArch::ARCH_MAMBA)
+        {
+            printf("Warning: Only GGUF transformer models can cache prompt prefixes. Prefix cache disabled.\n");
+        }
+        else
+        {
+            prefix_cache_seqs = inputs.prefix_cache;
+            prefix_cache_dir = (inputs.prefix_cache_dir ? inputs.prefix_cache_dir : "");
+            prefix_cache_disk_limit = (size_t)(inputs.prefix_cache_disk_mb > 0 ? inputs.prefix_cache_disk_mb : 8192) * 1024 * 1024;
+        }
+    }
 
     auto clamped_max_context_length = inputs.max_context_length;
 
@@ -970,6 +2129,14 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         {
            llama_ctx_params.n_ctx += extra_context_handle_fragmentation;
         }
+        const int n_seqs = slots.size() + prefix_cache_seqs;
+        if(n_seqs>1)
+        {
+            //every slot and every cached prefix can fill a context, they all live in the same KV cache
+            printf("Using %zu generation slots and %d cached prompt prefixes, KV cache sized for %d tokens.\n", slots.size(), prefix_cache_seqs, llama_ctx_params.n_ctx * n_seqs);
+            llama_ctx_params.n_ctx *= n_seqs;
+            llama_ctx_params.n_seq_max = n_seqs;
+        }
 
         llama_ctx_params.seed = -1;
         llama_ctx_params.offload_kqv = !inputs.low_vram;
@@ -1114,6 +2281,13 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
         {
             printf("\nLLAMA EVAL returned nonzero!\n");
         }
+
+        if(prefix_cache_dir!="")
+        {
+            //keys depend on the weights and the rope settings, files made with anything else are ignored
+            prefix_cache_identity = modelname + "|" + lora_filename + "|" + std::to_string(llama_ctx_params.rope_freq_base) + "|" + std::to_string(llama_ctx_params.rope_freq_scale);
+            prefix_cache_load_index();
+        }
         return ModelLoadResult::SUCCESS;
     }
     else if (file_format == FileFormat::RWKV_1 || file_format==FileFormat::RWKV_2)
@@ -1482,14 +2656,18 @@ ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in
 
 }
 
-bool gpttype_generate_abort()
+bool gpttype_generate_abort(int slot)
 {
     if(kcpp_params==nullptr)
     {
         printf("\nWarning: KCPP text generation not initialized!\n");
     }
-    stopper_unused_tokens = remaining_tokens;
-    remaining_tokens = 0;
+    if(slot<0 || slot>=slots.size())
+    {
+        return false;
+    }
+    slots[slot].stopper_unused_tokens = slots[slot].remaining_tokens;
+    slots[slot].remaining_tokens = 0;
     return true;
 }
 
@@ -1514,17 +2692,61 @@ std::vector<int> gpttype_get_token_arr(const std::string & input)
     return toks;
 }
 
-const std::string & gpttype_get_pending_output()
+const std::string & gpttype_get_pending_output(int slot)
 {
-    if(kcpp_params==nullptr)
+    static const std::string empty_output = "";
+    if(kcpp_params==nullptr || slot<0 || slot>=slots.size())
     {
         printf("\nWarning: KCPP text generation not initialized!\n");
-        return concat_output_reader_copy_poll;
+        return empty_output;
     }
-    concat_output_mtx.lock();
-    concat_output_reader_copy_poll = concat_output;
-    concat_output_mtx.unlock();
-    return concat_output_reader_copy_poll;
+    kcpp_slot & s = slots[slot];
+    s.concat_output_mtx.lock();
+    s.concat_output_reader_copy_poll = s.concat_output;
+    s.concat_output_mtx.unlock();
+    return s.concat_output_reader_copy_poll;
+}
+
+int gpttype_get_slot_count()
+{
+    return slots.size();
+}
+
+bool gpttype_has_finished(int slot)
+{
+    if(slot<0 || slot>=slots.size())
+    {
+        return true;
+    }
+    return slots[slot].generation_finished;
+}
+
+int gpttype_get_stream_count(int slot)
+{
+    if(slot<0 || slot>=slots.size())
+    {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(slots[slot].concat_output_mtx);
+    return slots[slot].generated_tokens.size();
+}
+
+//copied out because the generating thread may grow the token list while the caller reads it
+const char * gpttype_get_stream_token(int slot, int idx)
+{
+    static thread_local std::string token_reader_copy = "";
+    if(slot<0 || slot>=slots.size())
+    {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(slots[slot].concat_output_mtx);
+    auto & toks = slots[slot].generated_tokens;
+    if(idx<0 || idx>=toks.size())
+    {
+        return nullptr;
+    }
+    token_reader_copy = toks[idx];
+    return token_reader_copy.c_str();
 }
 
 int GetThreadsToUse(bool blasmode)
@@ -1552,9 +2774,32 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         printf("\nWarning: KCPP text generation not initialized!\n");
         output.text = nullptr;
         output.status = 0;
-        generation_finished = true;
         return output;
     }
+    if(inputs.slot<0 || inputs.slot>=slots.size())
+    {
+        printf("\nWarning: Generation slot %d does not exist, only %zu slots loaded!\n",inputs.slot,slots.size());
+        output.text = nullptr;
+        output.status = 0;
+        return output;
+    }
+
+    //everything below works on the state of this one slot, other slots may be generating at the same time
+    kcpp_slot & slot = slots[inputs.slot];
+    gpt_params & params = slot.params;
+    params = *kcpp_params;
+    int & n_past = slot.n_past;
+    std::vector<gpt_vocab::id> & last_n_tokens = slot.last_n_tokens;
+    std::vector<gpt_vocab::id> & current_context_tokens = slot.current_context_tokens;
+    std::vector<int> & smartcontext = slot.smartcontext;
+    std::vector<std::string> & stop_sequence = slot.stop_sequence;
+    int & remaining_tokens = slot.remaining_tokens;
+    int & stopper_unused_tokens = slot.stopper_unused_tokens;
+    std::vector<llava_image> & llava_images = slot.llava_images;
+    std::string & llava_composite_image_signature = slot.llava_composite_image_signature;
+    int & current_llava_identifier = slot.current_llava_identifier;
+    std::mutex & concat_output_mtx = slot.concat_output_mtx;
+    std::string & concat_output = slot.concat_output;
 
     if(debugmode==1 && file_format == FileFormat::GGUF_GENERIC)
     {
@@ -1563,10 +2808,12 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
 
     concat_output_mtx.lock();
     concat_output = "";
-    concat_output_reader_copy_poll = "";
-    concat_output_reader_copy_res = "";
+    slot.concat_output_reader_copy_poll = "";
+    slot.concat_output_reader_copy_res = "";
+    slot.generated_tokens.clear(); // New Generation, new tokens
     concat_output_mtx.unlock();
-    last_stop_reason = stop_reason::OUT_OF_TOKENS;
+    slot.last_stop_reason = stop_reason::OUT_OF_TOKENS;
+    slot.mirostat_mu_set = false;
     stop_sequence.clear();
     for(int x=0;x<stop_token_max;++x)
     {
@@ -1577,14 +2824,14 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         }
     }
 
-    logit_biases.clear();
+    slot.logit_biases.clear();
     for(int x=0;x<logit_bias_max;++x)
     {
         int32_t t_id = inputs.logit_biases[x].token_id;
         float bias = inputs.logit_biases[x].bias;
         if(t_id >= 0 && t_id < n_vocab && bias!=0)
         {
-           logit_biases.push_back(inputs.logit_biases[x]);
+           slot.logit_biases.push_back(inputs.logit_biases[x]);
         }
     }
 
@@ -1623,63 +2870,62 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         }
     }
 
-    kcpp_params->prompt = inputs.prompt;
-    kcpp_params->seed = inputs.seed;
-    kcpp_params->n_predict = inputs.max_length;
-    kcpp_params->top_k = inputs.top_k;
-    kcpp_params->top_p = inputs.top_p;
-    kcpp_params->min_p = inputs.min_p;
-    kcpp_params->typical_p = inputs.typical_p;
-    kcpp_params->tfs_z = inputs.tfs;
-    kcpp_params->temp = inputs.temperature;
-    kcpp_params->repeat_last_n = inputs.rep_pen_range;
-    kcpp_params->repeat_penalty = inputs.rep_pen;
-    kcpp_params->presence_penalty = inputs.presence_penalty;
-    kcpp_params->mirostat = inputs.mirostat;
-    kcpp_params->mirostat_eta = inputs.mirostat_eta;
-    kcpp_params->mirostat_tau = inputs.mirostat_tau;
-    kcpp_params->dynatemp_range = inputs.dynatemp_range;
-    kcpp_params->dynatemp_exponent = inputs.dynatemp_exponent;
-    kcpp_params->n_ctx = inputs.max_context_length;
-    kcpp_params->smoothing_factor = inputs.smoothing_factor;
+    params.prompt = inputs.prompt;
+    params.seed = inputs.seed;
+    params.n_predict = inputs.max_length;
+    params.top_k = inputs.top_k;
+    params.top_p = inputs.top_p;
+    params.min_p = inputs.min_p;
+    params.typical_p = inputs.typical_p;
+    params.tfs_z = inputs.tfs;
+    params.temp = inputs.temperature;
+    params.repeat_last_n = inputs.rep_pen_range;
+    params.repeat_penalty = inputs.rep_pen;
+    params.presence_penalty = inputs.presence_penalty;
+    params.mirostat = inputs.mirostat;
+    params.mirostat_eta = inputs.mirostat_eta;
+    params.mirostat_tau = inputs.mirostat_tau;
+    params.dynatemp_range = inputs.dynatemp_range;
+    params.dynatemp_exponent = inputs.dynatemp_exponent;
+    params.n_ctx = inputs.max_context_length;
+    params.smoothing_factor = inputs.smoothing_factor;
 
     bool stream_sse = inputs.stream_sse;
 
     bool allow_regular_prints = (debugmode!=-1 && !inputs.quiet) || debugmode >= 1;
 
-    generation_finished = false; // Set current generation status
-    generated_tokens.clear(); // New Generation, new tokens
+    slot.generation_finished = false; // Set current generation status
 
     std::string grammarstr = inputs.grammar;
     bool grammar_retain_state = inputs.grammar_retain_state;
     if(grammar_retain_state)
     {
-        if(grammarstr=="" || current_grammar!=grammarstr) //if grammar is identical, retain state
+        if(grammarstr=="" || slot.current_grammar!=grammarstr) //if grammar is identical, retain state
         {
-            load_grammar(grammarstr);
+            load_grammar(slot, grammarstr);
         }
     }
     else
     {
-        load_grammar(grammarstr);
+        load_grammar(slot, grammarstr);
     }
-    current_grammar = grammarstr;
+    slot.current_grammar = grammarstr;
 
 
-    if (kcpp_params->repeat_last_n < 1)
+    if (params.repeat_last_n < 1)
     {
-        kcpp_params->repeat_last_n = 1;
+        params.repeat_last_n = 1;
     }
-    if (kcpp_params->top_k < 1)
+    if (params.top_k < 1)
     {
-        kcpp_params->top_k = n_vocab; // all tokens in the vocabulary should be considered if top k is disabled
+        params.top_k = n_vocab; // all tokens in the vocabulary should be considered if top k is disabled
     }
-    if (kcpp_params->seed <= 0 || kcpp_params->seed==0xFFFFFFFF)
+    if (params.seed <= 0 || params.seed==0xFFFFFFFF)
     {
-        kcpp_params->seed = (((uint32_t)time(NULL)) % 1000000u);
+        params.seed = (((uint32_t)time(NULL)) % 1000000u);
         if(debugmode==1)
         {
-            printf("\nUsing Seed: %d",kcpp_params->seed);
+            printf("\nUsing Seed: %d",params.seed);
         }
     }
 
@@ -1688,12 +2934,13 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     std::vector<int> embd_inp_mem; //for storing added memory
     std::vector<int> llava_mem; //for storing dummy tokens that will be consumed by llava
 
-    int32_t nctx = kcpp_params->n_ctx;
+    int32_t nctx = params.n_ctx;
 
-    TokenizeString(kcpp_params->prompt, embd_inp, file_format);
+    TokenizeString(params.prompt, embd_inp, file_format);
 
     if(clp_ctx!=nullptr && clp_img_data!=nullptr)
     {
+        std::lock_guard<std::mutex> lock(llama_ctx_mtx); //clp_img_data is shared by all slots
         for(int i=0;i<llava_images.size();++i)
         {
             std::string llava_image = llava_images[i].b64data;
@@ -1706,7 +2953,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
             else
             {
                 llava_images[i].clp_image_tokens = 0;
-                if (!llava_image_embed_make_with_clip_img(clp_ctx, kcpp_params->n_threads, clp_img_data, &llava_images[i].clp_img_embd, &llava_images[i].clp_image_tokens)) {
+                if (!llava_image_embed_make_with_clip_img(clp_ctx, params.n_threads, clp_img_data, &llava_images[i].clp_img_embd, &llava_images[i].clp_image_tokens)) {
                     printf("\nError: Clip image %d failed to create embd!",i);
                 }
                 if(debugmode==1)
@@ -1733,12 +2980,12 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     }
 
     //truncate to front of the prompt if its too long
-    if (embd_inp.size() + kcpp_params->n_predict > nctx)
+    if (embd_inp.size() + params.n_predict > nctx)
     {
         //get bos token
         std::vector<int> bos;
         TokenizeString("", bos, file_format);
-        int offset = embd_inp.size() - nctx + kcpp_params->n_predict;
+        int offset = embd_inp.size() - nctx + params.n_predict;
         embd_inp = std::vector<int>(embd_inp.begin() + offset, embd_inp.end());
         //replace bos into front if exists
         if(bos.size()>0 && embd_inp.size()>0)
@@ -1749,7 +2996,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
 
     if(llava_mem.size()>0) //stick the llava mem before the added mem
     {
-        if(llava_mem.size() + kcpp_params->n_predict + 4 > nctx)
+        if(llava_mem.size() + params.n_predict + 4 > nctx)
         {
             printf("\nWarning: Too many LLaVA tokens, max context exceeded! They will be ignored!\n");
         }
@@ -1772,9 +3019,9 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
             }
 
              //shorten memory if needed
-            if (embd_inp_mem.size() + kcpp_params->n_predict + 4 > nctx)
+            if (embd_inp_mem.size() + params.n_predict + 4 > nctx)
             {
-                int limit = nctx - (kcpp_params->n_predict + 4);
+                int limit = nctx - (params.n_predict + 4);
                 if (embd_inp_mem.size() > limit) {
                     embd_inp_mem.resize(limit);
                 }
@@ -1793,9 +3040,9 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         }
 
         //shorten memory if needed
-        if (embd_inp_mem.size() + kcpp_params->n_predict + 4 > nctx)
+        if (embd_inp_mem.size() + params.n_predict + 4 > nctx)
         {
-            int offset = embd_inp_mem.size() - nctx + kcpp_params->n_predict + 4;
+            int offset = embd_inp_mem.size() - nctx + params.n_predict + 4;
             embd_inp_mem = std::vector<int>(embd_inp_mem.begin() + offset, embd_inp_mem.end());
             //replace bos into front if exists
             if(bos.size()>0 && embd_inp_mem.size()>0)
@@ -1806,7 +3053,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
 
         //shorten main prompt by trimming the front if needed
         int addmemtokens = embd_inp_mem.size();
-        int totalsize = (addmemtokens + embd_inp.size() + kcpp_params->n_predict);
+        int totalsize = (addmemtokens + embd_inp.size() + params.n_predict);
         if(totalsize > nctx)
         {
             int excess = totalsize - nctx;
@@ -1824,7 +3071,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     //determine how much npast we have to rewind from the current state
     std::vector<gpt_vocab::id> embd;
 
-    int last_n_size = kcpp_params->repeat_last_n;
+    int last_n_size = params.repeat_last_n;
     last_n_tokens.resize(last_n_size);
 
     std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
@@ -1851,26 +3098,33 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     else
     {
         bool triggersc = useSmartContext;
+        if(prefix_cache_seqs>0) //set at load, the entries themselves are only touched under the lock
+        {
+            std::lock_guard<std::mutex> lock(llama_ctx_mtx);
+            prefix_cache_restore(slot, embd_inp);
+        }
         if(useContextShift && (file_format == FileFormat::GGUF_GENERIC))
         {
-            PurgeMissingTokens(llama_ctx_v4, current_context_tokens, embd_inp, inputs.max_length, nctx);
+            std::lock_guard<std::mutex> lock(llama_ctx_mtx);
+            PurgeMissingTokens(llama_ctx_v4, slot.seq_id, current_context_tokens, embd_inp, inputs.max_length, nctx);
             triggersc = false;
         }
         ContextFastForward(current_context_tokens, embd_inp, n_past, last_n_tokens, nctx, smartcontext, triggersc, false);
         if(file_format == FileFormat::GGUF_GENERIC)
         {
-            llama_kv_cache_seq_rm(llama_ctx_v4, 0, n_past, -1);
+            std::lock_guard<std::mutex> lock(llama_ctx_mtx);
+            llama_kv_cache_seq_rm(llama_ctx_v4, slot.seq_id, n_past, -1);
         }
     }
 
-    bool blasmode = (embd_inp.size() >= 32 && ggml_cpu_has_blas() && kcpp_params->n_batch>=32);
+    bool blasmode = (embd_inp.size() >= 32 && ggml_cpu_has_blas() && params.n_batch>=32);
 
     current_context_tokens.resize(n_past);
 
-    remaining_tokens = kcpp_params->n_predict;
+    remaining_tokens = params.n_predict;
     stopper_unused_tokens = 0;
     int input_consumed = 0;
-    std::mt19937 rng(kcpp_params->seed);
+    std::mt19937 rng(params.seed);
 
     //prepare sampler order
     std::vector<samplers> sampler_order;
@@ -1939,6 +3193,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     }
 
     //prepare banned tokens
+    std::unique_lock<std::mutex> banned_lock(llama_ctx_mtx);
     if(banned_token_ids.size()==0 && banned_tokens.size()>0)
     {
         printf("\n[First Run] Banning %zu token sequences...",banned_tokens.size());
@@ -1956,6 +3211,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         }
         printf("\nBanned a total of %zu tokens.\n",banned_token_ids.size());
     }
+    banned_lock.unlock();
 
     if(allow_regular_prints)
     {
@@ -1972,6 +3228,9 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         printf("%s\n\n", RemoveBell(outstr).c_str());
     }
 
+    //while this slot generates, batches wait briefly for its next token instead of running without it
+    kcpp_active_slot active_slot(file_format == FileFormat::GGUF_GENERIC);
+
     while (remaining_tokens > 0)
     {
         gpt_vocab::id id = 0;
@@ -1999,7 +3258,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
             }
             else if(file_format == FileFormat::GGUF_GENERIC)
             {
-                evalres = (llama_decode(llama_ctx_v4, llama_batch_get_one(embd.data(), embdsize, n_past, 0))==0);
+                evalres = kcpp_decode(slot, embd, n_past);
             }
             else if(file_format==FileFormat::RWKV_1 || file_format==FileFormat::RWKV_2)
             {
@@ -2071,7 +3330,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                 fprintf(stderr, "\nFailed to predict at %d! Check your context buffer sizes!\n",n_past);
                 output.text = nullptr;
                 output.status = 0;
-                generation_finished = true;
+                slot.generation_finished = true;
                 return output;
             }
         }
@@ -2081,22 +3340,28 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
         if ((int)embd_inp.size() <= input_consumed)
         {
             // out of user input, sample next token
-            const float top_k = kcpp_params->top_k;
-            const float top_p = kcpp_params->top_p;
-            const float min_p = kcpp_params->min_p;
-            const float temp = kcpp_params->temp;
+            const float top_k = params.top_k;
+            const float top_p = params.top_p;
+            const float min_p = params.min_p;
+            const float temp = params.temp;
             const float top_a = inputs.top_a;
-            const float repeat_penalty = kcpp_params->repeat_penalty;
-            const float presence_penalty = kcpp_params->presence_penalty;
-            const float typical_p = kcpp_params->typical_p;
-            const float tfs_z = kcpp_params->tfs_z;
-            const float dynatemp_range = kcpp_params->dynatemp_range;
-            const float dynatemp_exponent = kcpp_params->dynatemp_exponent;
-            const float smoothing_factor = kcpp_params->smoothing_factor;
+            const float repeat_penalty = params.repeat_penalty;
+            const float presence_penalty = params.presence_penalty;
+            const float typical_p = params.typical_p;
+            const float tfs_z = params.tfs_z;
+            const float dynatemp_range = params.dynatemp_range;
+            const float dynatemp_exponent = params.dynatemp_exponent;
+            const float smoothing_factor = params.smoothing_factor;
 
             if (!startedsampling)
             {
                 startedsampling = true;
+                slot.rep_pen_window.reset(last_n_tokens, std::min(last_n_size, nctx), n_vocab);
+                if(prefix_cache_seqs>0)
+                {
+                    std::lock_guard<std::mutex> lock(llama_ctx_mtx);
+                    prefix_cache_store(slot);
+                }
                 time1 = timer_check();
                 timer_start();
                 if(allow_regular_prints)
@@ -2113,7 +3378,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
             {
                 if(file_format == FileFormat::GGUF_GENERIC)
                 {
-                    logitsPtr = llama_get_logits(llama_ctx_v4);
+                    logitsPtr = slot.logits.data();
                 }
                 else if(file_format == FileFormat::GGJT_3)
                 {
@@ -2144,16 +3409,15 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                 }
             }
 
-            id = SampleLogits(logitsPtr, nctx, n_vocab, last_n_size, repeat_penalty, presence_penalty,
+            id = SampleLogits(slot, logitsPtr, n_vocab, repeat_penalty, presence_penalty,
             top_k, top_a, top_p, min_p, typical_p, tfs_z, temp, rng,
-            kcpp_params->mirostat, kcpp_params->mirostat_tau, kcpp_params->mirostat_eta, sampler_order, grammar, dynatemp_range, dynatemp_exponent, smoothing_factor);
+            params.mirostat, params.mirostat_tau, params.mirostat_eta, sampler_order, slot.grammar, dynatemp_range, dynatemp_exponent, smoothing_factor);
 
-            if (grammar != nullptr) {
-                grammar_accept_token(file_format, n_vocab, grammar, id);
+            if (slot.grammar != nullptr) {
+                grammar_accept_token(file_format, n_vocab, slot.grammar, id);
             }
 
-            last_n_tokens.erase(last_n_tokens.begin());
-            last_n_tokens.push_back(id);
+            slot.rep_pen_window.push(last_n_tokens, id);
             current_context_tokens.push_back(id);
 
             // add it to the context
@@ -2165,18 +3429,18 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
             for (auto id : embd)
             {
                 std::string tokenizedstr = FileFormatTokenizeID(id, file_format);
+                concat_output_mtx.lock();
                 if(stream_sse)
                 {
-                    generated_tokens.push_back(tokenizedstr);
+                    slot.generated_tokens.push_back(tokenizedstr);
                 }
-                concat_output_mtx.lock();
                 concat_output += tokenizedstr;
                 concat_output_mtx.unlock();
             }
 
             if (startedsampling && allow_regular_prints)
             {
-                printf("\rGenerating (%d / %d tokens)", (kcpp_params->n_predict - remaining_tokens), kcpp_params->n_predict);
+                printf("\rGenerating (%d / %d tokens)", (params.n_predict - remaining_tokens), params.n_predict);
             }
             if(debugmode==1 && top_picks.size()>0)
             {
@@ -2204,7 +3468,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                     printf("\n(EOS token triggered!)");
                 }
                 remaining_tokens = 0;
-                last_stop_reason = stop_reason::EOS_TOKEN_HIT;
+                slot.last_stop_reason = stop_reason::EOS_TOKEN_HIT;
             }
 
             for (const auto &matched : stop_sequence)
@@ -2219,7 +3483,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                         replace_all(match_clean, "\n", "\\n");
                         printf("\n(Stop sequence triggered: %s)", match_clean.c_str());
                     }
-                    last_stop_reason = stop_reason::CUSTOM_STOPPER;
+                    slot.last_stop_reason = stop_reason::CUSTOM_STOPPER;
                     break;
                 }
             }
@@ -2257,7 +3521,9 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                             {
                                 printf("\rProcessing LLaVa Embedding %d (%d tokens)",(i+1), llava_images[i].clp_image_tokens);
                             }
-                            bool err = kcpp_eval_image(llama_ctx_v4,llava_images[i].clp_img_embd,llava_images[i].clp_image_tokens,kcpp_params->n_batch,&n_past);
+                            std::unique_lock<std::mutex> lock(llama_ctx_mtx);
+                            bool err = kcpp_eval_image(llama_ctx_v4,slot.seq_id,llava_images[i].clp_img_embd,llava_images[i].clp_image_tokens,params.n_batch,&n_past);
+                            lock.unlock();
                             llavatokensevaled += llava_images[i].clp_image_tokens;
                             if(!err)
                             {
@@ -2265,7 +3531,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                                 fprintf(stderr, "\nFailed to eval llava image at %d!\n",n_past);
                                 output.text = nullptr;
                                 output.status = 0;
-                                generation_finished = true;
+                                slot.generation_finished = true;
                                 return output;
                             }
                         }
@@ -2275,7 +3541,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                             fprintf(stderr, "\nLLAVA image tokens mismatch at %d! (%d vs %d tokens)\n",n_past,llavatokenscounted,llavatokensevaled);
                             output.text = nullptr;
                             output.status = 0;
-                            generation_finished = true;
+                            slot.generation_finished = true;
                             return output;
                         }
                     }
@@ -2287,7 +3553,7 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
                     last_n_tokens.push_back(currtoken);
                     current_context_tokens.push_back(currtoken);
                     ++input_consumed;
-                    if ((int)embd.size() >= kcpp_params->n_batch)
+                    if ((int)embd.size() >= params.n_batch)
                     {
                         break;
                     }
@@ -2305,22 +3571,23 @@ generation_outputs gpttype_generate(const generation_inputs inputs)
     time2 = timer_check();
     float pt1 = (time1*1000.0/(embd_inp.size()==0?1:embd_inp.size()));
     float ts1 = (1000.0/pt1);
-    int realnpredict = kcpp_params->n_predict-stopper_unused_tokens;
+    int realnpredict = params.n_predict-stopper_unused_tokens;
     float pt2 = (time2*1000.0/(realnpredict==0?1:realnpredict));
     float ts2 = (1000.0/pt2);
     float tokens_per_second = (realnpredict == 0 ? 0 : realnpredict / (time1 + time2));
     printf("\nCtxLimit: %d/%d, Process:%.2fs (%.1fms/T = %.2fT/s), Generate:%.2fs (%.1fms/T = %.2fT/s), Total:%.2fs (%.2fT/s)",current_context_tokens.size(),nctx, time1, pt1, ts1, time2, pt2, ts2, (time1 + time2), tokens_per_second);
     fflush(stdout);
     output.status = 1;
-    generation_finished = true;
+    last_stop_reason = slot.last_stop_reason;
     last_eval_time = pt2;
     last_process_time = pt1;
     last_token_count = realnpredict;
-    last_seed = kcpp_params->seed;
+    last_seed = params.seed;
     total_gens += 1;
     concat_output_mtx.lock();
-    concat_output_reader_copy_res = concat_output;
+    slot.concat_output_reader_copy_res = concat_output;
     concat_output_mtx.unlock();
-    output.text = concat_output_reader_copy_res.c_str();
+    output.text = slot.concat_output_reader_copy_res.c_str();
+    slot.generation_finished = true;
     return output;
 }
\ No newline at end of file
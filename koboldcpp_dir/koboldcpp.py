@@ -57,7 +57,11 @@ class load_model_inputs(ctypes.Structure):
                 ("rope_freq_scale", ctypes.c_float),
                 ("rope_freq_base", ctypes.c_float),
                 ("banned_tokens", ctypes.c_char_p * ban_token_max),
-                ("tensor_split", ctypes.c_float * tensor_split_max)]
+                ("tensor_split", ctypes.c_float * tensor_split_max),
+                ("slots", ctypes.c_int),
+                ("prefix_cache", ctypes.c_int),
+                ("prefix_cache_dir", ctypes.c_char_p),
+                ("prefix_cache_disk_mb", ctypes.c_int)]
 
 class generation_inputs(ctypes.Structure):
     _fields_ = [("seed", ctypes.c_int),
@@ -90,7 +94,8 @@ class generation_inputs(ctypes.Structure):
                 ("dynatemp_range", ctypes.c_float),
                 ("dynatemp_exponent", ctypes.c_float),
                 ("smoothing_factor", ctypes.c_float),
-                ("logit_biases", logit_bias * logit_bias_max)]
+                ("logit_biases", logit_bias * logit_bias_max),
+                ("slot", ctypes.c_int)]
 
 class generation_outputs(ctypes.Structure):
     _fields_ = [("status", ctypes.c_int),
@@ -272,9 +277,12 @@ def init_library():
     handle.generate.argtypes = [generation_inputs]
     handle.generate.restype = generation_outputs
     handle.new_token.restype = ctypes.c_char_p
-    handle.new_token.argtypes = [ctypes.c_int]
+    handle.new_token.argtypes = [ctypes.c_int, ctypes.c_int]
     handle.get_stream_count.restype = ctypes.c_int
+    handle.get_stream_count.argtypes = [ctypes.c_int]
     handle.has_finished.restype = ctypes.c_bool
+    handle.has_finished.argtypes = [ctypes.c_int]
+    handle.get_slot_count.restype = ctypes.c_int
     handle.get_last_eval_time.restype = ctypes.c_float
     handle.get_last_process_time.restype = ctypes.c_float
     handle.get_last_token_count.restype = ctypes.c_int
@@ -282,8 +290,10 @@ def init_library():
     handle.get_total_gens.restype = ctypes.c_int
     handle.get_last_stop_reason.restype = ctypes.c_int
     handle.abort_generate.restype = ctypes.c_bool
+    handle.abort_generate.argtypes = [ctypes.c_int]
     handle.token_count.restype = token_count_outputs
     handle.get_pending_output.restype = ctypes.c_char_p
+    handle.get_pending_output.argtypes = [ctypes.c_int]
     handle.sd_load_model.argtypes = [sd_load_model_inputs]
     handle.sd_load_model.restype = ctypes.c_bool
     handle.sd_generate.argtypes = [sd_generation_inputs]
@@ -387,6 +397,17 @@ def load_model(model_filename):
 
     inputs.executable_path = (getdirpath()+"/").encode("UTF-8")
     inputs.debugmode = args.debugmode
+    inputs.slots = args.slots
+    inputs.prefix_cache = 0
+    inputs.prefix_cache_dir = "".encode("UTF-8")
+    inputs.prefix_cache_disk_mb = 0
+    if args.prefixcache:
+        inputs.prefix_cache = int(args.prefixcache[0])
+        if len(args.prefixcache) > 1:
+            os.makedirs(args.prefixcache[1], exist_ok=True)
+            inputs.prefix_cache_dir = args.prefixcache[1].encode("UTF-8")
+        if len(args.prefixcache) > 2:
+            inputs.prefix_cache_disk_mb = int(args.prefixcache[2])
     banned_tokens = args.bantokens
     for n in range(ban_token_max):
         if not banned_tokens or n >= len(banned_tokens):
@@ -394,11 +415,14 @@ def load_model(model_filename):
         else:
             inputs.banned_tokens[n] = banned_tokens[n].encode("UTF-8")
     ret = handle.load_model(inputs)
+    if ret:
+        modelbusy.resize(handle.get_slot_count())
     return ret
 
-def generate(prompt, memory="", images=[], max_length=32, max_context_length=512, temperature=0.7, top_k=100, top_a=0.0, top_p=0.92, min_p=0.0, typical_p=1.0, tfs=1.0, rep_pen=1.0, rep_pen_range=128, presence_penalty=0.0, mirostat=0, mirostat_tau=5.0, mirostat_eta=0.1, sampler_order=[6,0,1,3,4,2,5], seed=-1, stop_sequence=[], use_default_badwordsids=False, stream_sse=False, grammar='', grammar_retain_state=False, genkey='', trimstop=False, quiet=False, dynatemp_range=0.0, dynatemp_exponent=1.0, smoothing_factor=0.0, logit_biases={}):
-    global maxctx, args, currentusergenkey, totalgens, pendingabortkey
+def generate(prompt, memory="", images=[], max_length=32, max_context_length=512, temperature=0.7, top_k=100, top_a=0.0, top_p=0.92, min_p=0.0, typical_p=1.0, tfs=1.0, rep_pen=1.0, rep_pen_range=128, presence_penalty=0.0, mirostat=0, mirostat_tau=5.0, mirostat_eta=0.1, sampler_order=[6,0,1,3,4,2,5], seed=-1, stop_sequence=[], use_default_badwordsids=False, stream_sse=False, grammar='', grammar_retain_state=False, genkey='', trimstop=False, quiet=False, dynatemp_range=0.0, dynatemp_exponent=1.0, smoothing_factor=0.0, logit_biases={}, slot=0):
+    global maxctx, args, totalgens, pendingabortkey
     inputs = generation_inputs()
+    inputs.slot = slot
     inputs.prompt = prompt.encode("UTF-8")
     inputs.memory = memory.encode("UTF-8")
     for n in range(images_max):
@@ -482,7 +506,6 @@ def generate(prompt, memory="", images=[], max_length=32, max_context_length=512
                 inputs.logit_biases[n] = logit_bias(-1, 0.0)
                 print(f"Skipped unparsable logit bias:{ex}")
 
-    currentusergenkey = genkey
     totalgens += 1
     #early exit if aborted
 
@@ -524,7 +547,7 @@ def sd_load_model(model_filename):
     return ret
 
 def sd_generate(genparams):
-    global maxctx, args, currentusergenkey, totalgens, pendingabortkey
+    global maxctx, args, totalgens, pendingabortkey
     prompt = genparams.get("prompt", "high quality")
     negative_prompt = genparams.get("negative_prompt", "")
     cfg_scale = genparams.get("cfg_scale", 5)
@@ -613,7 +636,66 @@ password = "" #if empty, no auth key required
 maxctx = 2048
 maxhordectx = 2048
 maxhordelen = 256
-modelbusy = threading.Lock()
+
+class ModelSlots:
+    #tracks which generation slots of the loaded model are in use. every slot runs one request at a time,
+    #a request goes back to the slot its genkey used last so that its context is still cached there
+    def __init__(self):
+        self.cond = threading.Condition()
+        self.resize(1)
+
+    def resize(self, count):
+        with self.cond:
+            count = max(1, count)
+            self.genkeys = [None] * count #genkey of the running request, None if idle
+            self.lastkeys = [None] * count #genkey of the most recent request
+            self.lastused = [0] * count
+            self.usecounter = 0
+            self.cond.notify_all()
+
+    def _pick(self, genkey):
+        free = [i for i in range(len(self.genkeys)) if self.genkeys[i] is None]
+        if not free:
+            return -1
+        for i in free:
+            if self.lastkeys[i]==genkey:
+                return i
+        return min(free, key=lambda i: self.lastused[i])
+
+    def acquire(self, blocking=True, genkey=""):
+        with self.cond:
+            slot = self._pick(genkey)
+            while slot < 0 and blocking:
+                self.cond.wait()
+                slot = self._pick(genkey)
+            if slot >= 0:
+                self.usecounter += 1
+                self.genkeys[slot] = self.lastkeys[slot] = genkey
+                self.lastused[slot] = self.usecounter
+            return slot
+
+    def release(self, slot):
+        with self.cond:
+            if 0 <= slot < len(self.genkeys):
+                self.genkeys[slot] = None
+                self.cond.notify()
+
+    def locked(self): #true if no slot is free
+        with self.cond:
+            return all(k is not None for k in self.genkeys)
+
+    def find(self, genkey, running_only=False): #slot running this genkey, else the slot that ran it most recently, else -1
+        with self.cond:
+            for i in range(len(self.genkeys)):
+                if self.genkeys[i]==genkey:
+                    return i
+            if running_only:
+                return -1
+            found = [i for i in range(len(self.lastkeys)) if self.lastkeys[i]==genkey]
+            return max(found, key=lambda i: self.lastused[i]) if found else -1
+
+modelbusy = ModelSlots()
+sdbusy = threading.Lock() #image generation only has a single context
 requestsinqueue = 0
 defaultport = 5001
 KcppVersion = "1.61.2"
@@ -627,7 +709,6 @@ exitcounter = -1
 punishcounter = 0 #causes a timeout if too many errors
 rewardcounter = 0 #reduces error counts for successful jobs
 totalgens = 0
-currentusergenkey = "" #store a special key so polled streaming works even in multiuser
 pendingabortkey = "" #if an abort is received for the non-active request, remember it (at least 1) to cancel later
 args = None #global args
 gui_layers_untouched = True
@@ -656,7 +737,7 @@ class ServerRequestHandler(http.server.SimpleHTTPRequestHandler):
             super().log_message(format, *args)
         pass
 
-    async def generate_text(self, genparams, api_format, stream_flag):
+    async def generate_text(self, genparams, api_format, stream_flag, slot):
         global friendlymodelname
         is_quiet = args.quiet
         def run_blocking(): #api format 1=basic,2=kai,3=oai,4=oai-chat
@@ -770,7 +851,8 @@ class ServerRequestHandler(http.server.SimpleHTTPRequestHandler):
                 dynatemp_range=genparams.get('dynatemp_range', 0.0),
                 dynatemp_exponent=genparams.get('dynatemp_exponent', 1.0),
                 smoothing_factor=genparams.get('smoothing_factor', 0.0),
-                logit_biases=genparams.get('logit_bias', {})
+                logit_biases=genparams.get('logit_bias', {}),
+                slot=slot
                 )
 
         recvtxt = ""
@@ -817,7 +899,7 @@ class ServerRequestHandler(http.server.SimpleHTTPRequestHandler):
         self.wfile.write(f'data: {data}\n\n'.encode())
         self.wfile.flush()
 
-    async def handle_sse_stream(self, api_format):
+    async def handle_sse_stream(self, api_format, slot):
         global friendlymodelname
         self.send_response(200)
         self.send_header("cache-control", "no-cache")
@@ -829,11 +911,11 @@ class ServerRequestHandler(http.server.SimpleHTTPRequestHandler):
         await asyncio.sleep(0.25) #anti race condition, prevent check from overtaking generate
         try:
             while True:
-                streamDone = handle.has_finished() #exit next loop on done
+                streamDone = handle.has_finished(slot) #exit next loop on done
                 tokenStr = ""
-                streamcount = handle.get_stream_count()
+                streamcount = handle.get_stream_count(slot)
                 while current_token < streamcount:
-                    token = handle.new_token(current_token)
+                    token = handle.new_token(slot, current_token)
 
                     if token is None: # Token isnt ready yet, received nullpointer
                         break
@@ -868,7 +950,7 @@ class ServerRequestHandler(http.server.SimpleHTTPRequestHandler):
         except Exception as ex:
             print("Token streaming was interrupted or aborted!")
             print(ex)
-            handle.abort_generate()
+            handle.abort_generate(slot)
             time.sleep(0.2) #short delay
 
         # flush buffers, sleep a bit to make sure all data sent, and then force close the connection
@@ -878,14 +960,14 @@ class ServerRequestHandler(http.server.SimpleHTTPRequestHandler):
         await asyncio.sleep(0.05)
 
 
-    async def handle_request(self, genparams, api_format, stream_flag):
+    async def handle_request(self, genparams, api_format, stream_flag, slot):
         tasks = []
 
         try:
             if stream_flag:
-                tasks.append(self.handle_sse_stream(api_format))
+                tasks.append(self.handle_sse_stream(api_format, slot))
 
-            generate_task = asyncio.create_task(self.generate_text(genparams, api_format, stream_flag))
+            generate_task = asyncio.create_task(self.generate_text(genparams, api_format, stream_flag, slot))
             tasks.append(generate_task)
 
             await asyncio.gather(*tasks)
@@ -894,7 +976,7 @@ class ServerRequestHandler(http.server.SimpleHTTPRequestHandler):
         except (BrokenPipeError, ConnectionAbortedError) as cae: # attempt to abort if connection lost
             print("An ongoing connection was aborted or interrupted!")
             print(cae)
-            handle.abort_generate()
+            handle.abort_generate(slot)
             time.sleep(0.2) #short delay
         except Exception as e:
             print(e)
@@ -1003,7 +1085,7 @@ Enter Prompt:<br>
         self.wfile.write(finalhtml)
 
     def do_GET(self):
-        global maxctx, maxhordelen, friendlymodelname, KcppVersion, totalgens, preloaded_story, exitcounter, currentusergenkey, friendlysdmodelname, fullsdmodelpath, mmprojpath, password
+        global maxctx, maxhordelen, friendlymodelname, KcppVersion, totalgens, preloaded_story, exitcounter, friendlysdmodelname, fullsdmodelpath, mmprojpath, password
         self.path = self.path.rstrip('/')
         response_body = None
         content_type = 'application/json'
@@ -1060,8 +1142,9 @@ Enter Prompt:<br>
             if not self.secure_endpoint():
                 return
             pendtxtStr = ""
-            if requestsinqueue==0 and totalgens>0 and currentusergenkey=="":
-                pendtxt = handle.get_pending_output()
+            checkslot = modelbusy.find("")
+            if requestsinqueue==0 and totalgens>0 and checkslot>=0:
+                pendtxt = handle.get_pending_output(checkslot)
                 pendtxtStr = ctypes.string_at(pendtxt).decode("UTF-8","ignore")
             response_body = (json.dumps({"results": [{"text": pendtxtStr}]}).encode())
 
@@ -1122,7 +1205,7 @@ Enter Prompt:<br>
         return
 
     def do_POST(self):
-        global modelbusy, requestsinqueue, currentusergenkey, totalgens, pendingabortkey
+        global modelbusy, requestsinqueue, totalgens, pendingabortkey
         content_length = int(self.headers['content-length'])
         body = self.rfile.read(content_length)
         self.path = self.path.rstrip('/')
@@ -1157,8 +1240,9 @@ Enter Prompt:<br>
             except Exception as e:
                 multiuserkey = ""
                 pass
-            if (multiuserkey=="" and requestsinqueue==0) or (multiuserkey!="" and multiuserkey==currentusergenkey):
-                ag = handle.abort_generate()
+            abortslot = modelbusy.find(multiuserkey, running_only=True)
+            if abortslot>=0 and (multiuserkey!="" or requestsinqueue==0):
+                ag = handle.abort_generate(abortslot)
                 time.sleep(0.1) #short delay before replying
                 response_body = (json.dumps({"success": ("true" if ag else "false"), "done":"true"}).encode())
                 print("\nGeneration Aborted")
@@ -1181,8 +1265,9 @@ Enter Prompt:<br>
                 multiuserkey = ""
 
             if totalgens>0:
-                if (multiuserkey=="" and multiuserkey==currentusergenkey and requestsinqueue==0) or (multiuserkey!="" and multiuserkey==currentusergenkey): #avoid leaking prompts in multiuser
-                    pendtxt = handle.get_pending_output()
+                checkslot = modelbusy.find(multiuserkey) #avoid leaking prompts in multiuser
+                if checkslot>=0 and (multiuserkey!="" or requestsinqueue==0):
+                    pendtxt = handle.get_pending_output(checkslot)
                     pendtxtStr = ctypes.string_at(pendtxt).decode("UTF-8","ignore")
             response_body = (json.dumps({"results": [{"text": pendtxtStr}]}).encode())
 
@@ -1200,7 +1285,15 @@ Enter Prompt:<br>
         if muint > 0 and requestsinqueue < multiuserlimit:
             reqblocking = True
             requestsinqueue += 1
-        if not modelbusy.acquire(blocking=reqblocking):
+        reqgenkey = ""
+        try:
+            tempbody = json.loads(body)
+            if isinstance(tempbody, dict):
+                reqgenkey = str(tempbody.get('genkey', ""))
+        except Exception as e:
+            reqgenkey = ""
+        slot = modelbusy.acquire(blocking=reqblocking, genkey=reqgenkey)
+        if slot < 0:
             self.send_response(503)
             self.end_headers(content_type='application/json')
             self.wfile.write(json.dumps({"detail": {
@@ -1273,7 +1366,7 @@ Enter Prompt:<br>
                     if (api_format == 4 or api_format == 3) and "stream" in genparams and genparams["stream"]:
                         sse_stream_flag = True
 
-                    gen = asyncio.run(self.handle_request(genparams, api_format, sse_stream_flag))
+                    gen = asyncio.run(self.handle_request(genparams, api_format, sse_stream_flag, slot))
 
                     try:
                         # Headers are already sent when streaming
@@ -1287,13 +1380,14 @@ Enter Prompt:<br>
                         if args.debugmode:
                             print(ex)
                         print("Generate: The response could not be sent, maybe connection was terminated?")
-                        handle.abort_generate()
+                        handle.abort_generate(slot)
                         time.sleep(0.2) #short delay
                     return
 
                 elif is_txt2img: #image gen
                     try:
-                        gen = sd_generate(genparams)
+                        with sdbusy:
+                            gen = sd_generate(genparams)
                         genresp = (json.dumps({"images":[gen],"parameters":{},"info":""}).encode())
                         self.send_response(200)
                         self.send_header('content-length', str(len(genresp)))
@@ -1307,7 +1401,7 @@ Enter Prompt:<br>
                     return
 
         finally:
-            modelbusy.release()
+            modelbusy.release(slot)
 
         self.send_response(404)
         self.end_headers(content_type='text/html')
@@ -3079,6 +3173,8 @@ if __name__ == '__main__':
     parser.add_argument("--onready", help="An optional shell command to execute after the model has been loaded.", metavar=('[shell command]'), type=str, default="",nargs=1)
     parser.add_argument("--benchmark", help="Do not start server, instead run benchmarks. If filename is provided, appends results to provided file.", metavar=('[filename]'), nargs='?', const="stdout", type=str, default=None)
     parser.add_argument("--multiuser", help="Runs in multiuser mode, which queues incoming requests instead of blocking them.", metavar=('limit'), nargs='?', const=1, type=int, default=0)
+    parser.add_argument("--slots", help="Number of requests a GGUF model can generate at the same time. Each slot keeps its own conversation in a shared KV cache sized for all of them.", metavar=('[slots]'), type=int, default=1)
+    parser.add_argument("--prefixcache", help="Keeps this many processed GGUF prompts in the KV cache, so a request starting with the same tokens (such as a shared system prompt, or a conversation resumed in another slot) skips processing them. Each entry reserves KV space for a full context. If a directory is given, entries pushed out of memory are saved there in the background and reused after a restart, keeping the files under a size in MB given after the directory (default 8192).", metavar=('[entries]', '[directory] [max MB]'), nargs='+')
     parser.add_argument("--remotetunnel", help="Uses Cloudflare to create a remote tunnel, allowing you to access koboldcpp remotely over the internet even behind a firewall.", action='store_true')
     parser.add_argument("--highpriority", help="Experimental flag. If set, increases the process CPU priority, potentially speeding up generation. Use caution.", action='store_true')
     parser.add_argument("--foreground", help="Windows only. Sends the terminal to the foreground every time a new prompt is generated. This helps avoid some idle slowdown issues.", action='store_true')
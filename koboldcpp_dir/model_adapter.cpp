@@ -5,6 +5,7 @@
 #include <iostream>
 #include <iterator>
 #include <queue>
+#include <unordered_map>
 #include <string>
 #include <math.h>
 #include <vector>
@@ -14,7 +15,7 @@
 
 #include <chrono>
 
-static auto bench_timer = std::chrono::high_resolution_clock().now();
+static thread_local auto bench_timer = std::chrono::high_resolution_clock().now();
 
 void timer_start()
 {
@@ -310,91 +311,122 @@ void print_tok_vec(std::vector<float> &embd)
     return fileformat;
  }
 
- bool ArrStartWith(const std::vector<int> targetArray, const std::vector<int> searchSeq)
+ //suffix automaton of a, then b is walked through it while tracking the longest match ending at each token.
+ //linear in the length of both inputs. ties go to the match that ends first in a, then first in b
+ common_span LongestCommonSubstring(const int * a, int a_len, const int * b, int b_len)
  {
-     int ss = searchSeq.size();
-     if(targetArray.size()<ss)
+     common_span best;
+     if (a_len <= 0 || b_len <= 0)
      {
-         return false;
+         return best;
      }
-     for(int i=0;i<ss;++i)
-     {
-         if(targetArray[i]!=searchSeq[i])
-         {
-             return false;
-         }
-     }
-     return true;
- }
 
- int ArrFindIndexOf(const std::vector<int> targetArray, const std::vector<int> searchSeq)
- {
-     int ss = searchSeq.size();
-     int tas = targetArray.size();
-     if(tas<ss)
+     struct sam_state
      {
-         return -1;
-     }
-     for(int i=0;i<tas;++i)
+         int len;
+         int link;
+         int firstpos; //where the strings of this state first end in a
+         int edges; //head of this state's outgoing transition list, needed when cloning
+     };
+     struct sam_edge
      {
-         int srch = 0;
-         bool fail = false;
-         for(int srch=0;srch<ss;++srch)
+         int token;
+         int next;
+     };
+     std::vector<sam_state> st;
+     std::vector<sam_edge> edges;
+     std::unordered_map<uint64_t, int> trans; //(state,token) -> state, one table instead of a map per state
+     st.reserve(2 * a_len);
+     edges.reserve(3 * a_len);
+     trans.reserve(3 * a_len);
+
+     auto key = [](int state, int token) { return ((uint64_t)(uint32_t)state << 32) | (uint32_t)token; };
+     auto get = [&](int state, int token) {
+         auto it = trans.find(key(state, token));
+         return (it == trans.end() ? -1 : it->second);
+     };
+     auto add = [&](int state, int token, int target) {
+         trans[key(state, token)] = target;
+         edges.push_back({token, st[state].edges});
+         st[state].edges = edges.size() - 1;
+     };
+
+     st.push_back({0, -1, -1, -1});
+     int last = 0;
+     for (int i = 0; i < a_len; ++i)
+     {
+         int c = a[i];
+         int cur = st.size();
+         st.push_back({st[last].len + 1, -1, i, -1});
+         int p = last;
+         while (p != -1 && get(p, c) == -1)
          {
-             if ((i + srch) >= tas || targetArray[i + srch] != searchSeq[srch])
-             {
-                 fail = true;
-                 break;
-             }
+             add(p, c, cur);
+             p = st[p].link;
          }
-         if(!fail)
+         if (p == -1)
          {
-             return i;
+             st[cur].link = 0;
          }
-     }
-     return -1;
- }
-
- std::vector<int> LongestCommonSubseq(const std::vector<int> x, const std::vector<int> y)
- {
-     int m = x.size(), n = y.size();
-
-     //int LCSuff[m+1][n+1];
-     std::vector<std::vector<int>> LCSuff(m+1, std::vector<int>(n+1));
-
-     for (int j = 0; j <= n; j++)
-         LCSuff[0][j] = 0;
-     for (int i = 0; i <= m; i++)
-         LCSuff[i][0] = 0;
-
-     for (int i = 1; i <= m; i++)
-     {
-         for (int j = 1; j <= n; j++)
+         else
          {
-             if (x[i - 1] == y[j - 1])
-                 LCSuff[i][j] = LCSuff[i - 1][j - 1] + 1;
+             int q = get(p, c);
+             if (st[p].len + 1 == st[q].len)
+             {
+                 st[cur].link = q;
+             }
              else
-                 LCSuff[i][j] = 0;
+             {
+                 int clone = st.size();
+                 st.push_back({st[p].len + 1, st[q].link, st[q].firstpos, -1});
+                 for (int e = st[q].edges; e != -1; e = edges[e].next)
+                 {
+                     add(clone, edges[e].token, get(q, edges[e].token));
+                 }
+                 while (p != -1 && get(p, c) == q)
+                 {
+                     trans[key(p, c)] = clone;
+                     p = st[p].link;
+                 }
+                 st[q].link = clone;
+                 st[cur].link = clone;
+             }
          }
+         last = cur;
      }
 
-     std::vector<int> longest;
-     for (int i = 1; i <= m; i++)
+     int v = 0, l = 0;
+     for (int j = 0; j < b_len; ++j)
      {
-         for (int j = 1; j <= n; j++)
+         int c = b[j];
+         while (v != 0 && get(v, c) == -1)
+         {
+             v = st[v].link;
+             l = st[v].len;
+         }
+         int t = get(v, c);
+         if (t != -1)
+         {
+             v = t;
+             ++l;
+         }
+         else
+         {
+             v = 0;
+             l = 0;
+         }
+         if (l > 0)
          {
-             if (LCSuff[i][j] > longest.size())
+             int a_start = st[v].firstpos - l + 1;
+             if (l > best.length || (l == best.length && a_start < best.a_start))
              {
-                 auto off1 = ((i - LCSuff[i][j] + 1) - 1);
-                 auto off2 = off1 + LCSuff[i][j];
-                 longest.clear();
-                //  std::vector<int>().swap(longest);
-                 longest = std::vector<int>(x.begin() + off1, x.begin() + off2);
-                // x.substr((i - LCSuff[i][j] + 1) - 1, LCSuff[i][j]);
+                 best.a_start = a_start;
+                 best.b_start = j - l + 1;
+                 best.length = l;
              }
          }
      }
-     return longest;
+     return best;
  }
 
  void ContextFastForward(std::vector<int> &current_context_tokens, std::vector<int> &embd_inp,
@@ -463,10 +495,10 @@ void print_tok_vec(std::vector<float> &embd)
     if (fastforwardok && useSmartContext && smartcontext.size() > 0 && embd_inp_len >= SCInpLenThreshold)
     {
         //see if smartcontext is still usable
-        auto shared = LongestCommonSubseq(smartcontext, embd_inp);
-        if (shared.size() > SCTokThreshold && ArrStartWith(smartcontext, shared)) //at least 32 tokens in common
+        common_span shared = LongestCommonSubstring(smartcontext.data(), smartcontext.size(), embd_inp.data(), embd_inp.size());
+        if (shared.length > SCTokThreshold && shared.a_start == 0) //at least 32 tokens in common, starting with the smartcontext
         {
-            int found = ArrFindIndexOf(embd_inp,shared);
+            int found = shared.b_start; //first place it appears in the input
             if(found>=0)
             {
                 auto trimmed = std::vector<int>(embd_inp.begin() + found, embd_inp.end());
@@ -75,8 +75,12 @@ enum ModelLoadResult
 
 ModelLoadResult gpttype_load_model(const load_model_inputs inputs, FileFormat in_file_format, FileFormatExtraMeta file_format_meta);
 generation_outputs gpttype_generate(const generation_inputs inputs);
-bool gpttype_generate_abort();
-const std::string & gpttype_get_pending_output();
+bool gpttype_generate_abort(int slot);
+const std::string & gpttype_get_pending_output(int slot);
+int gpttype_get_slot_count();
+bool gpttype_has_finished(int slot);
+int gpttype_get_stream_count(int slot);
+const char * gpttype_get_stream_token(int slot, int idx);
 std::vector<int> gpttype_get_token_arr(const std::string & input);
 
 bool sdtype_load_model(const sd_load_model_inputs inputs);
@@ -87,9 +91,14 @@ double timer_check();
 void print_tok_vec(std::vector<int> &embd);
 void print_tok_vec(std::vector<float> &embd);
 void print_vec(std::vector<std::string> &embd);
-std::vector<int> LongestCommonSubseq(const std::vector<int> x, const std::vector<int> y);
-bool ArrStartWith(const std::vector<int> targetArray, const std::vector<int> searchSeq);
-int ArrFindIndexOf(const std::vector<int> targetArray, const std::vector<int> searchSeq);
+
+struct common_span
+{
+    int a_start = 0; //offset of the shared run in the first sequence
+    int b_start = 0; //offset of the shared run in the second sequence
+    int length = 0;
+};
+common_span LongestCommonSubstring(const int * a, int a_len, const int * b, int b_len);
 
 FileFormat check_file_format(const std::string & fname, FileFormatExtraMeta * fileformatmeta);
 void ContextFastForward(std::vector<int> &current_context_tokens, std::vector<int> &embd_inp,
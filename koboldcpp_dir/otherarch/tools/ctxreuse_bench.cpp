@@ -0,0 +1,172 @@
+//benchmarks how long context reuse takes before prompt processing starts.
+//times the longest common run search done by PurgeMissingTokens (context shifting) and by
+//ContextFastForward (smart context) at several context sizes, and checks the result against
+//the old quadratic LongestCommonSubseq for the sizes where its table still fits in memory.
+//usage: ctxreuse_bench [repeats] [context sizes...]    defaults: 5 4096 8192 16384
+
+#include "model_adapter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+//the old O(n*m) implementation, kept here as a reference
+static std::vector<int> ReferenceLongestCommonSubseq(const std::vector<int> x, const std::vector<int> y)
+{
+    int m = x.size(), n = y.size();
+    std::vector<std::vector<int>> LCSuff(m+1, std::vector<int>(n+1));
+    std::vector<int> longest;
+    for (int i = 1; i <= m; i++)
+    {
+        for (int j = 1; j <= n; j++)
+        {
+            LCSuff[i][j] = (x[i - 1] == y[j - 1]) ? LCSuff[i - 1][j - 1] + 1 : 0;
+        }
+    }
+    for (int i = 1; i <= m; i++)
+    {
+        for (int j = 1; j <= n; j++)
+        {
+            if (LCSuff[i][j] > longest.size())
+            {
+                auto off1 = i - LCSuff[i][j];
+                longest = std::vector<int>(x.begin() + off1, x.begin() + off1 + LCSuff[i][j]);
+            }
+        }
+    }
+    return longest;
+}
+
+static double now_ms()
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+static std::vector<int> random_tokens(std::mt19937 & rng, int count, int vocab)
+{
+    std::vector<int> toks(count);
+    for (auto & t : toks)
+    {
+        t = rng() % vocab;
+    }
+    return toks;
+}
+
+int main(int argc, char ** argv)
+{
+    int repeats = (argc > 1 ? std::max(1, atoi(argv[1])) : 5);
+    std::vector<int> sizes;
+    for (int i = 2; i < argc; ++i)
+    {
+        sizes.push_back(atoi(argv[i]));
+    }
+    if (sizes.empty())
+    {
+        sizes = {4096, 8192, 16384};
+    }
+    const long long reference_limit = 8192LL * 8192LL; //larger tables take several GB
+
+    std::mt19937 rng(42);
+    bool all_ok = true;
+    printf("%8s %-14s %12s %12s %10s %s\n", "n_ctx", "case", "new (ms)", "old (ms)", "speedup", "check");
+    for (int nctx : sizes)
+    {
+        const int memory = 256; //tokens of memory kept at the start
+        const int shift = nctx / 4; //tokens that fell out of the context since the last request
+
+        //context shifting: the old context minus a chunk after the memory, plus new tokens at the end
+        std::vector<int> old_ctx = random_tokens(rng, nctx, 32000);
+        std::vector<int> new_ctx(old_ctx.begin(), old_ctx.begin() + memory);
+        new_ctx.insert(new_ctx.end(), old_ctx.begin() + memory + shift, old_ctx.end());
+        std::vector<int> fresh = random_tokens(rng, shift, 32000);
+        new_ctx.insert(new_ctx.end(), fresh.begin(), fresh.end());
+
+        //smart context: the saved half of the previous prompt reappears inside the new prompt
+        std::vector<int> history = random_tokens(rng, nctx / 2, 32000);
+        std::vector<int> smartcontext(history.begin() + nctx / 4, history.end());
+        std::vector<int> current_context_tokens = smartcontext;
+        std::vector<int> prompt = random_tokens(rng, nctx / 4, 32000);
+        prompt.insert(prompt.end(), history.begin(), history.end());
+        std::vector<int> user = random_tokens(rng, nctx - (int)prompt.size() - 8, 32000);
+        prompt.insert(prompt.end(), user.begin(), user.end());
+
+        struct bench_case
+        {
+            const char * name;
+            const std::vector<int> * a;
+            const std::vector<int> * b;
+            int offset;
+        };
+        bench_case cases[] = {
+            {"context shift", &old_ctx, &new_ctx, memory},
+            {"smart context", &smartcontext, &prompt, 0},
+        };
+
+        for (auto & bc : cases)
+        {
+            const std::vector<int> & a = *bc.a;
+            const std::vector<int> & b = *bc.b;
+            std::vector<double> t_new, t_old;
+            common_span res;
+            for (int r = 0; r < repeats; ++r)
+            {
+                double t0 = now_ms();
+                res = LongestCommonSubstring(a.data() + bc.offset, a.size() - bc.offset, b.data() + bc.offset, b.size() - bc.offset);
+                t_new.push_back(now_ms() - t0);
+            }
+
+            std::string check = "skipped";
+            double old_ms = 0;
+            long long cells = (long long)(a.size() - bc.offset) * (long long)(b.size() - bc.offset);
+            if (cells <= reference_limit)
+            {
+                std::vector<int> ax(a.begin() + bc.offset, a.end());
+                std::vector<int> bx(b.begin() + bc.offset, b.end());
+                double t0 = now_ms();
+                std::vector<int> ref = ReferenceLongestCommonSubseq(ax, bx);
+                old_ms = now_ms() - t0;
+                t_old.push_back(old_ms);
+                bool same = (ref.size() == res.length && std::equal(ref.begin(), ref.end(), ax.begin() + res.a_start)
+                && std::equal(ref.begin(), ref.end(), bx.begin() + res.b_start));
+                check = (same ? "ok" : "MISMATCH");
+                all_ok = all_ok && same;
+            }
+
+            double new_ms = median(t_new);
+            if (t_old.empty())
+            {
+                printf("%8d %-14s %12.3f %12s %10s %s (match %d tokens)\n", nctx, bc.name, new_ms, "-", "-", check.c_str(), res.length);
+            }
+            else
+            {
+                printf("%8d %-14s %12.3f %12.1f %9.0fx %s (match %d tokens)\n", nctx, bc.name, new_ms, old_ms, old_ms / std::max(new_ms, 0.001), check.c_str(), res.length);
+            }
+        }
+
+        //whole smart context fast forward, as run before every prompt
+        std::vector<double> t_ff;
+        int n_past = 0;
+        for (int r = 0; r < repeats; ++r)
+        {
+            std::vector<int> ctx = current_context_tokens;
+            std::vector<int> inp = prompt;
+            std::vector<int> sc = smartcontext;
+            std::vector<int> last_n_tokens(256, 0);
+            n_past = 0;
+            double t0 = now_ms();
+            ContextFastForward(ctx, inp, n_past, last_n_tokens, nctx, sc, true, false);
+            t_ff.push_back(now_ms() - t0);
+        }
+        printf("\n%8d %-14s %12.3f   (n_past %d)\n", nctx, "fast forward", median(t_ff), n_past);
+    }
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+# Checks that a context shift in one slot leaves the KV cells of other slots alone when both took
+# the same cached prompt prefix. Generation is greedy, so a slot that continues the same prompt
+# has to give the same text again, no matter what the other slot did in between.
+#
+# Start koboldcpp with a GGUF model first, for example:
+#   python koboldcpp.py --model model.gguf --contextsize 512 --slots 2 --prefixcache 4 --multiuser --skiplauncher
+# then run:
+#   python otherarch/tools/prefixcache_check.py [url]
+# The server log should show "[Prefix Cache: Reused ...]" for both slots and a "[Context Shifting: ...]" line.
+
+import json
+import sys
+import urllib.request
+
+url = (sys.argv[1] if len(sys.argv) > 1 else "http://localhost:5001").rstrip("/")
+genamt = 24
+
+def post(path, body):
+    req = urllib.request.Request(url + path, data=json.dumps(body).encode(), headers={"Content-Type": "application/json"})
+    return json.loads(urllib.request.urlopen(req).read())
+
+def get(path):
+    return json.loads(urllib.request.urlopen(url + path).read())
+
+def tokencount(text):
+    return post("/api/extra/tokencount", {"prompt": text})["value"]
+
+def generate(genkey, prompt):
+    body = {"prompt": prompt, "max_length": genamt, "genkey": genkey, "temperature": 0.01, "top_k": 1, "rep_pen": 1.0, "sampler_seed": 1}
+    return post("/api/v1/generate", body)["results"][0]["text"]
+
+def text_of(count, start):
+    words = []
+    while True:
+        words.append("w%d q" % ((start + len(words)) % 37))
+        if tokencount(" ".join(words)) >= count:
+            return " ".join(words)
+
+nctx = get("/api/extra/true_max_context_length")["value"]
+shared = text_of(nctx - genamt - 2, 0) #fills the context, so adding to it makes the slot shift
+other0 = text_of(100, 11)
+other1 = text_of(100, 23)
+
+# slot 0 processes the shared prompt, it becomes the cached prefix. then both slots move on to something else
+generate("k0", shared)
+generate("k1", other1)
+generate("k0", other0)
+generate("k1", other0 + other1)
+
+# both slots take the cached prefix, so they share its cells
+first0 = generate("k0", shared)
+first1 = generate("k1", shared)
+
+# slot 0 gets a longer prompt, the front is trimmed and its cells are shifted
+generate("k0", shared + " and then more text arrives" * max(1, nctx // 50))
+
+# slot 1 continues with its own context, which must still be intact
+again1 = generate("k1", shared)
+
+ok = (first0 == first1 and again1 == first1)
+print("same prefix in both slots:", first0 == first1)
+print("other slot intact after shift:", again1 == first1)
+print("PASS" if ok else "FAIL")
+sys.exit(0 if ok else 1)
@@ -0,0 +1,485 @@
+// End-to-end benchmark of whisper_full()
+//
+// Runs a corpus of audio files through the full pipeline (mel, encoder, decoder, sampling) for every combination of
+// the given configurations and reports the time of each stage and the real-time factor. The results can be written
+// as JSON and compared with the JSON of another build to catch performance regressions.
+
+#include "common.h"
+
+#include "whisper.h"
+#include "json.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+// command-line parameters
+struct whisper_params {
+    std::vector<int> n_threads    = { std::min(4, (int32_t) std::thread::hardware_concurrency()) };
+    std::vector<int> n_processors = { 1 };
+    std::vector<int> best_of      = { 1 };
+    std::vector<int> beam_size    = { 0 };  // 0 or 1 - greedy
+    std::vector<int> audio_ctx    = { 0 };  // 0 - all, -1 - size it to the input
+    std::vector<int> lengths      = { };    // generated clips, in seconds
+
+    int32_t n_repeat = 3;
+
+    float compare_thold = 0.10f;
+
+    std::string model       = "models/ggml-base.en.bin";
+    std::string language    = "en";
+    std::string fname_json  = "";
+    std::string fname_cmp   = "";
+
+    std::vector<std::string> fname_inp = {};
+
+    bool use_gpu  = true;
+    bool no_fallback = false;
+};
+
+void whisper_print_usage(int argc, char ** argv, const whisper_params & params);
+
+std::vector<int> parse_list(const std::string & s) {
+    std::vector<int> result;
+
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        result.push_back(item == "auto" ? -1 : std::stoi(item));
+    }
+
+    return result;
+}
+
+std::string to_list(const std::vector<int> & v) {
+    std::string result;
+    for (size_t i = 0; i < v.size(); ++i) {
+        result += (i > 0 ? "," : "") + std::to_string(v[i]);
+    }
+    return result;
+}
+
+bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+        else if (arg == "-t"  || arg == "--threads")       { params.n_threads     = parse_list(argv[++i]); }
+        else if (arg == "-p"  || arg == "--processors")    { params.n_processors  = parse_list(argv[++i]); }
+        else if (arg == "-bo" || arg == "--best-of")       { params.best_of       = parse_list(argv[++i]); }
+        else if (arg == "-bs" || arg == "--beam-size")     { params.beam_size     = parse_list(argv[++i]); }
+        else if (arg == "-ac" || arg == "--audio-ctx")     { params.audio_ctx     = parse_list(argv[++i]); }
+        else if (arg == "-d"  || arg == "--durations")     { params.lengths       = parse_list(argv[++i]); }
+        else if (arg == "-r"  || arg == "--repeat")        { params.n_repeat      = std::stoi(argv[++i]); }
+        else if (arg == "-ct" || arg == "--compare-thold") { params.compare_thold = std::stof(argv[++i]); }
+        else if (arg == "-m"  || arg == "--model")         { params.model         = argv[++i]; }
+        else if (arg == "-l"  || arg == "--language")      { params.language      = argv[++i]; }
+        else if (arg == "-oj" || arg == "--output-json")   { params.fname_json    = argv[++i]; }
+        else if (arg == "-c"  || arg == "--compare")       { params.fname_cmp     = argv[++i]; }
+        else if (arg == "-f"  || arg == "--file")          { params.fname_inp.emplace_back(argv[++i]); }
+        else if (arg == "-nf" || arg == "--no-fallback")   { params.no_fallback   = true; }
+        else if (arg == "-ng" || arg == "--no-gpu")        { params.use_gpu       = false; }
+        else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            whisper_print_usage(argc, argv, params);
+            exit(0);
+        }
+    }
+
+    return true;
+}
+
+void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & params) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options] -f file0.wav -f file1.wav ...\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "the options that take a LIST accept comma-separated values, all combinations are benchmarked\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h,         --help            [default] show this help message and exit\n");
+    fprintf(stderr, "  -t LIST,    --threads LIST    [%-7s] number of threads to use during computation\n",   to_list(params.n_threads).c_str());
+    fprintf(stderr, "  -p LIST,    --processors LIST [%-7s] number of processors to use during computation\n", to_list(params.n_processors).c_str());
+    fprintf(stderr, "  -bo LIST,   --best-of LIST    [%-7s] number of best candidates to keep (greedy)\n",    to_list(params.best_of).c_str());
+    fprintf(stderr, "  -bs LIST,   --beam-size LIST  [%-7s] beam size for beam search (0 - greedy)\n",        to_list(params.beam_size).c_str());
+    fprintf(stderr, "  -ac LIST,   --audio-ctx LIST  [%-7s] audio context size (0 - all, auto - fit the input)\n", to_list(params.audio_ctx).c_str());
+    fprintf(stderr, "  -d LIST,    --durations LIST  [%-7s] also run clips of these lengths in seconds, made from the first file\n", to_list(params.lengths).c_str());
+    fprintf(stderr, "  -r N,       --repeat N        [%-7d] runs per configuration, the fastest one is reported\n", params.n_repeat);
+    fprintf(stderr, "  -m FNAME,   --model FNAME     [%-7s] model path\n",                                   params.model.c_str());
+    fprintf(stderr, "  -l LANG,    --language LANG   [%-7s] spoken language\n",                              params.language.c_str());
+    fprintf(stderr, "  -f FNAME,   --file FNAME      [%-7s] input WAV file, can be repeated\n",             "");
+    fprintf(stderr, "  -oj FNAME,  --output-json FNAME [%-5s] write the results to a JSON file\n",           params.fname_json.c_str());
+    fprintf(stderr, "  -c FNAME,   --compare FNAME   [%-7s] compare with the JSON results of another run\n", params.fname_cmp.c_str());
+    fprintf(stderr, "  -ct N,      --compare-thold N [%-7.2f] relative slowdown reported as a regression\n", params.compare_thold);
+    fprintf(stderr, "  -nf,        --no-fallback     [%-7s] do not use temperature fallback while decoding\n", params.no_fallback ? "true" : "false");
+    fprintf(stderr, "  -ng,        --no-gpu          [%-7s] disable GPU\n",                                  params.use_gpu ? "false" : "true");
+    fprintf(stderr, "\n");
+}
+
+struct bench_clip {
+    std::string name;
+    std::vector<float> pcmf32;
+};
+
+// speech-like test signal: voiced syllables of a few harmonics with short pauses in between
+std::vector<float> generate_audio(int n_samples) {
+    std::vector<float> result(n_samples);
+
+    for (int i = 0; i < n_samples; ++i) {
+        const float t  = float(i)/WHISPER_SAMPLE_RATE;
+        const float f0 = 120.0f + 30.0f*sinf(2.0f*M_PI*0.5f*t);
+
+        const float syllable = std::max(0.0f, sinf(2.0f*M_PI*2.0f*t));
+        const float pause    = fmodf(t, 4.0f) < 3.5f ? 1.0f : 0.0f;
+
+        float v = 0.0f;
+        for (int h = 1; h <= 8; ++h) {
+            v += sinf(2.0f*M_PI*f0*h*t)/h;
+        }
+
+        result[i] = 0.1f*v*syllable*pause;
+    }
+
+    return result;
+}
+
+// a clip of n seconds, the source is repeated as needed
+std::vector<float> tile_audio(const std::vector<float> & src, int n_samples) {
+    std::vector<float> result(n_samples);
+
+    for (int i = 0; i < n_samples; ++i) {
+        result[i] = src[i % src.size()];
+    }
+
+    return result;
+}
+
+struct bench_config {
+    int n_threads;
+    int n_processors;
+    int best_of;
+    int beam_size;
+    int audio_ctx;
+
+    std::string key(const std::string & clip) const {
+        std::stringstream ss;
+        ss << clip << " t=" << n_threads << " p=" << n_processors << " " << (beam_size > 1 ? "bs=" + std::to_string(beam_size) : "bo=" + std::to_string(best_of))
+           << " ac=" << (audio_ctx < 0 ? std::string("auto") : std::to_string(audio_ctx));
+        return ss.str();
+    }
+};
+
+struct bench_result {
+    int64_t t_total_us = -1;
+
+    whisper_timings timings = {};
+
+    std::string text;
+};
+
+// one run of whisper_full_parallel_with_states(), the stage timings are the difference of the counters of the first state
+bool bench_run(struct whisper_context * ctx, std::vector<struct whisper_state *> & states, const whisper_params & params,
+               const bench_config & cfg, const bench_clip & clip, bench_result & result) {
+    whisper_full_params wparams = whisper_full_default_params(cfg.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+
+    wparams.print_progress   = false;
+    wparams.print_realtime   = false;
+    wparams.print_timestamps = false;
+    wparams.print_special    = false;
+    wparams.language         = params.language.c_str();
+    wparams.n_threads        = cfg.n_threads;
+    wparams.greedy.best_of   = cfg.best_of;
+    wparams.beam_search.beam_size = cfg.beam_size;
+    wparams.audio_ctx        = std::max(0, cfg.audio_ctx);
+    wparams.audio_ctx_auto   = cfg.audio_ctx < 0;
+    wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
+
+    const whisper_timings t0 = whisper_get_timings_from_state(states[0]);
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (whisper_full_parallel_with_states(ctx, states.data(), cfg.n_processors, wparams, clip.pcmf32.data(), clip.pcmf32.size()) != 0) {
+        return false;
+    }
+
+    const int64_t t_total_us = ggml_time_us() - t_start_us;
+
+    const whisper_timings t1 = whisper_get_timings_from_state(states[0]);
+
+    result.t_total_us = t_total_us;
+
+    result.timings.t_mel_us    = t1.t_mel_us    - t0.t_mel_us;
+    result.timings.t_sample_us = t1.t_sample_us - t0.t_sample_us;
+    result.timings.t_encode_us = t1.t_encode_us - t0.t_encode_us;
+    result.timings.t_decode_us = t1.t_decode_us - t0.t_decode_us;
+    result.timings.t_batchd_us = t1.t_batchd_us - t0.t_batchd_us;
+    result.timings.t_prompt_us = t1.t_prompt_us - t0.t_prompt_us;
+    result.timings.t_draft_us  = t1.t_draft_us  - t0.t_draft_us;
+
+    result.timings.n_sample = t1.n_sample - t0.n_sample;
+    result.timings.n_encode = t1.n_encode - t0.n_encode;
+    result.timings.n_decode = t1.n_decode - t0.n_decode;
+    result.timings.n_batchd = t1.n_batchd - t0.n_batchd;
+    result.timings.n_prompt = t1.n_prompt - t0.n_prompt;
+    result.timings.n_fail_p = t1.n_fail_p - t0.n_fail_p;
+    result.timings.n_fail_h = t1.n_fail_h - t0.n_fail_h;
+
+    result.text.clear();
+    const int n_segments = whisper_full_n_segments_from_state(states[0]);
+    for (int i = 0; i < n_segments; ++i) {
+        result.text += whisper_full_get_segment_text_from_state(states[0], i);
+    }
+
+    return true;
+}
+
+json result_to_json(const bench_config & cfg, const bench_clip & clip, const bench_result & r) {
+    const double duration = double(clip.pcmf32.size())/WHISPER_SAMPLE_RATE;
+
+    return json{
+        {"key",        cfg.key(clip.name)},
+        {"file",       clip.name},
+        {"duration",   duration},
+        {"threads",    cfg.n_threads},
+        {"processors", cfg.n_processors},
+        {"strategy",   cfg.beam_size > 1 ? "beam_search" : "greedy"},
+        {"best_of",    cfg.best_of},
+        {"beam_size",  cfg.beam_size},
+        {"audio_ctx",  cfg.audio_ctx < 0 ? json("auto") : json(cfg.audio_ctx)},
+        {"time",       r.t_total_us*1e-6},
+        {"rtf",        r.t_total_us*1e-6/duration},
+        {"stages", {
+            {"mel",    r.timings.t_mel_us*1e-6},
+            {"encode", r.timings.t_encode_us*1e-6},
+            {"decode", r.timings.t_decode_us*1e-6},
+            {"batchd", r.timings.t_batchd_us*1e-6},
+            {"prompt", r.timings.t_prompt_us*1e-6},
+            {"sample", r.timings.t_sample_us*1e-6},
+        }},
+        {"runs", {
+            {"encode", r.timings.n_encode},
+            {"decode", r.timings.n_decode},
+            {"batchd", r.timings.n_batchd},
+            {"prompt", r.timings.n_prompt},
+            {"sample", r.timings.n_sample},
+        }},
+        {"fallbacks", r.timings.n_fail_p + r.timings.n_fail_h},
+        {"text", r.text},
+    };
+}
+
+// prints the change of the time of each configuration that is in both results, returns the number of regressions
+int compare_results(const json & cur, const json & ref, float thold) {
+    int n_regressions = 0;
+    int n_compared    = 0;
+
+    printf("\n");
+    printf("comparison with '%s' (%s)\n", ref.value("model", "").c_str(), ref.value("system_info", "").c_str());
+    printf("\n");
+    printf("%-48s %9s %9s %8s\n", "config", "ref [s]", "cur [s]", "change");
+
+    for (const auto & r : cur["results"]) {
+        const std::string key = r["key"];
+
+        for (const auto & o : ref["results"]) {
+            if (o["key"] != key) {
+                continue;
+            }
+
+            const double t_cur = r["time"];
+            const double t_ref = o["time"];
+
+            const double change = t_cur/t_ref - 1.0;
+            const bool   is_reg = change > thold;
+
+            printf("%-48s %9.3f %9.3f %+7.1f%%%s%s\n", key.c_str(), t_ref, t_cur, 100.0*change,
+                    is_reg ? "  REGRESSION" : "", o["text"] != r["text"] ? "  (text differs)" : "");
+
+            n_regressions += is_reg ? 1 : 0;
+            n_compared++;
+        }
+    }
+
+    printf("\n");
+    printf("%d configurations compared, %d slower by more than %.0f%%\n", n_compared, n_regressions, 100.0*thold);
+
+    return n_regressions;
+}
+
+int main(int argc, char ** argv) {
+    whisper_params params;
+
+    if (whisper_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    // the corpus
+    std::vector<bench_clip> clips;
+
+    for (const auto & fname : params.fname_inp) {
+        bench_clip clip;
+        clip.name = fname.substr(fname.find_last_of("/\\") + 1);
+
+        std::vector<std::vector<float>> pcmf32s;
+        if (!::read_wav(fname, clip.pcmf32, pcmf32s, false)) {
+            fprintf(stderr, "error: failed to read WAV file '%s'\n", fname.c_str());
+            return 2;
+        }
+
+        clips.push_back(std::move(clip));
+    }
+
+    {
+        // the generated clips repeat the first file, or a synthetic signal if there is none
+        const std::vector<float> src = clips.empty() ? generate_audio(10*WHISPER_SAMPLE_RATE) : clips[0].pcmf32;
+        const std::string src_name   = clips.empty() ? "synth" : clips[0].name;
+
+        for (int len : params.lengths) {
+            bench_clip clip;
+            clip.name   = src_name + "@" + std::to_string(len) + "s";
+            clip.pcmf32 = tile_audio(src, len*WHISPER_SAMPLE_RATE);
+            clips.push_back(std::move(clip));
+        }
+    }
+
+    if (clips.empty()) {
+        fprintf(stderr, "error: no input, use -f FNAME and/or -d LIST\n");
+        whisper_print_usage(argc, argv, params);
+        return 2;
+    }
+
+    // the configurations
+    std::vector<bench_config> configs;
+
+    for (int t : params.n_threads) {
+        for (int p : params.n_processors) {
+            for (int ac : params.audio_ctx) {
+                for (int bs : params.beam_size) {
+                    if (bs > 1) {
+                        configs.push_back({ t, p, 1, bs, ac });
+                        continue;
+                    }
+                    for (int bo : params.best_of) {
+                        configs.push_back({ t, p, bo, 0, ac });
+                    }
+                }
+            }
+        }
+    }
+
+    whisper_log_set([](enum ggml_log_level level, const char * text, void * /*user_data*/) {
+        if (level == GGML_LOG_LEVEL_ERROR) {
+            fputs(text, stderr);
+        }
+    }, nullptr);
+
+    struct whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_gpu = params.use_gpu;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 3;
+    }
+
+    // one state per processor, shared by all configurations
+    std::vector<struct whisper_state *> states;
+    for (int i = 0; i < *std::max_element(params.n_processors.begin(), params.n_processors.end()); ++i) {
+        states.push_back(whisper_init_state(ctx));
+        if (states.back() == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper state\n");
+            return 3;
+        }
+    }
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "system_info: %s\n", whisper_print_system_info());
+    fprintf(stderr, "%s: %d clips x %d configurations x %d runs\n", __func__, (int) clips.size(), (int) configs.size(), params.n_repeat);
+
+    // warm up the caches and the allocators
+    {
+        bench_result r;
+        bench_run(ctx, states, params, configs[0], clips[0], r);
+    }
+
+    printf("\n");
+    printf("%-48s %8s %8s %8s %8s %8s %8s %8s %6s\n", "config", "total", "rtf", "mel", "encode", "decode", "batchd", "prompt", "fails");
+
+    json results = json::array();
+
+    for (const auto & clip : clips) {
+        for (const auto & cfg : configs) {
+            bench_result best;
+
+            for (int i = 0; i < params.n_repeat; ++i) {
+                bench_result r;
+                if (!bench_run(ctx, states, params, cfg, clip, r)) {
+                    fprintf(stderr, "error: failed to process '%s'\n", cfg.key(clip.name).c_str());
+                    return 4;
+                }
+
+                if (best.t_total_us < 0 || r.t_total_us < best.t_total_us) {
+                    best = r;
+                }
+            }
+
+            const double duration = double(clip.pcmf32.size())/WHISPER_SAMPLE_RATE;
+
+            printf("%-48s %7.3fs %8.3f %7.3fs %7.3fs %7.3fs %7.3fs %7.3fs %6d\n", cfg.key(clip.name).c_str(),
+                    best.t_total_us*1e-6, best.t_total_us*1e-6/duration,
+                    best.timings.t_mel_us*1e-6, best.timings.t_encode_us*1e-6, best.timings.t_decode_us*1e-6,
+                    best.timings.t_batchd_us*1e-6, best.timings.t_prompt_us*1e-6, best.timings.n_fail_p + best.timings.n_fail_h);
+            fflush(stdout);
+
+            results.push_back(result_to_json(cfg, clip, best));
+        }
+    }
+
+    const json output = json{
+        {"model",       params.model},
+        {"model_type",  whisper_model_type_readable(ctx)},
+        {"system_info", whisper_print_system_info()},
+        {"n_repeat",    params.n_repeat},
+        {"results",     results},
+    };
+
+    if (!params.fname_json.empty()) {
+        std::ofstream fout(params.fname_json);
+        if (!fout) {
+            fprintf(stderr, "error: failed to open '%s' for writing\n", params.fname_json.c_str());
+            return 5;
+        }
+        fout << output.dump(2, ' ', false, json::error_handler_t::replace) << "\n";
+        fprintf(stderr, "\n%s: results written to '%s'\n", __func__, params.fname_json.c_str());
+    }
+
+    int ret = 0;
+
+    if (!params.fname_cmp.empty()) {
+        std::ifstream fin(params.fname_cmp);
+        if (!fin) {
+            fprintf(stderr, "error: failed to open '%s'\n", params.fname_cmp.c_str());
+            return 5;
+        }
+
+        const json ref = json::parse(fin);
+
+        ret = compare_results(output, ref, params.compare_thold) > 0 ? 1 : 0;
+    }
+
+    for (auto * state : states) {
+        whisper_free_state(state);
+    }
+    whisper_free(ctx);
+
+    return ret;
+}
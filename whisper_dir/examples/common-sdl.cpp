@@ -1,9 +1,15 @@
 #include "common-sdl.h"
 
+#include <algorithm>
+#include <cstring>
+
 audio_async::audio_async(int len_ms) {
     m_len_ms = len_ms;
 
     m_running = false;
+
+    m_n_reserved = 0;
+    m_n_written  = 0;
 }
 
 audio_async::~audio_async() {
@@ -71,7 +77,9 @@ bool audio_async::init(int capture_id, int sample_rate) {
 
     m_sample_rate = capture_spec_obtained.freq;
 
-    m_audio.resize((m_sample_rate*m_len_ms)/1000);
+    // twice the requested length, so that the spans returned by get_span() are not overwritten right away
+    m_capacity = 2*((m_sample_rate*m_len_ms)/1000);
+    m_audio.resize(2*m_capacity);
 
     return true;
 }
@@ -123,13 +131,24 @@ bool audio_async::clear() {
         return false;
     }
 
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
+    m_n_cleared = m_n_written.load(std::memory_order_acquire);
+
+    return true;
+}
+
+bool audio_async::clear(int64_t t0) {
+    if (!m_dev_id_in) {
+        fprintf(stderr, "%s: no audio device to clear!\n", __func__);
+        return false;
+    }
 
-        m_audio_pos = 0;
-        m_audio_len = 0;
+    if (!m_running) {
+        fprintf(stderr, "%s: not running!\n", __func__);
+        return false;
     }
 
+    m_n_cleared = std::max(m_n_cleared, std::min(t0, m_n_written.load(std::memory_order_acquire)));
+
     return true;
 }
 
@@ -141,75 +160,96 @@ void audio_async::callback(uint8_t * stream, int len) {
 
     size_t n_samples = len / sizeof(float);
 
-    if (n_samples > m_audio.size()) {
-        n_samples = m_audio.size();
+    if (n_samples > m_capacity) {
+        n_samples = m_capacity;
 
         stream += (len - (n_samples * sizeof(float)));
     }
 
-    //fprintf(stderr, "%s: %zu samples, pos %zu, len %zu\n", __func__, n_samples, m_audio_pos, m_audio_len);
+    const int64_t n_written = m_n_written.load(std::memory_order_relaxed);
 
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
+    // announce the samples that are about to be overwritten before touching them, see is_valid()
+    m_n_reserved.store(n_written + n_samples, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
 
-        if (m_audio_pos + n_samples > m_audio.size()) {
-            const size_t n0 = m_audio.size() - m_audio_pos;
+    const size_t pos = n_written % m_capacity;
+    const size_t n0  = std::min(n_samples, m_capacity - pos);
 
-            memcpy(&m_audio[m_audio_pos], stream, n0 * sizeof(float));
-            memcpy(&m_audio[0], stream + n0 * sizeof(float), (n_samples - n0) * sizeof(float));
+    //fprintf(stderr, "%s: %zu samples, pos %zu, written %lld\n", __func__, n_samples, pos, (long long) n_written);
 
-            m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
-            m_audio_len = m_audio.size();
-        } else {
-            memcpy(&m_audio[m_audio_pos], stream, n_samples * sizeof(float));
+    memcpy(&m_audio[pos],              stream, n0 * sizeof(float));
+    memcpy(&m_audio[pos + m_capacity], stream, n0 * sizeof(float));
 
-            m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
-            m_audio_len = std::min(m_audio_len + n_samples, m_audio.size());
-        }
+    if (n0 < n_samples) {
+        memcpy(&m_audio[0],          stream + n0 * sizeof(float), (n_samples - n0) * sizeof(float));
+        memcpy(&m_audio[m_capacity], stream + n0 * sizeof(float), (n_samples - n0) * sizeof(float));
     }
+
+    m_n_written.store(n_written + n_samples, std::memory_order_release);
 }
 
 void audio_async::get(int ms, std::vector<float> & result) {
+    int64_t t0 = 0;
+    get(ms, result, t0);
+}
+
+void audio_async::get(int ms, std::vector<float> & result, int64_t & t0) {
+    result.clear();
+
+    audio_span span;
+
+    // retry if the callback has overwritten the samples while copying them - can only happen if the thread was
+    // preempted for more than len_ms
+    do {
+        if (!get_span(ms, span)) {
+            return;
+        }
+
+        result.assign(span.data, span.data + span.n);
+    } while (!is_valid(span));
+
+    t0 = span.t0;
+}
+
+bool audio_async::get_span(int ms, audio_span & span) {
     if (!m_dev_id_in) {
         fprintf(stderr, "%s: no audio device to get audio from!\n", __func__);
-        return;
+        return false;
     }
 
     if (!m_running) {
         fprintf(stderr, "%s: not running!\n", __func__);
-        return;
+        return false;
     }
 
-    result.clear();
+    if (ms <= 0) {
+        ms = m_len_ms;
+    }
 
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
+    const int64_t n_written = m_n_written.load(std::memory_order_acquire);
 
-        if (ms <= 0) {
-            ms = m_len_ms;
-        }
+    int64_t n_samples = (int64_t(m_sample_rate) * std::min(ms, m_len_ms)) / 1000;
+    if (n_samples > n_written - m_n_cleared) {
+        n_samples = std::max<int64_t>(0, n_written - m_n_cleared);
+    }
 
-        size_t n_samples = (m_sample_rate * ms) / 1000;
-        if (n_samples > m_audio_len) {
-            n_samples = m_audio_len;
-        }
+    span.t0   = n_written - n_samples;
+    span.n    = n_samples;
+    span.data = &m_audio[span.t0 % m_capacity];
 
-        result.resize(n_samples);
+    return true;
+}
 
-        int s0 = m_audio_pos - n_samples;
-        if (s0 < 0) {
-            s0 += m_audio.size();
-        }
+bool audio_async::is_valid(const audio_span & span) const {
+    // pairs with the fence in callback(): if any of the samples read before this call were overwritten, the
+    // reservation of the new samples is visible here
+    std::atomic_thread_fence(std::memory_order_acquire);
 
-        if (s0 + n_samples > m_audio.size()) {
-            const size_t n0 = m_audio.size() - s0;
+    return m_n_reserved.load(std::memory_order_relaxed) - span.t0 <= (int64_t) m_capacity;
+}
 
-            memcpy(result.data(), &m_audio[s0], n0 * sizeof(float));
-            memcpy(&result[n0], &m_audio[0], (n_samples - n0) * sizeof(float));
-        } else {
-            memcpy(result.data(), &m_audio[s0], n_samples * sizeof(float));
-        }
-    }
+int64_t audio_async::n_captured() const {
+    return m_n_written.load(std::memory_order_acquire);
 }
 
 bool sdl_poll_events() {
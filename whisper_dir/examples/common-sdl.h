@@ -6,12 +6,22 @@
 #include <atomic>
 #include <cstdint>
 #include <vector>
-#include <mutex>
 
 //
 // SDL Audio capture
 //
 
+// view of the captured audio, without copying it out of the circular buffer
+// the samples can be overwritten by the capture callback - check audio_async::is_valid() after using them
+struct audio_span {
+    const float * data = nullptr;
+
+    size_t  n  = 0; // number of samples
+    int64_t t0 = 0; // index of the first sample since the start of the capture
+};
+
+// the SDL callback is the only producer and the user of the class is the only consumer, so there is no lock between
+// the audio thread and the application: the callback publishes the number of captured samples with an atomic counter
 class audio_async {
 public:
     audio_async(int len_ms);
@@ -25,11 +35,25 @@ public:
     bool pause();
     bool clear();
 
+    // drop the audio before sample t0 (see audio_span::t0)
+    bool clear(int64_t t0);
+
     // callback to be called by SDL
     void callback(uint8_t * stream, int len);
 
     // get audio data from the circular buffer
     void get(int ms, std::vector<float> & audio);
+    void get(int ms, std::vector<float> & audio, int64_t & t0);
+
+    // get the last ms of audio data (all of it if ms <= 0) without copying
+    // the span stays valid for at least len_ms of newly captured audio
+    bool get_span(int ms, audio_span & span);
+
+    // true if the samples of the span have not been overwritten yet
+    bool is_valid(const audio_span & span) const;
+
+    // number of samples captured since the start
+    int64_t n_captured() const;
 
 private:
     SDL_AudioDeviceID m_dev_id_in = 0;
@@ -38,11 +62,17 @@ private:
     int m_sample_rate = 0;
 
     std::atomic_bool m_running;
-    std::mutex       m_mutex;
 
+    // each sample is stored twice, at i and i + m_capacity, so that the last m_capacity samples are always contiguous
     std::vector<float> m_audio;
-    size_t             m_audio_pos = 0;
-    size_t             m_audio_len = 0;
+    size_t             m_capacity = 0;
+
+    // written by the callback only
+    std::atomic<int64_t> m_n_reserved; // samples that are being written
+    std::atomic<int64_t> m_n_written;  // samples that can be read
+
+    // written by the consumer only
+    int64_t m_n_cleared = 0;
 };
 
 // Return false if need to quit
@@ -7,6 +7,7 @@
 #define DR_WAV_IMPLEMENTATION
 #include "dr_wav.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <fstream>
@@ -15,6 +16,14 @@
 #include <codecvt>
 #include <sstream>
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
@@ -630,6 +639,76 @@ bool is_wav_buffer(const std::string buf) {
     return true;
 }
 
+// upper bound on the frames that fit in size bytes of sample data, 0 if the header has no sample size
+// counted in bits, since a mono ADPCM frame takes less than a byte
+static uint64_t wav_frames_max(const drwav & wav, size_t size) {
+    const uint64_t frame_bits = (uint64_t) wav.channels*wav.bitsPerSample;
+    return frame_bits > 0 ? (uint64_t) size*8/frame_bits : 0;
+}
+
+// decode all frames of an opened WAV stream to mono (and optionally stereo) float PCM at COMMON_SAMPLE_RATE
+// n_frames_max limits the number of frames when the header does not carry the total frame count (stdin)
+static bool read_wav_pcm(drwav & wav, const char * name, uint64_t n_frames_max, std::vector<float> & pcmf32, std::vector<std::vector<float>> & pcmf32s, bool stereo) {
+    if (wav.channels != 1 && wav.channels != 2) {
+        fprintf(stderr, "%s: WAV file '%s' must be mono or stereo\n", __func__, name);
+        drwav_uninit(&wav);
+        return false;
+    }
+
+    if (stereo && wav.channels != 2) {
+        fprintf(stderr, "%s: WAV file '%s' must be stereo for diarization\n", __func__, name);
+        drwav_uninit(&wav);
+        return false;
+    }
+
+    if (wav.sampleRate == 0) {
+        fprintf(stderr, "%s: WAV file '%s' has an invalid sample rate\n", __func__, name);
+        drwav_uninit(&wav);
+        return false;
+    }
+
+    // streamed WAV headers may carry a bogus frame count, so never read past the end of the data
+    uint64_t n_req = wav.totalPCMFrameCount;
+    if (n_frames_max > 0 && (n_req == 0 || n_req > n_frames_max)) {
+        n_req = n_frames_max;
+    }
+
+    const uint32_t channels    = wav.channels;
+    const uint32_t sample_rate = wav.sampleRate;
+
+    // dr_wav converts 8/16/24/32-bit integer, float and A-law/mu-law/ADPCM samples to f32 in [-1, 1]
+    std::vector<float> pcm;
+    pcm.resize(n_req*channels);
+    const uint64_t n = drwav_read_pcm_frames_f32(&wav, n_req, pcm.data());
+    drwav_uninit(&wav);
+
+    // convert to mono
+    std::vector<float> mono(n);
+    if (channels == 1) {
+        std::copy(pcm.begin(), pcm.begin() + n, mono.begin());
+    } else {
+        for (uint64_t i = 0; i < n; i++) {
+            mono[i] = 0.5f*(pcm[2*i] + pcm[2*i + 1]);
+        }
+    }
+    resample(mono, pcmf32, sample_rate, COMMON_SAMPLE_RATE);
+
+    if (stereo) {
+        // convert to stereo
+        pcmf32s.resize(2);
+
+        std::vector<float> channel(n);
+        for (int c = 0; c < 2; c++) {
+            for (uint64_t i = 0; i < n; i++) {
+                channel[i] = pcm[2*i + c];
+            }
+            resample(channel, pcmf32s[c], sample_rate, COMMON_SAMPLE_RATE);
+        }
+    }
+
+    return true;
+}
+
 bool read_wav(const std::string & fname, std::vector<float>& pcmf32, std::vector<std::vector<float>>& pcmf32s, bool stereo) {
     drwav wav;
     std::vector<uint8_t> wav_data; // used for pipe input from stdin
@@ -655,68 +734,174 @@ bool read_wav(const std::string & fname, std::vector<float>& pcmf32, std::vector
         fprintf(stderr, "%s: read %zu bytes from stdin\n", __func__, wav_data.size());
     }
     else if (is_wav_buffer(fname)) {
-        if (drwav_init_memory(&wav, fname.c_str(), fname.size(), nullptr) == false) {
-            fprintf(stderr, "error: failed to open WAV file from fname buffer\n");
-            return false;
-        }
+        return read_wav_buffer(fname.data(), fname.size(), pcmf32, pcmf32s, stereo);
     }
     else if (drwav_init_file(&wav, fname.c_str(), nullptr) == false) {
         fprintf(stderr, "error: failed to open '%s' as WAV file\n", fname.c_str());
         return false;
     }
 
-    if (wav.channels != 1 && wav.channels != 2) {
-        fprintf(stderr, "%s: WAV file '%s' must be mono or stereo\n", __func__, fname.c_str());
-        return false;
+    uint64_t n_frames_max = 0;
+    if (fname == "-") {
+        n_frames_max = wav_frames_max(wav, wav_data.size());
+        if (n_frames_max == 0) {
+            fprintf(stderr, "error: WAV data from stdin has no valid sample size\n");
+            drwav_uninit(&wav);
+            return false;
+        }
     }
 
-    if (stereo && wav.channels != 2) {
-        fprintf(stderr, "%s: WAV file '%s' must be stereo for diarization\n", __func__, fname.c_str());
+    return read_wav_pcm(wav, fname == "-" ? "stdin" : fname.c_str(), n_frames_max, pcmf32, pcmf32s, stereo);
+}
+
+bool read_wav_buffer(const void * data, size_t size, std::vector<float> & pcmf32, std::vector<std::vector<float>> & pcmf32s, bool stereo) {
+    drwav wav;
+
+    if (drwav_init_memory(&wav, data, size, nullptr) == false) {
+        fprintf(stderr, "error: failed to open WAV data from buffer\n");
         return false;
     }
 
-    if (wav.sampleRate != COMMON_SAMPLE_RATE) {
-        fprintf(stderr, "%s: WAV file '%s' must be %i kHz\n", __func__, fname.c_str(), COMMON_SAMPLE_RATE/1000);
+    const uint64_t n_frames_max = wav_frames_max(wav, size);
+    if (n_frames_max == 0) {
+        fprintf(stderr, "error: WAV data from buffer has no valid sample size\n");
+        drwav_uninit(&wav);
         return false;
     }
 
-    if (wav.bitsPerSample != 16) {
-        fprintf(stderr, "%s: WAV file '%s' must be 16-bit\n", __func__, fname.c_str());
-        return false;
+    return read_wav_pcm(wav, "buffer", n_frames_max, pcmf32, pcmf32s, stereo);
+}
+
+// dot product of two float arrays
+static float resample_dot(const float * a, const float * b, int n) {
+    int i = 0;
+    float sum = 0.0f;
+
+#if defined(__AVX__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+#if defined(__FMA__)
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+#else
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+#endif
+    }
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_add_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_add_ss(acc4, _mm_shuffle_ps(acc4, acc4, 1));
+    sum = _mm_cvtss_f32(acc4);
+#elif defined(__SSE__) || defined(_M_X64)
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
     }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    sum = vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1) + vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+#endif
 
-    const uint64_t n = wav_data.empty() ? wav.totalPCMFrameCount : wav_data.size()/(wav.channels*wav.bitsPerSample/8);
+    for (; i < n; i++) {
+        sum += a[i]*b[i];
+    }
 
-    std::vector<int16_t> pcm16;
-    pcm16.resize(n*wav.channels);
-    drwav_read_pcm_frames_s16(&wav, n, pcm16.data());
-    drwav_uninit(&wav);
+    return sum;
+}
 
-    // convert to mono, float
-    pcmf32.resize(n);
-    if (wav.channels == 1) {
-        for (uint64_t i = 0; i < n; i++) {
-            pcmf32[i] = float(pcm16[i])/32768.0f;
-        }
-    } else {
-        for (uint64_t i = 0; i < n; i++) {
-            pcmf32[i] = float(pcm16[2*i] + pcm16[2*i + 1])/65536.0f;
+// zeroth order modified Bessel function of the first kind, used for the Kaiser window
+static double resample_bessel_i0(double x) {
+    double sum  = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 32; k++) {
+        term *= (x/(2.0*k))*(x/(2.0*k));
+        sum  += term;
+    }
+    return sum;
+}
+
+void resample(const std::vector<float> & in, std::vector<float> & out, int sample_rate_in, int sample_rate_out) {
+    if (sample_rate_in == sample_rate_out || in.empty()) {
+        out = in;
+        return;
+    }
+
+    // the conversion ratio is up/down: the output sample n sits at input position n*down/up
+    int up   = sample_rate_out;
+    int down = sample_rate_in;
+    for (int a = up, b = down; ; ) {
+        if (b == 0) {
+            up   /= a;
+            down /= a;
+            break;
         }
+        const int t = a % b; a = b; b = t;
     }
 
-    if (stereo) {
-        // convert to stereo, float
-        pcmf32s.resize(2);
+    // one windowed-sinc filter per output phase, the number of phases is capped for awkward ratios
+    const int    n_phase = std::min(up, 1024);
+    const double cutoff  = 0.94*std::min(1.0, double(up)/down); // relative to the input Nyquist frequency
+    const int    n_half  = (int) std::ceil(16.0/cutoff);         // 16 zero crossings of the sinc on each side
+    const int    n_taps  = 2*n_half;
+    const double beta    = 8.0;
+    const double i0_beta = resample_bessel_i0(beta);
+
+    std::vector<float> filters(n_phase*n_taps);
+    for (int p = 0; p < n_phase; p++) {
+        const double frac = double(p)/n_phase;
+
+        double sum = 0.0;
+        for (int k = 0; k < n_taps; k++) {
+            const double x = (k - n_half + 1) - frac;
+            const double r = x/n_half;
+            const double w = std::fabs(r) < 1.0 ? resample_bessel_i0(beta*std::sqrt(1.0 - r*r))/i0_beta : 0.0;
+            const double h = x == 0.0 ? cutoff : std::sin(M_PI*cutoff*x)/(M_PI*x);
+
+            filters[p*n_taps + k] = h*w;
+            sum += h*w;
+        }
 
-        pcmf32s[0].resize(n);
-        pcmf32s[1].resize(n);
-        for (uint64_t i = 0; i < n; i++) {
-            pcmf32s[0][i] = float(pcm16[2*i])/32768.0f;
-            pcmf32s[1][i] = float(pcm16[2*i + 1])/32768.0f;
+        // unity gain at DC for every phase
+        for (int k = 0; k < n_taps; k++) {
+            filters[p*n_taps + k] /= sum;
         }
     }
 
-    return true;
+    const int64_t n_in  = in.size();
+    const int64_t n_out = (n_in*up + down - 1)/down;
+
+    out.resize(n_out);
+
+    for (int64_t n = 0; n < n_out; n++) {
+        const int64_t pos = n*down;
+
+        int64_t i = pos/up;
+        int     p = (int) (((pos % up)*n_phase + up/2)/up);
+        if (p == n_phase) {
+            p = 0;
+            i++;
+        }
+
+        const float * h = filters.data() + p*n_taps;
+        const int64_t i0 = i - n_half + 1;
+
+        if (i0 >= 0 && i0 + n_taps <= n_in) {
+            out[n] = resample_dot(in.data() + i0, h, n_taps);
+        } else {
+            // the edges are zero padded
+            float sum = 0.0f;
+            for (int k = 0; k < n_taps; k++) {
+                if (i0 + k >= 0 && i0 + k < n_in) {
+                    sum += in[i0 + k]*h[k];
+                }
+            }
+            out[n] = sum;
+        }
+    }
 }
 
 void high_pass_filter(std::vector<float> & data, float cutoff, float sample_rate) {
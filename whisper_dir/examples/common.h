@@ -140,7 +140,8 @@ bool is_wav_buffer(const std::string buf);
 
 // Read WAV audio file and store the PCM data into pcmf32
 // fname can be a buffer of WAV data instead of a filename
-// The sample rate of the audio must be equal to COMMON_SAMPLE_RATE
+// 8/16/24/32-bit integer and floating point samples are supported at any sample rate,
+// the audio is resampled to COMMON_SAMPLE_RATE
 // If stereo flag is set and the audio has 2 channels, the pcmf32s will contain 2 channel PCM
 bool read_wav(
         const std::string & fname,
@@ -148,6 +149,22 @@ bool read_wav(
         std::vector<std::vector<float>> & pcmf32s,
         bool stereo);
 
+// Same as read_wav, but decodes WAV data that is already in memory
+// Nothing is written to disk, so this is safe to call from multiple threads
+bool read_wav_buffer(
+        const void * data,
+        size_t size,
+        std::vector<float> & pcmf32,
+        std::vector<std::vector<float>> & pcmf32s,
+        bool stereo);
+
+// Resample PCM audio using a polyphase windowed-sinc (Kaiser) filter
+void resample(
+        const std::vector<float> & in,
+        std::vector<float> & out,
+        int sample_rate_in,
+        int sample_rate_out);
+
 // Write PCM data into WAV audio file
 class wav_writer {
 private:
@@ -4,11 +4,19 @@
 #include "httplib.h"
 #include "json.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <fstream>
+#include <list>
 #include <cstdio>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 #include <cstring>
 #include <sstream>
@@ -29,6 +37,10 @@ const std::string srt_format    = "srt";
 const std::string vjson_format  = "verbose_json";
 const std::string vtt_format    = "vtt";
 
+// /inference can send the segments as they are decoded instead of one response at the end
+const std::string ndjson_stream = "ndjson";
+const std::string sse_stream    = "sse";
+
 struct server_params
 {
     std::string hostname = "127.0.0.1";
@@ -38,6 +50,10 @@ struct server_params
     int32_t port          = 8080;
     int32_t read_timeout  = 600;
     int32_t write_timeout = 600;
+    int32_t n_parallel    = 1;
+    int32_t encoder_batch = 1;
+    int32_t encoder_wait  = 5;
+    int32_t cache_size_mb = 0;
 
     bool ffmpeg_converter = false;
 };
@@ -54,13 +70,25 @@ struct whisper_params {
     int32_t best_of       = 2;
     int32_t beam_size     = -1;
     int32_t audio_ctx     = 0;
+    int32_t n_draft       = 5;
+    int32_t vad_max_silence_ms = 1000;
+
+    // /stream
+    int32_t step_ms       = 500;
+    int32_t length_ms     = 10000;
+    int32_t keep_ms       = 200;
+    int32_t pause_ms      = 500;
 
     float word_thold      =  0.01f;
     float entropy_thold   =  2.40f;
     float logprob_thold   = -1.00f;
     float temperature     =  0.00f;
     float temperature_inc =  0.20f;
+    float vad_thold       =  0.60f;
+    float freq_thold      = 100.0f;
 
+    bool audio_ctx_auto  = false;
+    bool vad_trim        = false;
     bool speed_up        = false;
     bool debug_mode      = false;
     bool translate       = false;
@@ -75,13 +103,18 @@ struct whisper_params {
     bool print_progress  = false;
     bool no_timestamps   = false;
     bool use_gpu         = true;
+    bool use_mmap        = true;
+    bool kv_self_q8      = false;
+    bool kv_cross_q8     = false;
 
     std::string language        = "en";
     std::string prompt          = "";
     std::string font_path       = "/System/Library/Fonts/Supplemental/Courier New Bold.ttf";
     std::string model           = "models/ggml-base.en.bin";
+    std::string draft_model     = "";
 
     std::string response_format     = json_format;
+    std::string stream_format       = "";
 
     // [TDRZ] speaker turn string
     std::string tdrz_speaker_turn = " [SPEAKER_TURN]"; // TODO: set from command line
@@ -106,9 +139,14 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -bo N,     --best-of N         [%-7d] number of best candidates to keep\n",              params.best_of);
     fprintf(stderr, "  -bs N,     --beam-size N       [%-7d] beam size for beam search\n",                      params.beam_size);
     fprintf(stderr, "  -ac N,     --audio-ctx N       [%-7d] audio context size (0 - all)\n",                   params.audio_ctx);
+    fprintf(stderr, "  -aca,      --audio-ctx-auto    [%-7s] size the audio context to the input length\n",     params.audio_ctx_auto ? "true" : "false");
     fprintf(stderr, "  -wt N,     --word-thold N      [%-7.2f] word timestamp probability threshold\n",         params.word_thold);
     fprintf(stderr, "  -et N,     --entropy-thold N   [%-7.2f] entropy threshold for decoder fail\n",           params.entropy_thold);
     fprintf(stderr, "  -lpt N,    --logprob-thold N   [%-7.2f] log probability threshold for decoder fail\n",   params.logprob_thold);
+    fprintf(stderr, "  -vt,       --vad-trim          [%-7s] drop silence from the audio before the inference\n", params.vad_trim ? "true" : "false");
+    fprintf(stderr, "  -vth N,    --vad-thold N       [%-7.2f] voice activity detection threshold\n",           params.vad_thold);
+    fprintf(stderr, "  -fth N,    --freq-thold N      [%-7.2f] high-pass frequency cutoff\n",                   params.freq_thold);
+    fprintf(stderr, "  -vms N,    --vad-max-silence N [%-7d] silence longer than this (ms) is dropped\n",       params.vad_max_silence_ms);
     // fprintf(stderr, "  -su,       --speed-up          [%-7s] speed up audio by x2 (reduced accuracy)\n",        params.speed_up ? "true" : "false");
     fprintf(stderr, "  -debug,    --debug-mode        [%-7s] enable debug mode (eg. dump log_mel)\n",           params.debug_mode ? "true" : "false");
     fprintf(stderr, "  -tr,       --translate         [%-7s] translate from source language to english\n",      params.translate ? "true" : "false");
@@ -124,13 +162,26 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -dl,       --detect-language   [%-7s] exit after automatically detecting language\n",    params.detect_language ? "true" : "false");
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt\n",                                 params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
+    fprintf(stderr, "  -md FNAME, --draft-model FNAME [%-7s] draft model for speculative greedy decoding\n",  params.draft_model.c_str());
+    fprintf(stderr, "  -nd N,     --n-draft N         [%-7d] max number of tokens proposed by the draft model\n", params.n_draft);
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
+    fprintf(stderr, "  -nmm,      --no-mmap           [%-7s] read the model into memory instead of mapping it\n", params.use_mmap ? "false" : "true");
+    fprintf(stderr, "  -kvs8,     --kv-self-q8        [%-7s] store the self-attention keys in Q8_0\n",         params.kv_self_q8 ? "true" : "false");
+    fprintf(stderr, "  -kvc8,     --kv-cross-q8       [%-7s] store the cross-attention keys and values in Q8_0\n", params.kv_cross_q8 ? "true" : "false");
     // server params
     fprintf(stderr, "  --host HOST,                   [%-7s] Hostname/ip-adress for the server\n", sparams.hostname.c_str());
     fprintf(stderr, "  --port PORT,                   [%-7d] Port number for the server\n", sparams.port);
     fprintf(stderr, "  --public PATH,                 [%-7s] Path to the public folder\n", sparams.public_path.c_str());
     fprintf(stderr, "  --request-path PATH,           [%-7s] Request path for all requests\n", sparams.request_path.c_str());
-    fprintf(stderr, "  --convert,                     [%-7s] Convert audio to WAV, requires ffmpeg on the server", sparams.ffmpeg_converter ? "true" : "false");
+    fprintf(stderr, "  --convert,                     [%-7s] Convert non-WAV audio to WAV, requires ffmpeg on the server\n", sparams.ffmpeg_converter ? "true" : "false");
+    fprintf(stderr, "  -np N,     --parallel N        [%-7d] number of requests to process concurrently\n", sparams.n_parallel);
+    fprintf(stderr, "  -eb N,     --encoder-batch N   [%-7d] max number of concurrent requests to encode in one batch\n", sparams.encoder_batch);
+    fprintf(stderr, "  -ebw N,    --encoder-wait N    [%-7d] max time in ms a request waits for its encoder batch to fill\n", sparams.encoder_wait);
+    fprintf(stderr, "  -cs N,     --cache-size N      [%-7d] cache the responses of repeated uploads in up to N MB (0 - off)\n", sparams.cache_size_mb);
+    fprintf(stderr, "             --step N            [%-7d] /stream: audio step size in milliseconds\n", params.step_ms);
+    fprintf(stderr, "             --length N          [%-7d] /stream: audio length in milliseconds\n", params.length_ms);
+    fprintf(stderr, "             --keep N            [%-7d] /stream: audio to keep from the previous window in milliseconds\n", params.keep_ms);
+    fprintf(stderr, "             --pause N           [%-7d] /stream: silence in milliseconds that ends a window early (0 - off)\n", params.pause_ms);
     fprintf(stderr, "\n");
 }
 
@@ -152,9 +203,14 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params, serve
         else if (arg == "-bo"   || arg == "--best-of")         { params.best_of         = std::stoi(argv[++i]); }
         else if (arg == "-bs"   || arg == "--beam-size")       { params.beam_size       = std::stoi(argv[++i]); }
         else if (arg == "-ac"   || arg == "--audio-context")   { params.audio_ctx       = std::stoi(argv[++i]); }
+        else if (arg == "-aca"  || arg == "--audio-ctx-auto")  { params.audio_ctx_auto  = true; }
         else if (arg == "-wt"   || arg == "--word-thold")      { params.word_thold      = std::stof(argv[++i]); }
         else if (arg == "-et"   || arg == "--entropy-thold")   { params.entropy_thold   = std::stof(argv[++i]); }
         else if (arg == "-lpt"  || arg == "--logprob-thold")   { params.logprob_thold   = std::stof(argv[++i]); }
+        else if (arg == "-vt"   || arg == "--vad-trim")        { params.vad_trim        = true; }
+        else if (arg == "-vth"  || arg == "--vad-thold")       { params.vad_thold       = std::stof(argv[++i]); }
+        else if (arg == "-fth"  || arg == "--freq-thold")      { params.freq_thold      = std::stof(argv[++i]); }
+        else if (arg == "-vms"  || arg == "--vad-max-silence") { params.vad_max_silence_ms = std::stoi(argv[++i]); }
         // else if (arg == "-su"   || arg == "--speed-up")        { params.speed_up        = true; }
         else if (arg == "-debug"|| arg == "--debug-mode")      { params.debug_mode      = true; }
         else if (arg == "-tr"   || arg == "--translate")       { params.translate       = true; }
@@ -172,29 +228,982 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params, serve
         else if (arg == "-dl"   || arg == "--detect-language") { params.detect_language = true; }
         else if (                  arg == "--prompt")          { params.prompt          = argv[++i]; }
         else if (arg == "-m"    || arg == "--model")           { params.model           = argv[++i]; }
+        else if (arg == "-md"   || arg == "--draft-model")     { params.draft_model     = argv[++i]; }
+        else if (arg == "-nd"   || arg == "--n-draft")         { params.n_draft         = std::stoi(argv[++i]); }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = argv[++i]; }
         else if (arg == "-ng"   || arg == "--no-gpu")          { params.use_gpu         = false; }
+        else if (arg == "-nmm"  || arg == "--no-mmap")         { params.use_mmap        = false; }
+        else if (arg == "-kvs8" || arg == "--kv-self-q8")      { params.kv_self_q8      = true; }
+        else if (arg == "-kvc8" || arg == "--kv-cross-q8")     { params.kv_cross_q8     = true; }
         // server params
         else if (                  arg == "--port")            { sparams.port        = std::stoi(argv[++i]); }
         else if (                  arg == "--host")            { sparams.hostname    = argv[++i]; }
         else if (                  arg == "--public")          { sparams.public_path = argv[++i]; }
         else if (                  arg == "--request-path")    { sparams.request_path = argv[++i]; }
         else if (                  arg == "--convert")         { sparams.ffmpeg_converter     = true; }
+        else if (arg == "-np"   || arg == "--parallel")        { sparams.n_parallel  = std::stoi(argv[++i]); }
+        else if (arg == "-eb"   || arg == "--encoder-batch")   { sparams.encoder_batch = std::stoi(argv[++i]); }
+        else if (arg == "-ebw"  || arg == "--encoder-wait")    { sparams.encoder_wait  = std::stoi(argv[++i]); }
+        else if (arg == "-cs"   || arg == "--cache-size")      { sparams.cache_size_mb = std::stoi(argv[++i]); }
+        else if (                  arg == "--step")            { params.step_ms       = std::stoi(argv[++i]); }
+        else if (                  arg == "--length")          { params.length_ms     = std::stoi(argv[++i]); }
+        else if (                  arg == "--keep")            { params.keep_ms       = std::stoi(argv[++i]); }
+        else if (                  arg == "--pause")           { params.pause_ms      = std::stoi(argv[++i]); }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params, sparams);
             exit(0);
         }
-    }
+    }
+
+    return true;
+}
+
+// a stretch of audio kept by vad_trim(): samples [orig, orig + n) of the upload are at [trimmed, trimmed + n) of the trimmed audio
+struct vad_piece {
+    int64_t orig;
+    int64_t trimmed;
+    int64_t n;
+};
+
+// maps the timestamps of the trimmed audio back to the uploaded audio
+struct vad_map {
+    std::vector<vad_piece> pieces; // empty if the audio was not trimmed
+
+    // t is in centiseconds, as the segment and token timestamps
+    // an end timestamp at the border of two pieces belongs to the first one
+    int64_t to_orig(int64_t t, bool is_end = false) const {
+        if (pieces.empty()) {
+            return t;
+        }
+
+        const int64_t s = t*WHISPER_SAMPLE_RATE/100;
+
+        size_t k = 0;
+        while (k + 1 < pieces.size() && (is_end ? pieces[k + 1].trimmed < s : pieces[k + 1].trimmed <= s)) {
+            ++k;
+        }
+
+        const vad_piece & p = pieces[k];
+
+        return (p.orig + std::max<int64_t>(0, std::min(s - p.trimmed, p.n)))*100/WHISPER_SAMPLE_RATE;
+    }
+};
+
+// find the speech with the energy measure of vad_simple() (mean absolute amplitude after the same high-pass filter),
+// evaluated on 10 ms frames against the average of the whole input
+// silences longer than vad_max_silence_ms are dropped, keeping some padding around the speech
+// pcmf32 is replaced by the kept audio, offset is the position of pcmf32 in the upload
+// returns false if there is no speech at all
+bool vad_trim(std::vector<float> & pcmf32, int64_t offset, const whisper_params & params, vad_map & map) {
+    // below this, a frame is silence even if the whole input is quiet (about -60 dBFS)
+    const float energy_min = 1e-3f;
+
+    const int64_t n_samples   = pcmf32.size();
+    const int64_t n_frame     = WHISPER_SAMPLE_RATE/100;
+    const int64_t n_pad       = WHISPER_SAMPLE_RATE/5;
+    const int64_t n_max_sil   = std::max<int64_t>(2*n_pad, ((int64_t) WHISPER_SAMPLE_RATE*params.vad_max_silence_ms)/1000);
+
+    map.pieces.clear();
+
+    if (n_samples == 0) {
+        return false;
+    }
+
+    std::vector<float> filtered = pcmf32;
+    if (params.freq_thold > 0.0f) {
+        high_pass_filter(filtered, params.freq_thold, WHISPER_SAMPLE_RATE);
+    }
+
+    float energy_all = 0.0f;
+    for (int64_t i = 0; i < n_samples; ++i) {
+        energy_all += fabsf(filtered[i]);
+    }
+    energy_all /= n_samples;
+
+    const float thold = std::max(params.vad_thold*energy_all, energy_min);
+
+    // speech frames, padded and merged over short silences
+    std::vector<std::pair<int64_t, int64_t>> regions;
+
+    for (int64_t i0 = 0; i0 < n_samples; i0 += n_frame) {
+        const int64_t i1 = std::min(n_samples, i0 + n_frame);
+
+        float energy = 0.0f;
+        for (int64_t i = i0; i < i1; ++i) {
+            energy += fabsf(filtered[i]);
+        }
+        energy /= (i1 - i0);
+
+        if (energy <= thold) {
+            continue;
+        }
+
+        const int64_t r0 = std::max<int64_t>(0, i0 - n_pad);
+        const int64_t r1 = std::min(n_samples, i1 + n_pad);
+
+        if (!regions.empty() && r0 - regions.back().second <= n_max_sil) {
+            regions.back().second = r1;
+        } else {
+            regions.emplace_back(r0, r1);
+        }
+    }
+
+    if (regions.empty()) {
+        return false;
+    }
+
+    std::vector<float> kept;
+    kept.reserve(n_samples);
+
+    for (const auto & r : regions) {
+        map.pieces.push_back({ offset + r.first, (int64_t) kept.size(), r.second - r.first });
+        kept.insert(kept.end(), pcmf32.begin() + r.first, pcmf32.begin() + r.second);
+    }
+
+    pcmf32 = std::move(kept);
+
+    return true;
+}
+
+struct whisper_print_user_data {
+    const whisper_params * params;
+
+    const std::vector<std::vector<float>> * pcmf32s;
+    const vad_map * vad;
+    int progress_prev;
+};
+
+// a fixed set of whisper_state objects sharing the weights of one whisper_context
+// each in-flight request borrows one state per processor for the duration of its inference
+struct whisper_state_pool {
+    struct whisper_context * ctx = nullptr; // the model of new requests
+
+    std::vector<struct whisper_state *> states;
+    std::vector<struct whisper_state *> idle;
+
+    // the model replaced by swap() and the number of its states that are still borrowed
+    struct whisper_context * ctx_old = nullptr;
+    std::vector<struct whisper_state *> states_old;
+    int n_borrowed_old = 0;
+
+    int n_waiting = 0; // requests blocked in acquire()
+
+    int generation = 0; // incremented by swap()
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    // allocates n_states states of ctx, on failure the allocated ones are freed
+    // each state gets its own OpenVINO encoder on the given device. this has no effect on builds without OpenVINO
+    static bool init_states(struct whisper_context * ctx, int n_states, const std::string & openvino_device, std::vector<struct whisper_state *> & result) {
+        for (int i = 0; i < n_states; ++i) {
+            struct whisper_state * state = whisper_init_state(ctx);
+            if (state == nullptr) {
+                fprintf(stderr, "error: failed to allocate whisper state %d / %d\n", i + 1, n_states);
+                for (auto * s : result) {
+                    whisper_free_state(s);
+                }
+                result.clear();
+                return false;
+            }
+            whisper_ctx_init_openvino_encoder_with_state(ctx, state, nullptr, openvino_device.c_str(), nullptr);
+            result.push_back(state);
+        }
+
+        return true;
+    }
+
+    bool init(struct whisper_context * ctx_new, int n_states, const std::string & openvino_device) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        ctx = ctx_new;
+        if (!init_states(ctx, n_states, openvino_device, states)) {
+            return false;
+        }
+        idle = states;
+
+        return true;
+    }
+
+    int get_generation() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return generation;
+    }
+
+    size_t n_bytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        size_t result = 0;
+        for (struct whisper_state * state : states) {
+            result += whisper_state_n_bytes(state);
+        }
+
+        return result;
+    }
+
+    // blocks until n states are available, returns the time spent waiting in t_wait_us
+    // the states are taken all at once, so that concurrent requests cannot deadlock holding a part of them
+    // ctx_out is the model of the returned states, generation_out (if given) the generation of that model
+    std::vector<struct whisper_state *> acquire(int n, int64_t & t_wait_us, struct whisper_context * & ctx_out, int * generation_out = nullptr) {
+        const auto t_start = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        n_waiting++;
+        cv.wait(lock, [this, n] { return (int) idle.size() >= n; });
+        n_waiting--;
+
+        std::vector<struct whisper_state *> result(idle.end() - n, idle.end());
+        idle.resize(idle.size() - n);
+
+        ctx_out = ctx;
+        if (generation_out) {
+            *generation_out = generation;
+        }
+
+        t_wait_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t_start).count();
+
+        return result;
+    }
+
+    void release(const std::vector<struct whisper_state *> & borrowed) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            // the states of one request belong to the same model
+            if (std::find(states.begin(), states.end(), borrowed[0]) != states.end()) {
+                idle.insert(idle.end(), borrowed.begin(), borrowed.end());
+            } else {
+                n_borrowed_old -= borrowed.size();
+            }
+        }
+        cv.notify_all();
+    }
+
+    // replaces the model, the new requests use ctx_new and its states right away
+    // blocks until the requests that still run on the previous model have finished, then frees it
+    void swap(struct whisper_context * ctx_new, const std::vector<struct whisper_state *> & states_new) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            ctx_old        = ctx;
+            states_old     = states;
+            n_borrowed_old = states.size() - idle.size();
+
+            ctx    = ctx_new;
+            states = states_new;
+            idle   = states_new;
+
+            generation++;
+
+            cv.notify_all();
+
+            cv.wait(lock, [this] { return n_borrowed_old == 0; });
+        }
+
+        for (auto * state : states_old) {
+            whisper_free_state(state);
+        }
+        states_old.clear();
+
+        whisper_free(ctx_old);
+        ctx_old = nullptr;
+    }
+
+    void free() {
+        for (auto * state : states) {
+            whisper_free_state(state);
+        }
+        states.clear();
+        idle.clear();
+
+        whisper_free(ctx);
+        ctx = nullptr;
+    }
+};
+
+// loads a model in the background for /load - the current model keeps serving requests meanwhile
+// the new model replaces it only when it and all of its states are ready, so a failed load leaves the server as it was
+struct model_loader {
+    std::mutex  mutex;
+    std::thread thread;
+
+    std::string model;            // the model in use
+    std::string model_loading;    // the model of the last load
+    std::string status = "ready"; // "loading", "ready" or "failed"
+    std::string stage  = "";      // while loading: "weights", "states" or "swap"
+    std::string error  = "";      // why the last load failed
+
+    float  progress = 1.0f; // of the weights
+    double t_load_s = 0.0;  // time of the last load, without the swap
+    double t_swap_s = 0.0;  // time spent waiting for the requests on the previous model
+
+    std::chrono::steady_clock::time_point t_start;
+
+    ~model_loader() {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    // returns false if another load is still running
+    bool start(whisper_state_pool & pool, const std::string & path, whisper_context_params cparams, int n_states, const std::string & openvino_device, int encoder_batch, int encoder_wait) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (status == "loading") {
+            return false;
+        }
+
+        if (thread.joinable()) {
+            thread.join();
+        }
+
+        model_loading = path;
+        status   = "loading";
+        stage    = "weights";
+        error    = "";
+        progress = 0.0f;
+        t_load_s = 0.0;
+        t_swap_s = 0.0;
+        t_start  = std::chrono::steady_clock::now();
+
+        thread = std::thread([this, &pool, path, cparams, n_states, openvino_device, encoder_batch, encoder_wait]() mutable {
+            cparams.progress_callback = [](float progress, void * user_data) {
+                model_loader * loader = (model_loader *) user_data;
+
+                std::lock_guard<std::mutex> lock(loader->mutex);
+                loader->progress = progress;
+            };
+            cparams.progress_callback_user_data = this;
+
+            struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(path.c_str(), cparams);
+            if (ctx == nullptr) {
+                fail("failed to load the model");
+                return;
+            }
+
+            set_stage("states");
+
+            std::vector<struct whisper_state *> states;
+            if (!whisper_state_pool::init_states(ctx, n_states, openvino_device, states)) {
+                whisper_free(ctx);
+                fail("failed to allocate the whisper states");
+                return;
+            }
+
+            if (whisper_ctx_init_encoder_batch(ctx, encoder_batch, encoder_wait) != 0) {
+                for (auto * state : states) {
+                    whisper_free_state(state);
+                }
+                whisper_free(ctx);
+                fail("failed to initialize the encoder batch");
+                return;
+            }
+
+            const double t_load = elapsed_s();
+
+            set_stage("swap");
+
+            pool.swap(ctx, states);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                model    = path;
+                status   = "ready";
+                stage    = "";
+                t_load_s = t_load;
+                t_swap_s = elapsed_s() - t_load;
+            }
+
+            fprintf(stderr, "load: '%s' loaded in %.2f s, waited %.2f s for the requests on the previous model\n",
+                    path.c_str(), t_load_s, t_swap_s);
+        });
+
+        return true;
+    }
+
+    json to_json() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        json result = json{
+            {"status", status},
+            {"model", model},
+        };
+
+        if (status == "loading") {
+            result["loading"]  = model_loading;
+            result["stage"]    = stage;
+            result["progress"] = progress;
+            result["elapsed"]  = elapsed_s();
+        } else if (status == "ready") {
+            result["load_time"] = t_load_s;
+            result["swap_time"] = t_swap_s;
+        } else {
+            result["loading"] = model_loading;
+            result["error"]   = error;
+        }
+
+        return result;
+    }
+
+private:
+    double elapsed_s() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t_start).count()*1e-6;
+    }
+
+    void set_stage(const char * name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        stage = name;
+    }
+
+    void fail(const char * reason) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        fprintf(stderr, "error: %s from '%s', keeping '%s'\n", reason, model_loading.c_str(), model.c_str());
+
+        status = "failed";
+        stage  = "";
+        error  = reason;
+    }
+};
+
+// 64-bit hash of the samples, 8 bytes at a time - it only has to tell repeated uploads apart
+uint64_t hash_pcm(const std::vector<float> & pcm, uint64_t h) {
+    const uint64_t m = 0x9e3779b97f4a7c15ull;
+
+    const char * data = (const char *) pcm.data();
+    const size_t n    = pcm.size()*sizeof(float);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w)*m;
+        h ^= h >> 29;
+    }
+    for (; i < n; ++i) {
+        h = (h ^ (uint8_t) data[i])*m;
+    }
+
+    h ^= n;
+    h ^= h >> 32;
+
+    return h;
+}
+
+// a bounded LRU of /inference responses, keyed by the audio, the model and every parameter that changes the result
+// a retried request with the same audio is answered without running the model
+struct response_cache {
+    struct entry {
+        std::string key;
+        std::string content;
+        std::string content_type;
+    };
+
+    size_t n_bytes_max = 0;
+    size_t n_bytes     = 0;
+
+    std::list<entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<entry>::iterator> index;
+
+    std::mutex mutex;
+
+    static size_t entry_bytes(const entry & e) {
+        return 2*e.key.size() + e.content.size() + e.content_type.size() + 64;
+    }
+
+    // the parameters of the request that can change the response
+    static std::string make_key(const whisper_params & params, int generation, const std::vector<float> & pcmf32, const std::vector<std::vector<float>> & pcmf32s) {
+        uint64_t h = hash_pcm(pcmf32, 0);
+        if (params.diarize) {
+            for (const auto & channel : pcmf32s) {
+                h = hash_pcm(channel, h);
+            }
+        }
+
+        std::stringstream ss;
+        ss << std::hex << h << std::dec << "|" << generation << "|" << params.response_format << "|"
+           << params.n_processors << "|" << params.offset_t_ms << "|" << params.offset_n << "|" << params.duration_ms << "|"
+           << params.max_context << "|" << params.max_len << "|" << params.best_of << "|" << params.beam_size << "|"
+           << params.audio_ctx << "|" << params.audio_ctx_auto << "|" << params.word_thold << "|" << params.entropy_thold << "|"
+           << params.logprob_thold << "|" << params.temperature << "|" << params.temperature_inc << "|"
+           << params.vad_trim << "|" << params.vad_thold << "|" << params.freq_thold << "|" << params.vad_max_silence_ms << "|"
+           << params.speed_up << "|" << params.translate << "|" << params.detect_language << "|" << params.diarize << "|"
+           << params.tinydiarize << "|" << params.split_on_word << "|" << params.no_timestamps << "|"
+           << params.language << "|" << params.prompt;
+
+        return ss.str();
+    }
+
+    bool get(const std::string & key, std::string & content, std::string & content_type) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return false;
+        }
+
+        entries.splice(entries.begin(), entries, it->second);
+
+        content      = it->second->content;
+        content_type = it->second->content_type;
+
+        return true;
+    }
+
+    void put(const std::string & key, const std::string & content, const std::string & content_type) {
+        entry e = { key, content, content_type };
+
+        const size_t n = entry_bytes(e);
+        if (n > n_bytes_max) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (index.count(key) > 0) {
+            return;
+        }
+
+        while (n_bytes + n > n_bytes_max) {
+            n_bytes -= entry_bytes(entries.back());
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+
+        entries.push_front(std::move(e));
+        index[key] = entries.begin();
+        n_bytes += n;
+    }
+
+    void stats(size_t & n_entries, size_t & n_bytes_used) {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_entries    = entries.size();
+        n_bytes_used = n_bytes;
+    }
+};
+
+// the performance counters of each borrowed state
+std::vector<whisper_timings> get_timings(const std::vector<struct whisper_state *> & states) {
+    std::vector<whisper_timings> result;
+    for (auto * state : states) {
+        result.push_back(whisper_get_timings_from_state(state));
+    }
+    return result;
+}
+
+// the number of shards of the metrics counters, each thread adds to one of them
+const int metrics_n_shards = 8;
+
+int metrics_shard() {
+    static std::atomic<int> n_threads(0);
+    static thread_local int ith = n_threads++;
+    return ith % metrics_n_shards;
+}
+
+// a Prometheus histogram - observations only do relaxed atomic adds on the shard of the calling thread, so the
+// request threads neither lock nor share cache lines, and /metrics sums up the shards when it is scraped
+struct metrics_histogram {
+    std::vector<double> bounds; // upper bounds of the buckets, +Inf is implicit
+
+    int stride = 0; // counters per shard: buckets, +Inf, sum, padded to a cache line
+
+    std::unique_ptr<std::atomic<uint64_t>[]> cells;
+
+    explicit metrics_histogram(std::vector<double> bounds_) : bounds(std::move(bounds_)) {
+        stride = ((bounds.size() + 2 + 7)/8)*8;
+        cells.reset(new std::atomic<uint64_t>[metrics_n_shards*stride]);
+        for (int i = 0; i < metrics_n_shards*stride; ++i) {
+            cells[i] = 0;
+        }
+    }
+
+    void observe(double v) {
+        std::atomic<uint64_t> * shard = cells.get() + metrics_shard()*stride;
+
+        const size_t i = std::lower_bound(bounds.begin(), bounds.end(), v) - bounds.begin();
+
+        shard[i].fetch_add(1, std::memory_order_relaxed);
+        shard[bounds.size() + 1].fetch_add((uint64_t) std::llround(std::max(0.0, v)*1e6), std::memory_order_relaxed);
+    }
+
+    // appends the _bucket, _sum and _count series, labels is empty or 'name="value",'
+    void write(std::stringstream & ss, const std::string & name, const std::string & labels) const {
+        std::vector<uint64_t> counts(bounds.size() + 2, 0);
+        for (int s = 0; s < metrics_n_shards; ++s) {
+            for (size_t i = 0; i < counts.size(); ++i) {
+                counts[i] += cells[s*stride + i].load(std::memory_order_relaxed);
+            }
+        }
+
+        uint64_t total = 0;
+        for (size_t i = 0; i <= bounds.size(); ++i) {
+            total += counts[i];
+            ss << name << "_bucket{" << labels << "le=\"";
+            if (i < bounds.size()) {
+                ss << bounds[i];
+            } else {
+                ss << "+Inf";
+            }
+            ss << "\"} " << total << "\n";
+        }
+
+        const std::string braces = labels.empty() ? "" : "{" + labels.substr(0, labels.size() - 1) + "}";
+
+        ss << name << "_sum" << braces << " " << counts[bounds.size() + 1]*1e-6 << "\n";
+        ss << name << "_count" << braces << " " << total << "\n";
+    }
+};
+
+// a Prometheus counter, sharded like the histograms
+struct metrics_counter {
+    std::atomic<uint64_t> cells[metrics_n_shards*8];
+
+    metrics_counter() {
+        for (auto & c : cells) {
+            c = 0;
+        }
+    }
+
+    void add(uint64_t n) {
+        cells[metrics_shard()*8].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t result = 0;
+        for (int s = 0; s < metrics_n_shards; ++s) {
+            result += cells[s*8].load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+};
+
+// what /metrics exports, see record() for the per-request part
+struct server_metrics {
+    // the stages of whisper_timings, in the order of stage_names
+    static const int n_stages = 7;
+
+    const char * stage_names[n_stages] = { "mel", "encode", "decode", "batchd", "prompt", "sample", "draft" };
+
+    std::vector<metrics_histogram> stage_seconds;
+
+    metrics_histogram queue_seconds     { { 0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0 } };
+    metrics_histogram inference_seconds { { 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0, 120.0, 300.0 } };
+    metrics_histogram rtf               { { 0.01, 0.02, 0.05, 0.1, 0.2, 0.3, 0.5, 0.75, 1.0, 1.5, 2.0, 5.0 } };
+
+    metrics_counter requests_inference;
+    metrics_counter requests_stream;
+    metrics_counter requests_failed;
+    metrics_counter audio_us;  // audio processed, in microseconds
+    metrics_counter fail_p;
+    metrics_counter fail_h;
+    metrics_counter draft;
+    metrics_counter draft_accept;
+    metrics_counter cache_hits;
+    metrics_counter cache_misses;
+
+    server_metrics() {
+        stage_seconds.reserve(n_stages);
+        for (int i = 0; i < n_stages; ++i) {
+            stage_seconds.emplace_back(std::vector<double>{ 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0 });
+        }
+    }
+
+    // t0 and t1 are the counters of the borrowed states before and after the request, states[0] holds the merged
+    // stage times of whisper_full_parallel_with_states() and the threshold failures are counted on each state
+    void record(bool is_stream, const std::vector<whisper_timings> & t0, const std::vector<whisper_timings> & t1,
+                int64_t t_queue_us, int64_t t_inference_us, int64_t n_samples, bool ok) {
+        (is_stream ? requests_stream : requests_inference).add(1);
+
+        if (!ok) {
+            requests_failed.add(1);
+        }
+
+        const int64_t stage_us[n_stages] = {
+            t1[0].t_mel_us    - t0[0].t_mel_us,
+            t1[0].t_encode_us - t0[0].t_encode_us,
+            t1[0].t_decode_us - t0[0].t_decode_us,
+            t1[0].t_batchd_us - t0[0].t_batchd_us,
+            t1[0].t_prompt_us - t0[0].t_prompt_us,
+            t1[0].t_sample_us - t0[0].t_sample_us,
+            t1[0].t_draft_us  - t0[0].t_draft_us,
+        };
+
+        for (int i = 0; i < n_stages; ++i) {
+            // the draft stage only exists with a draft model
+            if (i + 1 < n_stages || stage_us[i] > 0) {
+                stage_seconds[i].observe(stage_us[i]*1e-6);
+            }
+        }
+
+        for (size_t i = 0; i < t0.size(); ++i) {
+            fail_p.add(t1[i].n_fail_p - t0[i].n_fail_p);
+            fail_h.add(t1[i].n_fail_h - t0[i].n_fail_h);
+        }
+
+        draft.add(t1[0].n_draft - t0[0].n_draft);
+        draft_accept.add(t1[0].n_draft_accept - t0[0].n_draft_accept);
+
+        const int64_t n_audio_us = n_samples*1000000/WHISPER_SAMPLE_RATE;
+
+        audio_us.add(n_audio_us);
+        queue_seconds.observe(t_queue_us*1e-6);
+        inference_seconds.observe(t_inference_us*1e-6);
+
+        // a stream lasts as long as its audio, so its real-time factor says nothing
+        if (!is_stream && n_audio_us > 0) {
+            rtf.observe(double(t_inference_us)/n_audio_us);
+        }
+    }
+
+    std::string to_prometheus(whisper_state_pool & pool, response_cache & cache) const {
+        std::stringstream ss;
+        ss.precision(12);
+
+        auto family = [&](const char * name, const char * type, const char * help) {
+            ss << "# HELP " << name << " " << help << "\n";
+            ss << "# TYPE " << name << " " << type << "\n";
+        };
+
+        family("whisper_requests_total", "counter", "Number of finished requests.");
+        ss << "whisper_requests_total{endpoint=\"inference\"} " << requests_inference.value() << "\n";
+        ss << "whisper_requests_total{endpoint=\"stream\"} "    << requests_stream.value()    << "\n";
+
+        family("whisper_requests_failed_total", "counter", "Number of requests that failed in the inference.");
+        ss << "whisper_requests_failed_total " << requests_failed.value() << "\n";
+
+        family("whisper_audio_seconds_total", "counter", "Seconds of audio processed.");
+        ss << "whisper_audio_seconds_total " << audio_us.value()*1e-6 << "\n";
+
+        family("whisper_fallbacks_total", "counter", "Number of decoding fallbacks to a higher temperature.");
+        ss << "whisper_fallbacks_total{reason=\"logprob\"} " << fail_p.value() << "\n";
+        ss << "whisper_fallbacks_total{reason=\"entropy\"} " << fail_h.value() << "\n";
+
+        family("whisper_draft_tokens_total", "counter", "Number of tokens proposed by the draft model.");
+        ss << "whisper_draft_tokens_total " << draft.value() << "\n";
+
+        family("whisper_draft_tokens_accepted_total", "counter", "Number of draft tokens accepted by the model.");
+        ss << "whisper_draft_tokens_accepted_total " << draft_accept.value() << "\n";
+
+        family("whisper_cache_requests_total", "counter", "Number of cache lookups of /inference, by result.");
+        ss << "whisper_cache_requests_total{result=\"hit\"} "  << cache_hits.value()   << "\n";
+        ss << "whisper_cache_requests_total{result=\"miss\"} " << cache_misses.value() << "\n";
+
+        {
+            size_t n_entries = 0;
+            size_t n_bytes   = 0;
+            cache.stats(n_entries, n_bytes);
+
+            family("whisper_cache_entries", "gauge", "Number of responses in the cache.");
+            ss << "whisper_cache_entries " << n_entries << "\n";
+
+            family("whisper_cache_bytes", "gauge", "Memory used by the cached responses.");
+            ss << "whisper_cache_bytes " << n_bytes << "\n";
+        }
+
+        family("whisper_stage_seconds", "histogram", "Time spent per request in each stage of the inference.");
+        for (int i = 0; i < n_stages; ++i) {
+            stage_seconds[i].write(ss, "whisper_stage_seconds", std::string("stage=\"") + stage_names[i] + "\",");
+        }
+
+        family("whisper_queue_seconds", "histogram", "Time a request waited for free states.");
+        queue_seconds.write(ss, "whisper_queue_seconds", "");
+
+        family("whisper_inference_seconds", "histogram", "Time from getting the states to the end of the inference.");
+        inference_seconds.write(ss, "whisper_inference_seconds", "");
+
+        family("whisper_real_time_factor", "histogram", "Inference time divided by the audio duration, /inference only.");
+        rtf.write(ss, "whisper_real_time_factor", "");
+
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+
+            family("whisper_states", "gauge", "Number of whisper states in the pool.");
+            ss << "whisper_states " << pool.states.size() << "\n";
+
+            family("whisper_states_active", "gauge", "Number of states borrowed by running requests.");
+            ss << "whisper_states_active " << pool.states.size() - pool.idle.size() << "\n";
+
+            family("whisper_requests_waiting", "gauge", "Number of requests waiting for free states.");
+            ss << "whisper_requests_waiting " << pool.n_waiting << "\n";
+        }
+
+        return ss.str();
+    }
+};
+
+// sliding-window transcription of a live audio stream, as in examples/stream
+// the current window is transcribed again every step_ms of new audio and the result is sent as partial, until
+// the window is full (length_ms) or ends in a pause of pause_ms - then its segments are final and the next
+// window starts with the last keep_ms of the audio, conditioned on the text of the previous window
+struct stream_session {
+    struct whisper_context * ctx   = nullptr;
+    struct whisper_state   * state = nullptr;
+
+    whisper_params params;
+
+    bool is_f32 = false; // the samples are 32-bit floats instead of 16-bit integers
+
+    std::string        bytes;  // received bytes that do not make up a whole sample yet
+    std::vector<float> pcm_in; // received audio that is not in the window yet
+    std::vector<float> pcm;    // audio of the current window
+
+    int64_t t_window = 0; // start of the window in the stream, in samples
+
+    std::vector<whisper_token> prompt; // text tokens of the last final window
+    std::string partial;               // text of the last partial result
+
+    int n_pass  = 0;
+    int n_final = 0;
+
+    void push(const char * data, size_t n) {
+        const size_t n_sample = is_f32 ? sizeof(float) : sizeof(int16_t);
+
+        bytes.append(data, n);
+
+        const size_t n_whole = bytes.size()/n_sample;
+        for (size_t i = 0; i < n_whole; ++i) {
+            if (is_f32) {
+                float v;
+                memcpy(&v, bytes.data() + i*n_sample, sizeof(v));
+                pcm_in.push_back(v);
+            } else {
+                int16_t v;
+                memcpy(&v, bytes.data() + i*n_sample, sizeof(v));
+                pcm_in.push_back(float(v)/32768.0f);
+            }
+        }
+
+        bytes.erase(0, n_whole*n_sample);
+    }
+
+    // transcribe the received audio, appends the resulting events to out as NDJSON lines
+    // with flush, the end of the stream has been reached and all the audio is transcribed as final
+    bool process(bool flush, std::string & out) {
+        const size_t n_step   = std::max<int64_t>(1, ((int64_t) WHISPER_SAMPLE_RATE*params.step_ms)/1000);
+        const size_t n_length = std::max<int64_t>(n_step, ((int64_t) WHISPER_SAMPLE_RATE*params.length_ms)/1000);
+        const size_t n_keep   = std::min<int64_t>(n_length/2, ((int64_t) WHISPER_SAMPLE_RATE*params.keep_ms)/1000);
+
+        while (pcm_in.size() >= n_step || (flush && (!pcm_in.empty() || !pcm.empty()))) {
+            const size_t n_take = std::min(pcm_in.size(), n_length - pcm.size());
+
+            pcm.insert(pcm.end(), pcm_in.begin(), pcm_in.begin() + n_take);
+            pcm_in.erase(pcm_in.begin(), pcm_in.begin() + n_take);
+
+            bool is_pause = false;
+            if (params.pause_ms > 0 && pcm.size() > (size_t) WHISPER_SAMPLE_RATE) {
+                std::vector<float> pcm_vad(pcm);
+                is_pause = ::vad_simple(pcm_vad, WHISPER_SAMPLE_RATE, params.pause_ms, params.vad_thold, params.freq_thold, false);
+            }
+
+            const bool is_full  = pcm.size() >= n_length;
+            const bool is_final = is_full || is_pause || (flush && pcm_in.empty());
+
+            // whisper_full() does not process less than 1 s of audio
+            if (pcm.size() <= (size_t) WHISPER_SAMPLE_RATE && !is_final) {
+                continue;
+            }
+
+            if (!transcribe(is_final, out)) {
+                return false;
+            }
+
+            if (is_final) {
+                // after a pause, the kept audio would be silence, and at the end of the stream there is no next window
+                const size_t n_next = is_full && !is_pause && !(flush && pcm_in.empty()) ? n_keep : 0;
+
+                t_window += pcm.size() - n_next;
+                pcm.erase(pcm.begin(), pcm.end() - n_next);
+            }
+        }
+
+        return true;
+    }
+
+    bool transcribe(bool is_final, std::string & out) {
+        const int64_t t_offset = (100*t_window)/WHISPER_SAMPLE_RATE; // centiseconds
+        const int64_t t_length = (100*(int64_t) pcm.size())/WHISPER_SAMPLE_RATE;
+
+        // pad a short tail with silence, so that its last words are transcribed
+        std::vector<float> pcm_pass(pcm);
+        pcm_pass.resize(std::max(pcm_pass.size(), (size_t) (WHISPER_SAMPLE_RATE*11)/10), 0.0f);
+
+        whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+        wparams.print_progress   = false;
+        wparams.print_realtime   = false;
+        wparams.print_timestamps = false;
+        wparams.translate        = params.translate;
+        wparams.language         = params.language.c_str();
+        wparams.n_threads        = params.n_threads;
+        wparams.audio_ctx        = params.audio_ctx;
+        wparams.audio_ctx_auto   = params.audio_ctx_auto;
+        wparams.temperature_inc  = params.no_fallback ? 0.0f : wparams.temperature_inc;
+        wparams.entropy_thold    = params.entropy_thold;
+        wparams.logprob_thold    = params.logprob_thold;
+
+        // the window is transcribed again with more audio, so the state must not keep its text
+        wparams.no_context       = true;
+        wparams.prompt_tokens    = prompt.empty() ? nullptr : prompt.data();
+        wparams.prompt_n_tokens  = prompt.size();
+
+        n_pass++;
+
+        if (whisper_full_with_state(ctx, state, wparams, pcm_pass.data(), pcm_pass.size()) != 0) {
+            out += json{{"type", "error"}, {"error", "failed to process audio"}}.dump() + "\n";
+            return false;
+        }
+
+        const int n_segments = whisper_full_n_segments_from_state(state);
+
+        if (!is_final) {
+            std::string text;
+            for (int i = 0; i < n_segments; ++i) {
+                text += whisper_full_get_segment_text_from_state(state, i);
+            }
+
+            if (text != partial) {
+                partial = text;
+
+                out += json{
+                    {"type",  "partial"},
+                    {"start", t_offset*0.01},
+                    {"end",   (t_offset + t_length)*0.01},
+                    {"text",  text},
+                }.dump(-1, ' ', false, json::error_handler_t::replace) + "\n";
+            }
+
+            return true;
+        }
 
-    return true;
-}
+        prompt.clear();
+
+        for (int i = 0; i < n_segments; ++i) {
+            // the padding of a short window is not part of the stream
+            const int64_t t0 = std::min(whisper_full_get_segment_t0_from_state(state, i), t_length);
+            const int64_t t1 = std::min(whisper_full_get_segment_t1_from_state(state, i), t_length);
+
+            out += json{
+                {"type",  "final"},
+                {"start", (t_offset + t0)*0.01},
+                {"end",   (t_offset + t1)*0.01},
+                {"text",  whisper_full_get_segment_text_from_state(state, i)},
+            }.dump(-1, ' ', false, json::error_handler_t::replace) + "\n";
+
+            const int n_tokens = whisper_full_n_tokens_from_state(state, i);
+            for (int j = 0; j < n_tokens; ++j) {
+                const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
+                if (id < whisper_token_eot(ctx)) {
+                    prompt.push_back(id);
+                }
+            }
+        }
 
-struct whisper_print_user_data {
-    const whisper_params * params;
+        partial.clear();
+        n_final += n_segments;
 
-    const std::vector<std::vector<float>> * pcmf32s;
-    int progress_prev;
+        return true;
+    }
 };
 
 void check_ffmpeg_availibility() {
@@ -278,11 +1287,12 @@ void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct wh
     }
 }
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
+    const auto & vad     = *((whisper_print_user_data *) user_data)->vad;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
 
     std::string speaker = "";
 
@@ -298,8 +1308,8 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
 
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = vad.to_orig(whisper_full_get_segment_t0_from_state(state, i));
+            t1 = vad.to_orig(whisper_full_get_segment_t1_from_state(state, i), true);
         }
 
         if (!params.no_timestamps) {
@@ -311,29 +1321,29 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
         }
 
         if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                    const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                     if (id >= whisper_token_eot(ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                const float  p    = whisper_full_get_token_p_from_state   (state, i, j);
 
                 const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
 
                 printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
             }
         } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
 
             printf("%s%s", speaker.c_str(), text);
         }
 
         if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+            if (whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                 printf("%s", params.tdrz_speaker_turn.c_str());
             }
         }
@@ -346,17 +1356,17 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
     }
 }
 
-std::string output_str(struct whisper_context * ctx, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+std::string output_str(struct whisper_state * state, const whisper_params & params, std::vector<std::vector<float>> pcmf32s, const vad_map & vad) {
     std::stringstream result;
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
         {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = vad.to_orig(whisper_full_get_segment_t0_from_state(state, i));
+            const int64_t t1 = vad.to_orig(whisper_full_get_segment_t1_from_state(state, i), true);
             speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
         }
 
@@ -365,6 +1375,181 @@ std::string output_str(struct whisper_context * ctx, const whisper_params & para
     return result.str();
 }
 
+// the audio and the parameters of one /inference request
+// a streamed response is produced after the handler returned, so the content provider shares the ownership
+struct inference_request {
+    whisper_params params;
+
+    std::string filename;
+
+    std::vector<float>              pcmf32;  // mono-channel F32 PCM
+    std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
+
+    vad_map vad;
+};
+
+// adjusts the language options to the model and prints what is going to be processed
+void print_request_info(struct whisper_context * ctx, whisper_params & params, const std::string & filename, int n_samples, int n_states) {
+    // print system information
+    {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
+                params.n_threads*params.n_processors, std::thread::hardware_concurrency(), whisper_print_system_info());
+    }
+
+    // print some info about the processing
+    {
+        fprintf(stderr, "\n");
+        if (!whisper_is_multilingual(ctx)) {
+            if (params.language != "en" || params.translate) {
+                params.language = "en";
+                params.translate = false;
+                fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
+            }
+        }
+        if (params.detect_language) {
+            params.language = "auto";
+        }
+        fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, %d processors, lang = %s, task = %s, %stimestamps = %d ...\n",
+                __func__, filename.c_str(), n_samples, float(n_samples)/WHISPER_SAMPLE_RATE,
+                params.n_threads, n_states,
+                params.language.c_str(),
+                params.translate ? "translate" : "transcribe",
+                params.tinydiarize ? "tdrz = 1, " : "",
+                params.no_timestamps ? 0 : 1);
+
+        fprintf(stderr, "\n");
+    }
+}
+
+// the whisper_full() parameters of a request, the callbacks are set by the caller
+// params.language must outlive the returned struct
+whisper_full_params request_full_params(const whisper_params & params, struct whisper_context * ctx_draft) {
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+
+    wparams.print_realtime   = false;
+    wparams.print_progress   = params.print_progress;
+    wparams.print_timestamps = !params.no_timestamps;
+    wparams.print_special    = params.print_special;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.detect_language  = params.detect_language;
+    wparams.n_threads        = params.n_threads;
+    wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
+    wparams.offset_ms        = params.offset_t_ms;
+    wparams.duration_ms      = params.duration_ms;
+
+    wparams.thold_pt         = params.word_thold;
+    wparams.max_len          = params.max_len == 0 ? 60 : params.max_len;
+    wparams.split_on_word    = params.split_on_word;
+    wparams.audio_ctx        = params.audio_ctx;
+    wparams.audio_ctx_auto   = params.audio_ctx_auto;
+
+    wparams.speed_up         = params.speed_up;
+    wparams.debug_mode       = params.debug_mode;
+
+    wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+
+    wparams.initial_prompt   = params.prompt.c_str();
+
+    wparams.greedy.best_of        = params.best_of;
+    wparams.beam_search.beam_size = params.beam_size;
+
+    wparams.draft.ctx     = ctx_draft;
+    wparams.draft.n_draft = params.n_draft;
+
+    wparams.temperature      = params.temperature;
+    wparams.temperature_inc  = params.temperature_inc;
+    wparams.entropy_thold    = params.entropy_thold;
+    wparams.logprob_thold    = params.logprob_thold;
+
+    wparams.no_timestamps    = params.no_timestamps;
+    wparams.token_timestamps = !params.no_timestamps && params.response_format == vjson_format;
+
+    return wparams;
+}
+
+// one segment as in the verbose_json response
+json segment_to_json(struct whisper_context * ctx, struct whisper_state * state, int i, const whisper_params & params, const vad_map & vad) {
+    json segment = json{
+        {"id", i},
+        {"text", whisper_full_get_segment_text_from_state(state, i)},
+    };
+
+    if (!params.no_timestamps) {
+        segment["start"] = vad.to_orig(whisper_full_get_segment_t0_from_state(state, i)) * 0.01;
+        segment["end"] = vad.to_orig(whisper_full_get_segment_t1_from_state(state, i), true) * 0.01;
+    }
+
+    float total_logprob = 0;
+    const int n_tokens = whisper_full_n_tokens_from_state(state, i);
+    for (int j = 0; j < n_tokens; ++j) {
+        whisper_token_data token = whisper_full_get_token_data_from_state(state, i, j);
+        if (token.id >= whisper_token_eot(ctx)) {
+            continue;
+        }
+
+        segment["tokens"].push_back(token.id);
+        json word = json{{"word", whisper_full_get_token_text_from_state(ctx, state, i, j)}};
+        if (!params.no_timestamps) {
+            word["start"] = vad.to_orig(token.t0) * 0.01;
+            word["end"] = vad.to_orig(token.t1, true) * 0.01;
+        }
+        word["probability"] = token.p;
+        total_logprob += token.plog;
+        segment["words"].push_back(word);
+    }
+
+    segment["temperature"] = params.temperature;
+    segment["avg_logprob"] = total_logprob / n_tokens;
+
+    // TODO compression_ratio and no_speech_prob are not implemented yet
+    // segment["compression_ratio"] = 0;
+    // segment["no_speech_prob"] = 0;
+
+    return segment;
+}
+
+// one event of a streamed /inference response: a line of NDJSON or a server-sent event
+std::string stream_event(const whisper_params & params, const json & event) {
+    const std::string data = event.dump(-1, ' ', false, json::error_handler_t::replace);
+
+    return params.stream_format == sse_stream ? "data: " + data + "\n\n" : data + "\n";
+}
+
+struct whisper_stream_user_data {
+    whisper_print_user_data * print;
+
+    DataSink * sink;
+
+    std::atomic<bool> is_aborted; // the client closed the connection
+};
+
+// sends each new segment to the client of a streamed /inference request as soon as it is decoded
+void whisper_stream_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
+    auto & data = *((whisper_stream_user_data *) user_data);
+
+    const auto & params = *data.print->params;
+
+    if (params.print_realtime) {
+        whisper_print_segment_callback(ctx, state, n_new, data.print);
+    }
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+
+    for (int i = n_segments - n_new; i < n_segments && !data.is_aborted; i++) {
+        json event = json{{"type", "segment"}};
+        event.update(segment_to_json(ctx, state, i, params, *data.print->vad));
+
+        const std::string out = stream_event(params, event);
+        if (!data.sink->write(out.data(), out.size())) {
+            data.is_aborted = true;
+        }
+    }
+}
+
 bool parse_str_to_bool(const std::string & s) {
     if (s == "true" || s == "1" || s == "yes" || s == "y") {
         return true;
@@ -406,6 +1591,26 @@ void get_req_parameters(const Request & req, whisper_params & params)
     {
         params.audio_ctx = std::stof(req.get_file_value("audio_ctx").content);
     }
+    if (req.has_file("audio_ctx_auto"))
+    {
+        params.audio_ctx_auto = parse_str_to_bool(req.get_file_value("audio_ctx_auto").content);
+    }
+    if (req.has_file("vad_trim"))
+    {
+        params.vad_trim = parse_str_to_bool(req.get_file_value("vad_trim").content);
+    }
+    if (req.has_file("vad_thold"))
+    {
+        params.vad_thold = std::stof(req.get_file_value("vad_thold").content);
+    }
+    if (req.has_file("freq_thold"))
+    {
+        params.freq_thold = std::stof(req.get_file_value("freq_thold").content);
+    }
+    if (req.has_file("vad_max_silence"))
+    {
+        params.vad_max_silence_ms = std::stoi(req.get_file_value("vad_max_silence").content);
+    }
     if (req.has_file("word_thold"))
     {
         params.word_thold = std::stof(req.get_file_value("word_thold").content);
@@ -458,6 +1663,10 @@ void get_req_parameters(const Request & req, whisper_params & params)
     {
         params.response_format = req.get_file_value("response_format").content;
     }
+    if (req.has_file("stream"))
+    {
+        params.stream_format = req.get_file_value("stream").content;
+    }
     if (req.has_file("temperature"))
     {
         params.temperature = std::stof(req.get_file_value("temperature").content);
@@ -468,14 +1677,53 @@ void get_req_parameters(const Request & req, whisper_params & params)
     }
 }
 
+// /stream takes its parameters from the query string, the body is the audio
+void get_stream_parameters(const Request & req, whisper_params & params)
+{
+    if (req.has_param("step"))
+    {
+        params.step_ms = std::stoi(req.get_param_value("step"));
+    }
+    if (req.has_param("length"))
+    {
+        params.length_ms = std::stoi(req.get_param_value("length"));
+    }
+    if (req.has_param("keep"))
+    {
+        params.keep_ms = std::stoi(req.get_param_value("keep"));
+    }
+    if (req.has_param("pause"))
+    {
+        params.pause_ms = std::stoi(req.get_param_value("pause"));
+    }
+    if (req.has_param("vad_thold"))
+    {
+        params.vad_thold = std::stof(req.get_param_value("vad_thold"));
+    }
+    if (req.has_param("freq_thold"))
+    {
+        params.freq_thold = std::stof(req.get_param_value("freq_thold"));
+    }
+    if (req.has_param("audio_ctx_auto"))
+    {
+        params.audio_ctx_auto = parse_str_to_bool(req.get_param_value("audio_ctx_auto"));
+    }
+    if (req.has_param("language"))
+    {
+        params.language = req.get_param_value("language");
+    }
+    if (req.has_param("translate"))
+    {
+        params.translate = parse_str_to_bool(req.get_param_value("translate"));
+    }
+}
+
 }  // namespace
 
 int main(int argc, char ** argv) {
     whisper_params params;
     server_params sparams;
 
-    std::mutex whisper_mutex;
-
     if (whisper_params_parse(argc, argv, params, sparams) == false) {
         whisper_print_usage(argc, argv, params, sparams);
         return 1;
@@ -493,22 +1741,84 @@ int main(int argc, char ** argv) {
         exit(0);
     }
 
+    if (sparams.n_parallel < 1) {
+        fprintf(stderr, "error: --parallel must be at least 1\n");
+        whisper_print_usage(argc, argv, params, sparams);
+        exit(0);
+    }
+
+    if (sparams.encoder_batch > sparams.n_parallel) {
+        fprintf(stderr, "%s: WARNING: --encoder-batch is larger than --parallel, using %d\n", __func__, sparams.n_parallel);
+        sparams.encoder_batch = sparams.n_parallel;
+    }
+
+    if (params.n_processors < 1) {
+        fprintf(stderr, "error: --processors must be at least 1\n");
+        whisper_print_usage(argc, argv, params, sparams);
+        exit(0);
+    }
+
     if (sparams.ffmpeg_converter) {
         check_ffmpeg_availibility();
     }
     // whisper init
     struct whisper_context_params cparams = whisper_context_default_params();
-    cparams.use_gpu = params.use_gpu;
+    cparams.use_gpu  = params.use_gpu;
+    cparams.use_mmap    = params.use_mmap;
+    cparams.kv_self_q8  = params.kv_self_q8;
+    cparams.kv_cross_q8 = params.kv_cross_q8;
+
+    // the weights are loaded once and shared by all states in the pool
+    whisper_state_pool pool;
+
+    {
+        struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+
+        if (ctx == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper context\n");
+            return 3;
+        }
+
+        if (!pool.init(ctx, sparams.n_parallel*params.n_processors, params.openvino_encode_device)) {
+            fprintf(stderr, "error: failed to initialize whisper states\n");
+            pool.free();
+            return 3;
+        }
+
+        if (whisper_ctx_init_encoder_batch(ctx, sparams.encoder_batch, sparams.encoder_wait) != 0) {
+            fprintf(stderr, "error: failed to initialize the encoder batch\n");
+            pool.free();
+            return 3;
+        }
+    }
+
+    // exported by /metrics
+    server_metrics metrics;
+
+    // responses of repeated uploads
+    response_cache cache;
+    cache.n_bytes_max = (size_t) std::max(0, sparams.cache_size_mb)*1024*1024;
 
-    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    // replaces the model of the pool on /load
+    model_loader loader;
+    loader.model = params.model;
 
-    if (ctx == nullptr) {
-        fprintf(stderr, "error: failed to initialize whisper context\n");
-        return 3;
+    // the draft model has no states of its own - each state of the pool creates its draft state on first use
+    struct whisper_context * ctx_draft = nullptr;
+
+    if (!params.draft_model.empty()) {
+        ctx_draft = whisper_init_from_file_with_params_no_state(params.draft_model.c_str(), cparams);
+
+        if (ctx_draft == nullptr) {
+            fprintf(stderr, "error: failed to initialize the draft whisper context\n");
+            pool.free();
+            return 3;
+        }
     }
 
-    // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-    whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+    fprintf(stderr, "%s: processing up to %d requests in parallel, %d processors each\n", __func__, sparams.n_parallel, params.n_processors);
+    fprintf(stderr, "%s: %zu states, %.2f MB each, %.2f MB total\n", __func__, pool.states.size(),
+            whisper_state_n_bytes(pool.states[0])/1e6, pool.n_bytes()/1e6);
 
     Server svr;
     svr.set_default_headers({{"Server", "whisper.cpp"},
@@ -589,6 +1899,9 @@ int main(int argc, char ** argv) {
     // store default params so we can reset after each inference request
     whisper_params default_params = params;
 
+    // used to give each ffmpeg conversion its own temporary file
+    std::atomic<int> n_temp_files(0);
+
     // this is only called if no index.html is found in the public --path
     svr.Get(sparams.request_path + "/", [&default_content](const Request &, Response &res){
         res.set_content(default_content, "text/html");
@@ -599,8 +1912,11 @@ int main(int argc, char ** argv) {
     });
 
     svr.Post(sparams.request_path + "/inference", [&](const Request &req, Response &res){
-        // acquire whisper model mutex lock
-        std::lock_guard<std::mutex> lock(whisper_mutex);
+        auto request = std::make_shared<inference_request>();
+
+        // each request works on its own copy of the default params
+        whisper_params & params = request->params;
+        params = default_params;
 
         // first check user requested fields of the request
         if (!req.has_file("file"))
@@ -615,17 +1931,32 @@ int main(int argc, char ** argv) {
         // check non-required fields
         get_req_parameters(req, params);
 
-        std::string filename{audio_file.filename};
+        if (!params.stream_format.empty() && params.stream_format != ndjson_stream && params.stream_format != sse_stream) {
+            fprintf(stderr, "error: unknown stream format '%s'\n", params.stream_format.c_str());
+            const std::string error_resp = "{\"error\":\"stream must be 'ndjson' or 'sse'\"}";
+            res.set_content(error_resp, "application/json");
+            return;
+        }
+
+        std::string & filename = request->filename;
+        filename = audio_file.filename;
         printf("Received request: %s\n", filename.c_str());
 
         // audio arrays
-        std::vector<float> pcmf32;               // mono-channel F32 PCM
-        std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
+        std::vector<float>              & pcmf32  = request->pcmf32;
+        std::vector<std::vector<float>> & pcmf32s = request->pcmf32s;
+
+        // WAV uploads of any bit depth and sample rate are decoded and resampled in memory
+        if (!::read_wav_buffer(audio_file.content.data(), audio_file.content.size(), pcmf32, pcmf32s, params.diarize)) {
+            if (!sparams.ffmpeg_converter) {
+                fprintf(stderr, "error: failed to read WAV file\n");
+                const std::string error_resp = "{\"error\":\"failed to read WAV file\"}";
+                res.set_content(error_resp, "application/json");
+                return;
+            }
 
-        if (sparams.ffmpeg_converter) {
-            // if file is not wav, convert to wav
-            // write to temporary file
-            const std::string temp_filename = "whisper_server_temp_file.wav";
+            // not a WAV file, convert it with ffmpeg through a temporary file unique to this request
+            const std::string temp_filename = "whisper_server_temp_file_" + std::to_string(n_temp_files++) + ".wav";
             std::ofstream temp_file{temp_filename, std::ios::binary};
             temp_file << audio_file.content;
             temp_file.close();
@@ -634,6 +1965,7 @@ int main(int argc, char ** argv) {
             const bool is_converted = convert_to_wav(temp_filename, error_resp);
             if (!is_converted) {
                 res.set_content(error_resp, "application/json");
+                std::remove(temp_filename.c_str());
                 return;
             }
 
@@ -648,93 +1980,193 @@ int main(int argc, char ** argv) {
             }
             // remove temp file
             std::remove(temp_filename.c_str());
-        } else {
-            if (!::read_wav(audio_file.content, pcmf32, pcmf32s, params.diarize))
-            {
-                fprintf(stderr, "error: failed to read WAV file\n");
-                const std::string error_resp = "{\"error\":\"failed to read WAV file\"}";
-                res.set_content(error_resp, "application/json");
-                return;
-            }
         }
 
-
         printf("Successfully loaded %s\n", filename.c_str());
 
-        // print system information
-        {
-            fprintf(stderr, "\n");
-            fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
-                    params.n_threads*params.n_processors, std::thread::hardware_concurrency(), whisper_print_system_info());
+        const float duration = float(pcmf32.size())/WHISPER_SAMPLE_RATE;
+
+        // a repeated upload is answered from the cache without running the model
+        std::string cache_key;
+        int cache_generation = 0;
+        if (cache.n_bytes_max > 0 && params.stream_format.empty()) {
+            cache_generation = pool.get_generation();
+            cache_key = response_cache::make_key(params, cache_generation, pcmf32, pcmf32s);
+
+            std::string content;
+            std::string content_type;
+            if (cache.get(cache_key, content, content_type)) {
+                metrics.cache_hits.add(1);
+                fprintf(stderr, "%s: '%s' answered from the cache\n", __func__, filename.c_str());
+
+                if (params.response_format == vjson_format) {
+                    // this request did not wait
+                    json jres = json::parse(content);
+                    jres["queue_time"] = 0.0;
+                    jres["cached"] = true;
+                    content = jres.dump(-1, ' ', false, json::error_handler_t::replace);
+                }
+
+                res.set_content(content, content_type.c_str());
+                return;
+            }
+
+            metrics.cache_misses.add(1);
         }
 
-        // print some info about the processing
-        {
-            fprintf(stderr, "\n");
-            if (!whisper_is_multilingual(ctx)) {
-                if (params.language != "en" || params.translate) {
-                    params.language = "en";
-                    params.translate = false;
-                    fprintf(stderr, "%s: WARNING: model is not multilingual, ignoring language and translation options\n", __func__);
+        // optionally drop the silence before the inference, the timestamps are mapped back to the upload
+        vad_map & vad = request->vad;
+        if (params.vad_trim) {
+            // the offset and duration are applied here, so that the trimmed audio starts at offset 0
+            const int64_t i0 = std::min<int64_t>(pcmf32.size(), ((int64_t) WHISPER_SAMPLE_RATE*params.offset_t_ms)/1000);
+            const int64_t i1 = params.duration_ms > 0 ? std::min<int64_t>(pcmf32.size(), i0 + ((int64_t) WHISPER_SAMPLE_RATE*params.duration_ms)/1000) : pcmf32.size();
+
+            std::vector<float> pcm_cut(pcmf32.begin() + i0, pcmf32.begin() + i1);
+
+            params.offset_t_ms = 0;
+            params.duration_ms = 0;
+
+            if (!vad_trim(pcm_cut, i0, params, vad)) {
+                fprintf(stderr, "%s: '%s' has no speech, skipping the inference\n", __func__, filename.c_str());
+
+                if (!params.stream_format.empty()) {
+                    const json done = json{{"type", "done"}, {"duration", duration}, {"queue_time", 0.0}, {"text", ""}};
+                    res.set_content(stream_event(params, done), params.stream_format == sse_stream ? "text/event-stream" : "application/x-ndjson");
+                } else if (params.response_format == text_format || params.response_format == srt_format) {
+                    res.set_content("", params.response_format == srt_format ? "application/x-subrip" : "text/html");
+                } else if (params.response_format == vtt_format) {
+                    res.set_content("WEBVTT\n\n", "text/vtt");
+                } else if (params.response_format == vjson_format) {
+                    // no language was detected
+                    const int lang_id = params.language == "auto" ? -1 : whisper_lang_id(params.language.c_str());
+
+                    json jres = json{
+                        {"task", params.translate ? "translate" : "transcribe"},
+                        {"language", lang_id >= 0 ? whisper_lang_str_full(lang_id) : ""},
+                        {"duration", duration},
+                        {"queue_time", 0.0},
+                        {"text", ""},
+                        {"speech", json::array()},
+                        {"segments", json::array()}
+                    };
+                    res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace), "application/json");
+                } else {
+                    res.set_content(json{{"text", ""}}.dump(), "application/json");
                 }
+
+                return;
             }
-            if (params.detect_language) {
-                params.language = "auto";
-            }
-            fprintf(stderr, "%s: processing '%s' (%d samples, %.1f sec), %d threads, %d processors, lang = %s, task = %s, %stimestamps = %d ...\n",
-                    __func__, filename.c_str(), int(pcmf32.size()), float(pcmf32.size())/WHISPER_SAMPLE_RATE,
-                    params.n_threads, params.n_processors,
-                    params.language.c_str(),
-                    params.translate ? "translate" : "transcribe",
-                    params.tinydiarize ? "tdrz = 1, " : "",
-                    params.no_timestamps ? 0 : 1);
 
-            fprintf(stderr, "\n");
+            fprintf(stderr, "%s: '%s' vad: kept %.2f of %.2f sec in %d pieces\n", __func__, filename.c_str(),
+                    float(pcm_cut.size())/WHISPER_SAMPLE_RATE, float(i1 - i0)/WHISPER_SAMPLE_RATE, (int) vad.pieces.size());
+
+            pcmf32 = std::move(pcm_cut);
         }
 
-        // run the inference
-        {
-            printf("Running whisper.cpp inference on %s\n", filename.c_str());
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+        // borrow one state per processor from the pool, this blocks while not enough states are idle
+        // whisper_full_parallel_with_states() does not split the audio into chunks shorter than 5 s,
+        // so short inputs take fewer states and leave the rest to the other requests
+        const int n_states = std::max(1, std::min(params.n_processors, (int) (pcmf32.size()/(5*WHISPER_SAMPLE_RATE))));
+
+        if (!params.stream_format.empty()) {
+            // the inference runs in the content provider, which writes each segment as soon as it is decoded
+            const bool is_sse = params.stream_format == sse_stream;
+
+            res.set_chunked_content_provider(is_sse ? "text/event-stream" : "application/x-ndjson",
+                    [&pool, &metrics, ctx_draft, request, n_states, duration](size_t /*offset*/, DataSink &sink) {
+                whisper_params & params = request->params;
+
+                int64_t t_queue_us = 0;
+                struct whisper_context * ctx = nullptr;
+                std::vector<struct whisper_state *> states = pool.acquire(n_states, t_queue_us, ctx);
+                struct whisper_state   * state = states[0]; // holds the merged result
+
+                const std::vector<whisper_timings> timings = get_timings(states);
+
+                const auto t_start = std::chrono::steady_clock::now();
+
+                print_request_info(ctx, params, request->filename, request->pcmf32.size(), n_states);
+
+                whisper_full_params wparams = request_full_params(params, ctx_draft);
+
+                // the streamed segments always carry the word timestamps of verbose_json
+                wparams.token_timestamps = !params.no_timestamps;
+
+                whisper_print_user_data print_user_data = { &params, &request->pcmf32s, &request->vad, 0 };
+                whisper_stream_user_data user_data = { &print_user_data, &sink, { false } };
+
+                wparams.new_segment_callback           = whisper_stream_segment_callback;
+                wparams.new_segment_callback_user_data = &user_data;
+
+                if (wparams.print_progress) {
+                    wparams.progress_callback           = whisper_print_progress_callback;
+                    wparams.progress_callback_user_data = &print_user_data;
+                }
+
+                // stop decoding when the client is gone
+                wparams.abort_callback = [](void * user_data) {
+                    return ((whisper_stream_user_data *) user_data)->is_aborted.load();
+                };
+                wparams.abort_callback_user_data = &user_data;
+
+                const int ret = whisper_full_parallel_with_states(ctx, states.data(), n_states, wparams, request->pcmf32.data(), request->pcmf32.size());
+
+                if (!user_data.is_aborted) {
+                    json event;
+                    if (ret != 0) {
+                        event = json{{"type", "error"}, {"error", "failed to process audio"}};
+                    } else {
+                        event = json{
+                            {"type", "done"},
+                            {"task", params.translate ? "translate" : "transcribe"},
+                            {"language", whisper_lang_str_full(whisper_full_lang_id_from_state(state))},
+                            {"duration", duration},
+                            {"queue_time", t_queue_us*1e-6},
+                            {"audio_ctx", whisper_full_n_audio_ctx_from_state(state)},
+                            {"text", output_str(state, params, request->pcmf32s, request->vad)},
+                        };
+                    }
+
+                    const std::string out = stream_event(params, event);
+                    sink.write(out.data(), out.size());
+                }
+
+                const int64_t t_inference_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t_start).count();
+
+                // a request aborted by the client did not fail
+                metrics.record(false, timings, get_timings(states), t_queue_us, t_inference_us, request->pcmf32.size(), ret == 0 || user_data.is_aborted);
 
-            wparams.strategy = params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY;
+                pool.release(states);
 
-            wparams.print_realtime   = false;
-            wparams.print_progress   = params.print_progress;
-            wparams.print_timestamps = !params.no_timestamps;
-            wparams.print_special    = params.print_special;
-            wparams.translate        = params.translate;
-            wparams.language         = params.language.c_str();
-            wparams.detect_language  = params.detect_language;
-            wparams.n_threads        = params.n_threads;
-            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
-            wparams.offset_ms        = params.offset_t_ms;
-            wparams.duration_ms      = params.duration_ms;
+                fprintf(stderr, "stream: '%s' queue time = %.2f ms, inference time = %.2f ms%s\n",
+                        request->filename.c_str(), t_queue_us/1000.0f, t_inference_us/1000.0f, user_data.is_aborted ? " (aborted)" : "");
 
-            wparams.thold_pt         = params.word_thold;
-            wparams.max_len          = params.max_len == 0 ? 60 : params.max_len;
-            wparams.split_on_word    = params.split_on_word;
-            wparams.audio_ctx        = params.audio_ctx;
+                sink.done();
 
-            wparams.speed_up         = params.speed_up;
-            wparams.debug_mode       = params.debug_mode;
+                return true;
+            });
 
-            wparams.tdrz_enable      = params.tinydiarize; // [TDRZ]
+            return;
+        }
 
-            wparams.initial_prompt   = params.prompt.c_str();
+        int64_t t_queue_us = 0;
+        int generation = 0;
+        struct whisper_context * ctx = nullptr;
+        std::vector<struct whisper_state *> states = pool.acquire(n_states, t_queue_us, ctx, &generation);
+        struct whisper_state   * state = states[0]; // holds the merged result
 
-            wparams.greedy.best_of        = params.best_of;
-            wparams.beam_search.beam_size = params.beam_size;
+        const std::vector<whisper_timings> timings = get_timings(states);
 
-            wparams.temperature      = params.temperature;
-            wparams.temperature_inc  = params.temperature_inc;
-            wparams.entropy_thold    = params.entropy_thold;
-            wparams.logprob_thold    = params.logprob_thold;
+        const auto t_start = std::chrono::steady_clock::now();
 
-            wparams.no_timestamps    = params.no_timestamps;
-            wparams.token_timestamps = !params.no_timestamps && params.response_format == vjson_format;
+        print_request_info(ctx, params, filename, pcmf32.size(), n_states);
+
+        // run the inference
+        {
+            printf("Running whisper.cpp inference on %s\n", filename.c_str());
+            whisper_full_params wparams = request_full_params(params, ctx_draft);
 
-            whisper_print_user_data user_data = { &params, &pcmf32s, 0 };
+            whisper_print_user_data user_data = { &params, &pcmf32s, &vad, 0 };
 
             // this callback is called on each new segment
             if (params.print_realtime) {
@@ -746,7 +2178,6 @@ int main(int argc, char ** argv) {
                 wparams.progress_callback           = whisper_print_progress_callback;
                 wparams.progress_callback_user_data = &user_data;
             }
-
             // examples for abort mechanism
             // in examples below, we do not abort the processing, but we could if the flag is set to true
 
@@ -772,28 +2203,38 @@ int main(int argc, char ** argv) {
                 wparams.abort_callback_user_data = &is_aborted;
             }
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
+            if (whisper_full_parallel_with_states(ctx, states.data(), n_states, wparams, pcmf32.data(), pcmf32.size()) != 0) {
                 fprintf(stderr, "%s: failed to process audio\n", argv[0]);
                 const std::string error_resp = "{\"error\":\"failed to process audio\"}";
                 res.set_content(error_resp, "application/json");
+                metrics.record(false, timings, get_timings(states), t_queue_us,
+                        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t_start).count(), pcmf32.size(), false);
+                pool.release(states);
                 return;
             }
         }
 
+        const int64_t t_inference_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t_start).count();
+
+        metrics.record(false, timings, get_timings(states), t_queue_us, t_inference_us, pcmf32.size(), true);
+
+        fprintf(stderr, "%s: '%s' queue time = %.2f ms, inference time = %.2f ms\n",
+                __func__, filename.c_str(), t_queue_us/1000.0f, t_inference_us/1000.0f);
+
         // return results to user
         if (params.response_format == text_format)
         {
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(state, params, pcmf32s, vad);
             res.set_content(results.c_str(), "text/html");
         }
         else if (params.response_format == srt_format)
         {
             std::stringstream ss;
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
+                const int64_t t0 = vad.to_orig(whisper_full_get_segment_t0_from_state(state, i));
+                const int64_t t1 = vad.to_orig(whisper_full_get_segment_t1_from_state(state, i), true);
                 std::string speaker = "";
 
                 if (params.diarize && pcmf32s.size() == 2)
@@ -811,11 +2252,11 @@ int main(int argc, char ** argv) {
 
             ss << "WEBVTT\n\n";
 
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
+                const int64_t t0 = vad.to_orig(whisper_full_get_segment_t0_from_state(state, i));
+                const int64_t t1 = vad.to_orig(whisper_full_get_segment_t1_from_state(state, i), true);
                 std::string speaker = "";
 
                 if (params.diarize && pcmf32s.size() == 2)
@@ -831,54 +2272,27 @@ int main(int argc, char ** argv) {
             res.set_content(ss.str(), "text/vtt");
         } else if (params.response_format == vjson_format) {
             /* try to match openai/whisper's Python format */
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(state, params, pcmf32s, vad);
             json jres = json{
                 {"task", params.translate ? "translate" : "transcribe"},
-                {"language", whisper_lang_str_full(whisper_full_lang_id(ctx))},
-                {"duration", float(pcmf32.size())/WHISPER_SAMPLE_RATE},
+                {"language", whisper_lang_str_full(whisper_full_lang_id_from_state(state))},
+                {"duration", duration},
+                {"queue_time", t_queue_us*1e-6},
+                {"audio_ctx", whisper_full_n_audio_ctx_from_state(state)},
                 {"text", results},
                 {"segments", json::array()}
             };
-            const int n_segments = whisper_full_n_segments(ctx);
+            if (params.vad_trim) {
+                // the kept stretches of the upload, in seconds
+                jres["speech"] = json::array();
+                for (const auto & p : vad.pieces) {
+                    jres["speech"].push_back({ float(p.orig)/WHISPER_SAMPLE_RATE, float(p.orig + p.n)/WHISPER_SAMPLE_RATE });
+                }
+            }
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i)
             {
-                json segment = json{
-                    {"id", i},
-                    {"text", whisper_full_get_segment_text(ctx, i)},
-                };
-
-                if (!params.no_timestamps) {
-                    segment["start"] = whisper_full_get_segment_t0(ctx, i) * 0.01;
-                    segment["end"] = whisper_full_get_segment_t1(ctx, i) * 0.01;
-                }
-
-                float total_logprob = 0;
-                const int n_tokens = whisper_full_n_tokens(ctx, i);
-                for (int j = 0; j < n_tokens; ++j) {
-                    whisper_token_data token = whisper_full_get_token_data(ctx, i, j);
-                    if (token.id >= whisper_token_eot(ctx)) {
-                        continue;
-                    }
-
-                    segment["tokens"].push_back(token.id);
-                    json word = json{{"word", whisper_full_get_token_text(ctx, i, j)}};
-                    if (!params.no_timestamps) {
-                        word["start"] = token.t0 * 0.01;
-                        word["end"] = token.t1 * 0.01;
-                    }
-                    word["probability"] = token.p;
-                    total_logprob += token.plog;
-                    segment["words"].push_back(word);
-                }
-
-                segment["temperature"] = params.temperature;
-                segment["avg_logprob"] = total_logprob / n_tokens;
-
-                // TODO compression_ratio and no_speech_prob are not implemented yet
-                // segment["compression_ratio"] = 0;
-                // segment["no_speech_prob"] = 0;
-
-                jres["segments"].push_back(segment);
+                jres["segments"].push_back(segment_to_json(ctx, state, i, params, vad));
             }
             res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace),
                             "application/json");
@@ -886,7 +2300,7 @@ int main(int argc, char ** argv) {
         // TODO add more output formats
         else
         {
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(state, params, pcmf32s, vad);
             json jres = json{
                 {"text", results}
             };
@@ -894,11 +2308,87 @@ int main(int argc, char ** argv) {
                             "application/json");
         }
 
-        // reset params to thier defaults
-        params = default_params;
+        // after a /load between the lookup and acquire(), the result is not from the model the key names
+        if (!cache_key.empty() && generation == cache_generation) {
+            cache.put(cache_key, res.body, res.get_header_value("Content-Type"));
+        }
+
+        pool.release(states);
+    });
+    svr.Options(sparams.request_path + "/stream", [&](const Request &, Response &){
+    });
+
+    // the body is 16 kHz mono PCM (16-bit, or 32-bit float with format=f32), usually sent with chunked transfer encoding
+    // as it is recorded - the audio is transcribed while it is received and the results are sent back as NDJSON,
+    // so the response is read by the client while it is still uploading
+    svr.Post(sparams.request_path + "/stream", [&](const Request &req, Response &res, const ContentReader &content_reader){
+        auto session = std::make_shared<stream_session>();
+
+        session->params = default_params;
+        session->params.audio_ctx_auto = true; // the windows are shorter than 30 s
+
+        get_stream_parameters(req, session->params);
+
+        session->is_f32 = req.get_param_value("format") == "f32";
+
+        if (session->params.language == "auto" || session->params.detect_language) {
+            // each window would detect the language again
+            res.set_content(json{{"error", "/stream needs a language"}}.dump(), "application/json");
+            return;
+        }
+
+        // the content reader stays valid while the response is written, so the body is read by the content provider
+        res.set_chunked_content_provider("application/x-ndjson", [&pool, &metrics, session, content_reader](size_t /*offset*/, DataSink &sink) {
+            int64_t t_queue_us = 0;
+            std::vector<struct whisper_state *> states = pool.acquire(1, t_queue_us, session->ctx);
+
+            session->state = states[0];
+
+            const std::vector<whisper_timings> timings = get_timings(states);
+
+            const auto t_start = std::chrono::steady_clock::now();
+
+            bool ok = true;
+            std::string out;
+
+            content_reader([&](const char * data, size_t n) {
+                session->push(data, n);
+
+                ok = session->process(false, out);
+                // written even when processing failed, so the client gets the error event
+                const bool wrote = out.empty() || sink.write(out.data(), out.size());
+                out.clear();
+                ok = ok && wrote;
+
+                return ok;
+            });
+
+            if (ok) {
+                ok = session->process(true, out);
+                if (ok) {
+                    out += json{{"type", "done"}}.dump() + "\n";
+                }
+                const bool wrote = out.empty() || sink.write(out.data(), out.size());
+                ok = ok && wrote;
+            }
+
+            const int64_t t_total_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t_start).count();
+
+            metrics.record(true, timings, get_timings(states), t_queue_us, t_total_us, session->t_window + session->pcm.size(), ok);
+
+            pool.release(states);
+
+            fprintf(stderr, "stream: %.2f sec of audio, %d passes, %d final segments, queue time = %.2f ms, total time = %.2f ms%s\n",
+                    float(session->t_window + session->pcm.size())/WHISPER_SAMPLE_RATE, session->n_pass, session->n_final,
+                    t_queue_us/1000.0f, t_total_us/1000.0f, ok ? "" : " (aborted)");
+
+            sink.done();
+
+            return true;
+        });
     });
+
     svr.Post(sparams.request_path + "/load", [&](const Request &req, Response &res){
-        std::lock_guard<std::mutex> lock(whisper_mutex);
         if (!req.has_file("model"))
         {
             fprintf(stderr, "error: no 'model' field in the request\n");
@@ -915,25 +2405,23 @@ int main(int argc, char ** argv) {
             return;
         }
 
-        // clean up
-        whisper_free(ctx);
-
-        // whisper init
-        ctx = whisper_init_from_file_with_params(model.c_str(), cparams);
-
-        // TODO perhaps load prior model here instead of exit
-        if (ctx == nullptr) {
-            fprintf(stderr, "error: model init  failed, no model loaded must exit\n");
-            exit(1);
+        // the current model serves the requests until the new one is ready
+        if (!loader.start(pool, model, cparams, sparams.n_parallel*params.n_processors, params.openvino_encode_device, sparams.encoder_batch, sparams.encoder_wait)) {
+            fprintf(stderr, "error: a model is already being loaded\n");
+            const std::string error_resp = "{\"error\":\"a model is already being loaded\"}";
+            res.set_content(error_resp, "application/json");
+            return;
         }
 
-        // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-        whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+        res.set_content(loader.to_json().dump(), "application/json");
+    });
 
-        const std::string success = "Load was successful!";
-        res.set_content(success, "application/text");
+    svr.Get(sparams.request_path + "/load", [&](const Request &, Response &res){
+        res.set_content(loader.to_json().dump(), "application/json");
+    });
 
-        // check if the model is in the file system
+    svr.Get(sparams.request_path + "/metrics", [&](const Request &, Response &res){
+        res.set_content(metrics.to_prometheus(pool, cache), "text/plain; version=0.0.4");
     });
 
     svr.set_exception_handler([](const Request &, Response &res, std::exception_ptr ep) {
@@ -981,8 +2469,13 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
-    whisper_print_timings(ctx);
-    whisper_free(ctx);
+    if (loader.thread.joinable()) {
+        loader.thread.join();
+    }
+
+    whisper_print_timings(pool.ctx);
+    pool.free();
+    whisper_free(ctx_draft);
 
     return 0;
 }
@@ -221,7 +221,9 @@ int main(int argc, char ** argv) {
     fflush(stdout);
 
     auto t_last  = std::chrono::high_resolution_clock::now();
-    const auto t_start = t_last;
+
+    // index of the first sample of the last transcribed audio
+    int64_t t_audio = 0;
 
     // main audio loop
     while (is_running) {
@@ -239,22 +241,29 @@ int main(int argc, char ** argv) {
 
         if (!use_vad) {
             while (true) {
-                audio.get(params.step_ms, pcmf32_new);
+                // poll without copying the audio
+                audio_span span;
+                audio.get_span(0, span);
 
-                if ((int) pcmf32_new.size() > 2*n_samples_step) {
+                if ((int) span.n > 2*n_samples_step) {
                     fprintf(stderr, "\n\n%s: WARNING: cannot process audio fast enough, dropping audio ...\n\n", __func__);
                     audio.clear();
                     continue;
                 }
 
-                if ((int) pcmf32_new.size() >= n_samples_step) {
-                    audio.clear();
+                if ((int) span.n >= n_samples_step) {
                     break;
                 }
 
                 std::this_thread::sleep_for(std::chrono::milliseconds(1));
             }
 
+            int64_t t0 = 0;
+            audio.get(0, pcmf32_new, t0);
+
+            // the audio captured after this point is processed in the next step
+            audio.clear(t0 + pcmf32_new.size());
+
             const int n_samples_new = pcmf32_new.size();
 
             // take up to params.length_ms audio from previous iteration
@@ -284,7 +293,7 @@ int main(int argc, char ** argv) {
             audio.get(2000, pcmf32_new);
 
             if (::vad_simple(pcmf32_new, WHISPER_SAMPLE_RATE, 1000, params.vad_thold, params.freq_thold, false)) {
-                audio.get(params.length_ms, pcmf32);
+                audio.get(params.length_ms, pcmf32, t_audio);
             } else {
                 std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
@@ -335,8 +344,8 @@ int main(int argc, char ** argv) {
 
                     printf("\33[2K\r");
                 } else {
-                    const int64_t t1 = (t_last - t_start).count()/1000000;
-                    const int64_t t0 = std::max(0.0, t1 - pcmf32.size()*1000.0/WHISPER_SAMPLE_RATE);
+                    const int64_t t0 = (t_audio*1000)/WHISPER_SAMPLE_RATE;
+                    const int64_t t1 = ((t_audio + pcmf32.size())*1000)/WHISPER_SAMPLE_RATE;
 
                     printf("\n");
                     printf("### Transcription %d START | t0 = %d ms | t1 = %d ms\n", n_iter, (int) t0, (int) t1);
@@ -0,0 +1,103 @@
+// read_wav_buffer with WAV data that has less than one byte per frame (mono 4-bit IMA ADPCM)
+// the frame bound used to divide by channels*bitsPerSample/8, which is 0 for such files
+
+#include "common.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static void put_u16(std::vector<uint8_t> & buf, uint16_t v) {
+    buf.push_back(v & 0xff);
+    buf.push_back(v >> 8);
+}
+
+static void put_u32(std::vector<uint8_t> & buf, uint32_t v) {
+    put_u16(buf, v & 0xffff);
+    put_u16(buf, v >> 16);
+}
+
+static void put_tag(std::vector<uint8_t> & buf, const char * tag) {
+    buf.insert(buf.end(), tag, tag + 4);
+}
+
+// a mono IMA ADPCM file of n_blocks blocks, each holding samples_per_block frames
+static std::vector<uint8_t> make_ima_adpcm(int n_blocks, uint32_t sample_rate) {
+    const uint16_t block_align       = 256;
+    const uint16_t samples_per_block = (block_align - 4)*2 + 1;
+
+    std::vector<uint8_t> data;
+    for (int b = 0; b < n_blocks; b++) {
+        put_u16(data, 0); // predictor
+        data.push_back(0); // step index
+        data.push_back(0); // reserved
+        for (int i = 4; i < block_align; i++) {
+            data.push_back((b + i) & 0x77);
+        }
+    }
+
+    std::vector<uint8_t> wav;
+    put_tag(wav, "RIFF");
+    put_u32(wav, 0); // patched below
+    put_tag(wav, "WAVE");
+
+    put_tag(wav, "fmt ");
+    put_u32(wav, 20);
+    put_u16(wav, 0x11); // WAVE_FORMAT_DVI_ADPCM
+    put_u16(wav, 1);
+    put_u32(wav, sample_rate);
+    put_u32(wav, sample_rate*block_align/samples_per_block);
+    put_u16(wav, block_align);
+    put_u16(wav, 4);
+    put_u16(wav, 2);
+    put_u16(wav, samples_per_block);
+
+    put_tag(wav, "fact");
+    put_u32(wav, 4);
+    put_u32(wav, n_blocks*samples_per_block);
+
+    put_tag(wav, "data");
+    put_u32(wav, data.size());
+    wav.insert(wav.end(), data.begin(), data.end());
+
+    const uint32_t riff_size = wav.size() - 8;
+    for (int i = 0; i < 4; i++) {
+        wav[4 + i] = (riff_size >> (8*i)) & 0xff;
+    }
+
+    return wav;
+}
+
+int main() {
+    const int n_blocks = 32;
+    const int n_frames = n_blocks*505;
+
+    const std::vector<uint8_t> wav = make_ima_adpcm(n_blocks, COMMON_SAMPLE_RATE);
+
+    if (!is_wav_buffer(std::string(wav.begin(), wav.end()))) {
+        fprintf(stderr, "%s: generated data is not recognized as WAV\n", __func__);
+        return 1;
+    }
+
+    std::vector<float> pcmf32;
+    std::vector<std::vector<float>> pcmf32s;
+    if (!read_wav_buffer(wav.data(), wav.size(), pcmf32, pcmf32s, false)) {
+        fprintf(stderr, "%s: failed to decode 4-bit mono ADPCM\n", __func__);
+        return 1;
+    }
+
+    if ((int) pcmf32.size() != n_frames) {
+        fprintf(stderr, "%s: decoded %zu samples, expected %d\n", __func__, pcmf32.size(), n_frames);
+        return 1;
+    }
+
+    for (float v : pcmf32) {
+        if (!(v >= -1.0f && v <= 1.0f)) {
+            fprintf(stderr, "%s: sample %f out of range\n", __func__, v);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -27,13 +27,17 @@
 #include <atomic>
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <cstdio>
 #include <cstdarg>
 #include <cstring>
+#include <condition_variable>
+#include <chrono>
 #include <fstream>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
 #include <thread>
@@ -42,6 +46,27 @@
 #include <random>
 #include <functional>
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef __has_include
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <sys/mman.h>
+            #include <sys/stat.h>
+            #include <fcntl.h>
+        #endif
+    #endif
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
@@ -151,6 +176,7 @@ static void whisper_log_callback_default(ggml_log_level level, const char * text
 //#define WHISPER_USE_FLASH_FF
 #define WHISPER_MAX_DECODERS 8
 #define WHISPER_MAX_NODES 4096
+#define WHISPER_MAX_ENCODER_BATCH 8
 
 //
 // ggml helpers
@@ -359,11 +385,59 @@ struct whisper_mel {
     std::vector<float> data;
 };
 
+// persistent helper threads that run the same job on [1, n_threads)
+// the calling thread always runs the job with ith == 0
+struct whisper_worker_pool {
+    std::vector<std::thread> threads;
+
+    std::mutex              mutex;
+    std::condition_variable cv_job;
+    std::condition_variable cv_done;
+
+    const std::function<void(int)> * job = nullptr;
+
+    uint64_t n_job     = 0; // incremented for every new job
+    int      n_active  = 0; // workers with ith < n_active take part in the current job
+    int      n_pending = 0; // workers that have not finished the current job yet
+    bool     stop      = false;
+};
+
 struct whisper_filters {
     int32_t n_mel;
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // sparse form of data, built at load time
+    // mel bin j uses the weights sparse[offs[j] ... offs[j] + end[j] - beg[j]) for the FFT bins [beg[j], end[j])
+    std::vector<int32_t> beg;
+    std::vector<int32_t> end;
+    std::vector<int32_t> offs;
+    std::vector<float>   sparse;
+};
+
+// precomputed plan for the FFT of a real-valued frame of n samples
+// for even n, the frame is transformed as n/2 complex samples and the spectrum is recovered afterwards
+// the complex transform is an iterative, in-place, mixed-radix (4, 2, 3, 5, ...) Cooley-Tukey FFT
+struct whisper_fft_plan {
+    int n     = 0; // number of real input samples
+    int n_c   = 0; // size of the complex transform
+    int n_out = 0; // number of output bins: n/2 + 1
+
+    std::vector<int> radix; // radix of each stage, in the order the stages are applied
+    std::vector<int> perm;  // mixed-radix digit reversal: input index for each position of the work buffer
+
+    std::vector<float> twiddle;   // per-stage twiddle factors (re, im), concatenated
+    std::vector<float> twiddle_r; // exp(-2*pi*i*k/n) (re, im) for recovering the real spectrum, k = 0 .. n/2
+
+    // number of floats of scratch memory needed by whisper_fft()
+    size_t n_work() const {
+        int r_max = 0;
+        for (int r : radix) {
+            r_max = std::max(r_max, r);
+        }
+        return 2*(n_c + r_max);
+    }
 };
 
 struct whisper_vocab {
@@ -766,6 +840,10 @@ struct whisper_state {
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
 
+    int64_t t_draft_us     = 0; // time spent in the draft model
+    int32_t n_draft        = 0; // number of tokens proposed by the draft model
+    int32_t n_draft_accept = 0; // number of proposed tokens that were accepted
+
     // unified self-attention KV cache for all decoders
     whisper_kv_cache kv_self;
 
@@ -775,10 +853,25 @@ struct whisper_state {
 
     whisper_mel mel;
 
+    // log mel frontend: padded input samples (reused between calls) and helper threads
+    std::vector<float>  mel_samples_padded;
+    whisper_worker_pool mel_workers;
+    whisper_worker_pool decoder_workers; // logits processing and sampling of the decoders
+
     whisper_batch batch;
 
     whisper_decoder decoders[WHISPER_MAX_DECODERS];
 
+    // speculative decoding, see whisper_full_params.draft
+    whisper_context * draft_ctx   = nullptr;
+    whisper_state   * draft_state = nullptr; // created on first use
+
+    int draft_seek = -1; // the window encoded in draft_state, -1 before the mel has been copied
+    int draft_next = 0;  // index of the next proposal in draft_pending
+
+    std::vector<whisper_token> draft_past;    // the tokens after the prompt in the KV cache of draft_state
+    std::vector<whisper_token> draft_pending; // the proposals verified by the last decode
+
     ggml_backend_t backend = nullptr;
 
     // ggml-alloc:
@@ -827,6 +920,50 @@ struct whisper_state {
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 };
 
+// collects the encoder passes of concurrent whisper_full_with_state() calls on different states of the same context
+// and evaluates them as one graph with a batch dimension, see whisper_ctx_init_encoder_batch()
+struct whisper_encoder_batch {
+    struct request {
+        whisper_state * state;
+
+        int mel_offset;
+        int n_ctx;
+
+        int64_t t_deadline_us; // the request is computed no later than this, even if the batch is not full
+
+        bool done;
+        bool ok;
+    };
+
+    int     n_batch_max   = 1;
+    int64_t t_wait_max_us = 0;
+
+    ggml_backend_t backend = nullptr;
+
+    whisper_allocr alloc;
+
+    std::vector<float> inp_mel;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::vector<request *> pending; // oldest first
+    bool busy = false;              // a batch is being computed
+};
+
+// read-only mapping of the model file
+// it is used as the loader context while loading, and the CPU tensors that are suitably aligned in the file
+// point directly into it, so the weights are not copied and the page cache is shared between processes
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+    size_t pos  = 0; // read position of the loader
+
+    ggml_backend_buffer_t buffer = nullptr; // CPU buffer wrapping the whole mapping
+
+    size_t n_bytes_mapped = 0; // tensor data used in place
+};
+
 struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
@@ -839,8 +976,16 @@ struct whisper_context {
     whisper_model model;
     whisper_vocab vocab;
 
+    whisper_fft_plan fft_plan; // WHISPER_N_FFT-point FFT used by the log mel frontend
+
     whisper_state * state = nullptr;
 
+    whisper_encoder_batch * encoder_batch = nullptr; // optional, shared by all states
+
+    std::vector<whisper_state *> states_parallel; // helper states reused by whisper_full_parallel()
+
+    whisper_mmap * mapping = nullptr; // set when the model was loaded with use_mmap
+
     ggml_backend_t backend = nullptr;
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
@@ -860,11 +1005,148 @@ static void read_safe(whisper_model_loader * loader, T & dest) {
     BYTESWAP_VALUE(dest);
 }
 
+// returns nullptr if the file cannot be mapped - the caller falls back to reading it
+// with prefetch, the kernel is asked to read the whole file ahead in the background
+static whisper_mmap * whisper_mmap_init(const char * path, bool prefetch) {
+#if defined(_POSIX_MAPPED_FILES) && !defined(GGML_BIG_ENDIAN)
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+#ifdef __linux__
+    // increases the readahead
+    if (posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL) != 0) {
+        WHISPER_LOG_WARN("%s: posix_fadvise(.., POSIX_FADV_SEQUENTIAL) failed: %s\n", __func__, strerror(errno));
+    }
+#endif
+
+    void * addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps a reference to the file
+
+    if (addr == MAP_FAILED) {
+        WHISPER_LOG_WARN("%s: mmap failed: %s\n", __func__, strerror(errno));
+        return nullptr;
+    }
+
+    if (prefetch && posix_madvise(addr, st.st_size, POSIX_MADV_WILLNEED) != 0) {
+        WHISPER_LOG_WARN("%s: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n", __func__, strerror(errno));
+    }
+
+    whisper_mmap * mapping = new whisper_mmap;
+
+    mapping->addr   = addr;
+    mapping->size   = st.st_size;
+    mapping->buffer = ggml_backend_cpu_buffer_from_ptr(addr, st.st_size);
+
+    return mapping;
+#else
+    GGML_UNUSED(path);
+    GGML_UNUSED(prefetch);
+
+    return nullptr;
+#endif
+}
+
+static void whisper_mmap_free(whisper_mmap * mapping) {
+    if (!mapping) {
+        return;
+    }
+
+    ggml_backend_buffer_free(mapping->buffer);
+
+#if defined(_POSIX_MAPPED_FILES) && !defined(GGML_BIG_ENDIAN)
+    munmap(mapping->addr, mapping->size);
+#endif
+
+    delete mapping;
+}
+
+// the tensor data in the model file is not padded, so only tensors that start at the natural alignment
+// of their type (the scalar or the fp16 scale of a quant block) can be used in place - the rest is copied
+static size_t whisper_mmap_tensor_align(ggml_type type) {
+    const size_t size = ggml_type_size(type);
+
+    return size % 4 == 0 ? 4 : size % 2 == 0 ? 2 : 1;
+}
+
+// scan the tensor headers starting at the current read position and point the matching tensors into the mapping
+// the headers are validated again by the regular loading loop, which skips the data of the mapped tensors
+static void whisper_mmap_map_tensors(whisper_mmap & mapping, whisper_model & model) {
+    char * base = (char *) mapping.addr;
+
+    size_t pos = mapping.pos;
+
+    auto read_i32 = [&](int32_t & dst) {
+        if (pos + sizeof(int32_t) > mapping.size) {
+            return false;
+        }
+        memcpy(&dst, base + pos, sizeof(int32_t));
+        pos += sizeof(int32_t);
+        return true;
+    };
+
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ttype;
+
+        if (!read_i32(n_dims) || !read_i32(length) || !read_i32(ttype)) {
+            break;
+        }
+
+        if (n_dims < 1 || n_dims > 4 || length < 0 || ttype < 0 || ttype >= GGML_TYPE_COUNT) {
+            break;
+        }
+
+        int64_t nelements = 1;
+        for (int i = 0; i < n_dims; ++i) {
+            int32_t ne;
+            if (!read_i32(ne)) {
+                return;
+            }
+            nelements *= ne;
+        }
+
+        if (pos + length > mapping.size) {
+            break;
+        }
+
+        const std::string name(base + pos, length);
+        pos += length;
+
+        const size_t nbytes = (nelements*ggml_type_size(ggml_type(ttype)))/ggml_blck_size(ggml_type(ttype));
+        if (pos + nbytes > mapping.size) {
+            break;
+        }
+
+        auto it = model.tensors.find(name);
+        if (it != model.tensors.end()) {
+            ggml_tensor * tensor = it->second;
+
+            if (tensor->type == ttype && ggml_nbytes(tensor) == nbytes && tensor->data == nullptr &&
+                pos % whisper_mmap_tensor_align(tensor->type) == 0) {
+                ggml_backend_tensor_alloc(mapping.buffer, tensor, base + pos);
+                mapping.n_bytes_mapped += nbytes;
+            }
+        }
+
+        pos += nbytes;
+    }
+}
+
 static bool kv_cache_init(
         const struct whisper_hparams & hparams,
              struct whisper_kv_cache & cache,
                       ggml_backend_t   backend,
-                           ggml_type   wtype,
+                           ggml_type   type_k,
+                           ggml_type   type_v,
                                  int   n_ctx) {
     const int64_t n_text_state = hparams.n_text_state;
     const int64_t n_text_layer = hparams.n_text_layer;
@@ -891,8 +1173,8 @@ static bool kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(cache.ctx, type_k, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, type_v, n_elements);
 
     cache.buffer = ggml_backend_alloc_ctx_tensors(cache.ctx, backend);
     if (!cache.buffer) {
@@ -909,6 +1191,109 @@ static void kv_cache_free(struct whisper_kv_cache & cache) {
     cache.ctx = nullptr;
 }
 
+// grow the cache to n_ctx cells, keeping the cells in use at the same positions
+// K is stored as n_layer*n_ctx rows of n_state values, V transposed as n_layer*n_state rows of n_ctx values
+static bool kv_cache_grow(
+        const struct whisper_hparams & hparams,
+             struct whisper_kv_cache & cache,
+                      ggml_backend_t   backend,
+                                 int   n_ctx) {
+    const int n_state = hparams.n_text_state;
+    const int n_layer = hparams.n_text_layer;
+
+    const int n_ctx_old = cache.size;
+
+    whisper_kv_cache cache_new;
+    if (!kv_cache_init(hparams, cache_new, backend, cache.k->type, cache.v->type, n_ctx)) {
+        kv_cache_free(cache_new);
+        return false;
+    }
+
+    std::vector<uint8_t> src;
+    std::vector<uint8_t> dst;
+
+    {
+        const size_t row = ggml_row_size(cache.k->type, n_state);
+
+        src.resize(ggml_nbytes(cache.k));
+        dst.resize(ggml_nbytes(cache_new.k));
+        ggml_backend_tensor_get(cache.k, src.data(), 0, src.size());
+
+        for (int il = 0; il < n_layer; ++il) {
+            memcpy(dst.data() + il*n_ctx*row, src.data() + il*n_ctx_old*row, n_ctx_old*row);
+        }
+
+        ggml_backend_tensor_set(cache_new.k, dst.data(), 0, dst.size());
+    }
+
+    {
+        const size_t esize = ggml_element_size(cache.v);
+
+        src.resize(ggml_nbytes(cache.v));
+        dst.resize(ggml_nbytes(cache_new.v));
+        ggml_backend_tensor_get(cache.v, src.data(), 0, src.size());
+
+        for (int ir = 0; ir < n_layer*n_state; ++ir) {
+            memcpy(dst.data() + ir*n_ctx*esize, src.data() + ir*n_ctx_old*esize, n_ctx_old*esize);
+        }
+
+        ggml_backend_tensor_set(cache_new.v, dst.data(), 0, dst.size());
+    }
+
+    std::copy(cache.cells.begin(), cache.cells.end(), cache_new.cells.begin());
+
+    cache_new.head = cache.head;
+    cache_new.n    = cache.n;
+
+    kv_cache_free(cache);
+
+    cache = std::move(cache_new);
+
+    return true;
+}
+
+// number of positions per layer in the cross-attention cache for an audio context of n_ctx
+// a quantized V is stored transposed, so its rows are padded to the block size - the padding is masked in the decoder
+static int whisper_kv_cross_n_ctx(const whisper_kv_cache & kv_cross, int n_ctx) {
+    return GGML_PAD(n_ctx, ggml_blck_size(kv_cross.v->type));
+}
+
+// store the cross-attention Kcross and Vcross [n_state, n_ctx] of layer il in kv_cross
+static void whisper_build_kv_cross_store(
+        struct ggml_context * ctx0,
+         struct ggml_cgraph * gf,
+     const whisper_kv_cache & kv_cross,
+        struct ggml_tensor  * Kcross,
+        struct ggml_tensor  * Vcross,
+                        int   il,
+                        int   n_state,
+                        int   n_ctx) {
+    const int n_ctx_pad = whisper_kv_cross_n_ctx(kv_cross, n_ctx);
+
+    Vcross = ggml_transpose(ctx0, Vcross);
+
+    if (ggml_is_quantized(kv_cross.v->type)) {
+        // the rows are quantized from contiguous data
+        Vcross = ggml_cont(ctx0, Vcross);
+    }
+
+    if (n_ctx_pad > n_ctx) {
+        Kcross = ggml_pad(ctx0, Kcross, 0, n_ctx_pad - n_ctx, 0, 0);
+        Vcross = ggml_pad(ctx0, Vcross, n_ctx_pad - n_ctx, 0, 0, 0);
+    }
+
+    struct ggml_tensor * k = ggml_view_1d(ctx0, kv_cross.k,
+            n_state*n_ctx_pad,
+            ggml_row_size(kv_cross.k->type, n_state)*(il*n_ctx_pad));
+
+    struct ggml_tensor * v = ggml_view_2d(ctx0, kv_cross.v, n_ctx_pad, n_state,
+            ggml_row_size(kv_cross.v->type, n_ctx_pad),
+            ggml_row_size(kv_cross.v->type, n_ctx_pad)*n_state*il);
+
+    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross, k));
+    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcross, v));
+}
+
 static bool whisper_kv_cache_find_slot(
            struct whisper_kv_cache & cache,
         const struct whisper_batch & batch) {
@@ -1072,6 +1457,30 @@ static ggml_backend_t whisper_backend_init(const whisper_context_params & params
     return ggml_backend_cpu_init();
 }
 
+// the triangular mel filters are non-zero only over a short range of FFT bins
+static void whisper_filters_init_sparse(whisper_filters & filters) {
+    filters.beg.resize(filters.n_mel);
+    filters.end.resize(filters.n_mel);
+    filters.offs.resize(filters.n_mel);
+    filters.sparse.clear();
+
+    for (int j = 0; j < filters.n_mel; j++) {
+        const float * row = filters.data.data() + j*filters.n_fft;
+
+        int beg = 0;
+        int end = filters.n_fft;
+
+        while (beg < end && row[beg]     == 0.0f) beg++;
+        while (end > beg && row[end - 1] == 0.0f) end--;
+
+        filters.beg[j]  = beg;
+        filters.end[j]  = end;
+        filters.offs[j] = filters.sparse.size();
+
+        filters.sparse.insert(filters.sparse.end(), row + beg, row + end);
+    }
+}
+
 // load the model from a ggml file
 //
 // file format:
@@ -1184,6 +1593,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         filters.data.resize(filters.n_mel * filters.n_fft);
         loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
         BYTESWAP_FILTERS(filters);
+
+        whisper_filters_init_sparse(filters);
+
+        WHISPER_LOG_INFO("%s: mel filters   = %d x %d (%zu non-zero)\n", __func__, filters.n_mel, filters.n_fft, filters.sparse.size());
     }
 
     // load vocab
@@ -1502,22 +1915,49 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         return false;
     }
 
-    // allocate tensors in the backend buffers
-    model.buffer = ggml_backend_alloc_ctx_tensors(model.ctx, wctx.backend);
-    if (!model.buffer) {
-        WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
-        return false;
+    // with a memory-mapped model file, the CPU tensors point into the mapping where possible
+    if (wctx.mapping && ggml_backend_is_cpu(wctx.backend)) {
+        whisper_mmap_map_tensors(*wctx.mapping, model);
+    }
+
+    size_t n_bytes_unmapped = 0;
+    for (const auto & kv : model.tensors) {
+        if (kv.second->data == nullptr) {
+            n_bytes_unmapped += ggml_nbytes(kv.second);
+        }
     }
 
-    size_t size_main = ggml_backend_buffer_get_size(model.buffer);
+    // allocate the remaining tensors in the backend buffers
+    if (n_bytes_unmapped > 0) {
+        model.buffer = ggml_backend_alloc_ctx_tensors(model.ctx, wctx.backend);
+        if (!model.buffer) {
+            WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
+            return false;
+        }
+    }
+
+    size_t size_main = model.buffer ? ggml_backend_buffer_get_size(model.buffer) : 0;
     WHISPER_LOG_INFO("%s: %8s total size = %8.2f MB\n", __func__, ggml_backend_name(wctx.backend), size_main / 1e6);
 
+    if (wctx.mapping) {
+        WHISPER_LOG_INFO("%s: %8s mmap size  = %8.2f MB\n", __func__, ggml_backend_name(wctx.backend), wctx.mapping->n_bytes_mapped / 1e6);
+    }
+
     // load weights
     {
         size_t total_size = 0;
 
         model.n_loaded = 0;
 
+        size_t expected_size = 0;
+        for (const auto & kv : model.tensors) {
+            expected_size += ggml_nbytes(kv.second);
+        }
+
+        if (wctx.params.progress_callback) {
+            wctx.params.progress_callback(0.0f, wctx.params.progress_callback_user_data);
+        }
+
         std::vector<char> read_buf;
 
         while (true) {
@@ -1577,7 +2017,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
             //printf("%s: [%5.5s] %s\n", __func__, ggml_backend_name(backend), name.c_str());
 
-            if (ggml_backend_buffer_is_host(model.buffer)) {
+            if (wctx.mapping && tensor->buffer == wctx.mapping->buffer) {
+                // the tensor is used in place, skip its data
+                loader->read(loader->context, nullptr, ggml_nbytes(tensor));
+            } else if (ggml_backend_buffer_is_host(tensor->buffer)) {
                 // for the CPU and Metal backend, we can read directly into the tensor
                 loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
                 BYTESWAP_TENSOR(tensor);
@@ -1593,6 +2036,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype), ggml_nbytes(tensor)/1e6);
             total_size += ggml_nbytes(tensor);
             model.n_loaded++;
+
+            if (wctx.params.progress_callback && expected_size > 0) {
+                wctx.params.progress_callback(std::min(1.0f, float(total_size)/expected_size), wctx.params.progress_callback_user_data);
+            }
         }
 
         WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
@@ -1689,57 +2136,25 @@ static struct ggml_cgraph * whisper_build_graph_conv(
     return gf;
 }
 
-static struct ggml_cgraph * whisper_build_graph_encoder(
+// the transformer layers of the encoder
+// the input holds n_batch sequences of n_ctx positional-encoded frames each: [n_state, n_ctx*n_batch]
+// every op except the self-attention treats the frames independently, so only the attention is split per sequence
+static struct ggml_tensor * whisper_build_encoder_layers(
+        struct ggml_context * ctx0,
         whisper_context & wctx,
-          whisper_state & wstate) {
+        struct ggml_tensor * inpL,
+        int n_ctx,
+        int n_batch) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
     const int n_state = hparams.n_audio_state;
     const int n_head  = hparams.n_audio_head;
     const int n_layer = hparams.n_audio_layer;
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.alloc_encode.meta.size(),
-        /*.mem_buffer =*/ wstate.alloc_encode.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
-
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
-
     const float KQscale = 1.0f/sqrtf(float(n_state)/n_head);
 
-    // ===================================================================
-    // NOTE: experimenting with partial evaluation of the encoder (ignore)
-    //static int iter = -1;
-    //const int n_iter = 1500/n_ctx;
-
-    //iter = (iter + 1) % n_iter;
-
-    //if (iter == 0) {
-    //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
-    //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
-    //}
-
-    static int iter = 0;
-
-    const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
-    const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
-
-    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
-    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
-
-    // ===================================================================
-
-    // original:
-    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
-
-    struct ggml_tensor * inpL = cur;
+    struct ggml_tensor * cur = nullptr;
 
     for (int il = 0; il < n_layer; ++il) {
         const auto & layer = model.layers_encoder[il];
@@ -1784,24 +2199,24 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Kcur,
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * V =
                 ggml_cpy(ctx0,
                         ggml_permute(ctx0,
-                            ggml_reshape_3d(ctx0,
+                            ggml_reshape_4d(ctx0,
                                 Vcur,
-                                n_state/n_head, n_head, n_ctx),
+                                n_state/n_head, n_head, n_ctx, n_batch),
                             1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head));
+                        ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_batch));
 
             struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
 #else
@@ -1809,14 +2224,14 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Kcur,
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             // K * Q
@@ -1829,11 +2244,11 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
             struct ggml_tensor * V =
                 ggml_cpy(ctx0,
                         ggml_permute(ctx0,
-                            ggml_reshape_3d(ctx0,
+                            ggml_reshape_4d(ctx0,
                                 Vcur,
-                                n_state/n_head, n_head, n_ctx),
+                                n_state/n_head, n_head, n_ctx, n_batch),
                             1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head)
+                        ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_batch)
                         );
 
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
@@ -1842,7 +2257,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
             cur = ggml_cpy(ctx0,
                     KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx));
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx*n_batch));
         }
 
         // projection
@@ -1873,7 +2288,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
 #ifdef WHISPER_USE_FLASH_FF
             cur = ggml_flash_ff(ctx0,
-                    ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx)),
+                    ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wctx.itype, n_state, n_ctx*n_batch)),
                     layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
             // fully connected
@@ -1910,52 +2325,102 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 model.e_ln_b);
     }
 
-    ggml_build_forward_expand(gf, cur);
-
-    wstate.embd_enc = cur;
-
-    //ggml_graph_print(gf);
-
-    ////////////////////////////////////////////////////////////////////////////
-
-    //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-    //        ggml_used_mem(ctx0)/1e6,
-    //        wstate.get_buf_max_mem(0)/1e6,
-    //        wstate.get_buf_max_mem(1)/1e6,
-    //        wstate.get_buf_max_mem(2)/1e6,
-    //        wstate.get_buf_max_mem(3)/1e6);
-
-    ggml_free(ctx0);
-
-    return gf;
+    return cur;
 }
 
-// pre-compute cross-attention memory
-static struct ggml_cgraph * whisper_build_graph_cross(
+static struct ggml_cgraph * whisper_build_graph_encoder(
         whisper_context & wctx,
           whisper_state & wstate) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
     const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state;
-    const int n_head  = hparams.n_audio_head;
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.alloc_cross.meta.size(),
-        /*.mem_buffer =*/ wstate.alloc_cross.meta.data(),
+        /*.mem_size   =*/ wstate.alloc_encode.meta.size(),
+        /*.mem_buffer =*/ wstate.alloc_encode.meta.data(),
         /*.no_alloc   =*/ true,
     };
 
     struct ggml_context * ctx0 = ggml_init(params);
 
-    ggml_cgraph * gf = ggml_new_graph(ctx0);
-
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_enc);
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
 
-    const float  Kscale = pow(float(n_state) / n_head, -0.25);
+    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
 
-    for (int il = 0; il < model.hparams.n_text_layer; ++il) {
+    // ===================================================================
+    // NOTE: experimenting with partial evaluation of the encoder (ignore)
+    //static int iter = -1;
+    //const int n_iter = 1500/n_ctx;
+
+    //iter = (iter + 1) % n_iter;
+
+    //if (iter == 0) {
+    //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
+    //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
+    //}
+
+    static int iter = 0;
+
+    const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
+    const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+
+    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
+
+    // ===================================================================
+
+    // original:
+    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+
+    cur = whisper_build_encoder_layers(ctx0, wctx, cur, n_ctx, 1);
+
+    ggml_build_forward_expand(gf, cur);
+
+    wstate.embd_enc = cur;
+
+    //ggml_graph_print(gf);
+
+    ////////////////////////////////////////////////////////////////////////////
+
+    //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
+    //        ggml_used_mem(ctx0)/1e6,
+    //        wstate.get_buf_max_mem(0)/1e6,
+    //        wstate.get_buf_max_mem(1)/1e6,
+    //        wstate.get_buf_max_mem(2)/1e6,
+    //        wstate.get_buf_max_mem(3)/1e6);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+// pre-compute cross-attention memory
+static struct ggml_cgraph * whisper_build_graph_cross(
+        whisper_context & wctx,
+          whisper_state & wstate) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.alloc_cross.meta.size(),
+        /*.mem_buffer =*/ wstate.alloc_cross.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_enc);
+
+    const float  Kscale = pow(float(n_state) / n_head, -0.25);
+
+    for (int il = 0; il < model.hparams.n_text_layer; ++il) {
         auto & layer = model.layers_decoder[il];
 
         struct ggml_tensor* Kcross = ggml_mul_mat(ctx0,
@@ -1972,18 +2437,7 @@ static struct ggml_cgraph * whisper_build_graph_cross(
                     Vcross,
                     layer.cross_attn_v_b);
 
-        Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
-
-        struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k,
-                n_state*n_ctx,
-                (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
-
-        struct ggml_tensor * v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
-
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross, k));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcross, v));
+        whisper_build_kv_cross_store(ctx0, gf, wstate.kv_cross, Kcross, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx), il, n_state, n_ctx);
     }
 
     //ggml_graph_print(gf);
@@ -1993,6 +2447,20 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     return gf;
 }
 
+// copy the 2*n_ctx mel frames starting at mel_offset into dst [n_mel][2*n_ctx], zero-padded past the end
+static void whisper_encode_copy_mel(const whisper_mel & mel_inp, int mel_offset, int n_ctx, float * dst) {
+    memset(dst, 0, (size_t) mel_inp.n_mel*2*n_ctx*sizeof(float));
+
+    const int i0 = std::min(mel_offset,           mel_inp.n_len);
+    const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+
+    for (int j = 0; j < mel_inp.n_mel; ++j) {
+        for (int i = i0; i < i1; ++i) {
+            dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+        }
+    }
+}
+
 // evaluate the encoder with the given state
 //
 // given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
@@ -2027,25 +2495,14 @@ static bool whisper_encode_internal(
 
         // set the input
         {
-            const auto & mel_inp = wstate.mel;
-            const int n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+            const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
 
             assert(mel->type == GGML_TYPE_F32);
-            assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
+            assert(wstate.mel.n_mel == wctx.model.hparams.n_mels);
 
             wstate.inp_mel.resize(ggml_nelements(mel));
 
-            float * dst = wstate.inp_mel.data();
-            memset(dst, 0, ggml_nbytes(mel));
-
-            const int i0 = std::min(mel_offset,           mel_inp.n_len);
-            const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
-
-            for (int j = 0; j < mel_inp.n_mel; ++j) {
-                for (int i = i0; i < i1; ++i) {
-                    dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-                }
-            }
+            whisper_encode_copy_mel(wstate.mel, mel_offset, n_ctx, wstate.inp_mel.data());
 
             ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
         }
@@ -2101,6 +2558,220 @@ static bool whisper_encode_internal(
     return !(abort_callback && abort_callback(abort_callback_data));
 }
 
+// conv + encoder + cross-attention memory for a batch of states with the same audio context size
+// the cross-attention K/V of sequence b are written to the kv_cross of states[b]
+static struct ggml_cgraph * whisper_build_graph_encoder_batch(
+        whisper_context & wctx,
+        whisper_encoder_batch & batch,
+        const std::vector<whisper_state *> & states,
+        int n_ctx) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_batch = states.size();
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_mels  = hparams.n_mels;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ batch.alloc.meta.size(),
+        /*.mem_buffer =*/ batch.alloc.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+
+    struct ggml_tensor * mel = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels, n_batch);
+    ggml_set_name(mel, "mel");
+    ggml_set_input(mel);
+
+    struct ggml_tensor * cur = nullptr;
+
+    // convolution + gelu
+    // note: for a batch, the data of the ggml_conv_1d result is laid out as [OL, N, OC] although its shape is [OL, OC, N]
+    {
+        cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
+        cur = ggml_cont(ctx0, ggml_permute(ctx0, ggml_reshape_3d(ctx0, cur, cur->ne[0], n_batch, cur->ne[1]), 0, 2, 1, 3));
+        cur = ggml_add(ctx0, cur, model.e_conv_1_b);
+
+        cur = ggml_gelu(ctx0, cur);
+
+        cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
+        cur = ggml_cont(ctx0, ggml_permute(ctx0, ggml_reshape_3d(ctx0, cur, cur->ne[0], n_batch, cur->ne[1]), 0, 2, 1, 3));
+        cur = ggml_add(ctx0, cur, model.e_conv_2_b);
+
+        cur = ggml_gelu(ctx0, cur);
+    }
+
+    // [n_ctx, n_state, n_batch] -> [n_state, n_ctx*n_batch]
+    {
+        const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
+
+        struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, 0);
+
+        cur = ggml_add(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, cur)), e_pe);
+        cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx*n_batch);
+    }
+
+    cur = whisper_build_encoder_layers(ctx0, wctx, cur, n_ctx, n_batch);
+
+    // cross-attention memory
+    const float Kscale = pow(float(n_state) / n_head, -0.25);
+
+    for (int il = 0; il < model.hparams.n_text_layer; ++il) {
+        auto & layer = model.layers_decoder[il];
+
+        struct ggml_tensor * Kcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_k_w,
+                cur);
+
+        Kcross = ggml_scale(ctx0, Kcross, Kscale);
+
+        struct ggml_tensor * Vcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_v_w,
+                cur);
+
+        Vcross = ggml_add(ctx0,
+                    Vcross,
+                    layer.cross_attn_v_b);
+
+        for (int b = 0; b < n_batch; ++b) {
+            const whisper_kv_cache & kv_cross = states[b]->kv_cross;
+
+            struct ggml_tensor * Kb = ggml_view_2d(ctx0, Kcross, n_state, n_ctx, Kcross->nb[1], b*n_ctx*Kcross->nb[1]);
+            struct ggml_tensor * Vb = ggml_view_2d(ctx0, Vcross, n_state, n_ctx, Vcross->nb[1], b*n_ctx*Vcross->nb[1]);
+
+            whisper_build_kv_cross_store(ctx0, gf, kv_cross, Kb, Vb, il, n_state, n_ctx);
+        }
+    }
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+static bool whisper_encoder_batch_compute(
+        whisper_context & wctx,
+        whisper_encoder_batch & batch,
+        const std::vector<whisper_encoder_batch::request *> & requests,
+        int n_threads) {
+    if (requests.size() == 1) {
+        return whisper_encode_internal(wctx, *requests[0]->state, requests[0]->mel_offset, n_threads, nullptr, nullptr);
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    const int n_ctx  = requests[0]->n_ctx;
+    const int n_mels = wctx.model.hparams.n_mels;
+
+    std::vector<whisper_state *> states;
+    for (const auto * req : requests) {
+        states.push_back(req->state);
+    }
+
+    ggml_cgraph * gf = whisper_build_graph_encoder_batch(wctx, batch, states, n_ctx);
+
+    // the compute buffer grows to fit the largest batch seen so far
+    if (!ggml_gallocr_alloc_graph(batch.alloc.alloc, gf)) {
+        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+        return false;
+    }
+
+    struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+
+    batch.inp_mel.resize(ggml_nelements(mel));
+
+    for (size_t b = 0; b < requests.size(); ++b) {
+        whisper_encode_copy_mel(requests[b]->state->mel, requests[b]->mel_offset, n_ctx, batch.inp_mel.data() + b*n_mels*2*n_ctx);
+    }
+
+    ggml_backend_tensor_set(mel, batch.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+
+    if (!ggml_graph_compute_helper(batch.backend, gf, n_threads)) {
+        return false;
+    }
+
+    const int64_t t_encode_us = ggml_time_us() - t_start_us;
+
+    for (auto * state : states) {
+        state->t_encode_us += t_encode_us;
+        state->n_encode++;
+    }
+
+    return true;
+}
+
+// queue an encoder pass and wait for it to be computed as part of a batch
+// the oldest pending request acts as the leader: it waits until the batch is full or its deadline has passed,
+// then computes the batch on its own thread and wakes up the other members
+static bool whisper_encode_batched(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads) {
+    auto & batch = *wctx.encoder_batch;
+
+    whisper_encoder_batch::request req = {
+        /*.state         =*/ &wstate,
+        /*.mel_offset    =*/ mel_offset,
+        /*.n_ctx         =*/ wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx,
+        /*.t_deadline_us =*/ ggml_time_us() + batch.t_wait_max_us,
+        /*.done          =*/ false,
+        /*.ok            =*/ false,
+    };
+
+    std::unique_lock<std::mutex> lock(batch.mutex);
+
+    batch.pending.push_back(&req);
+    batch.cv.notify_all();
+
+    while (!req.done) {
+        if (batch.busy || batch.pending.front() != &req) {
+            batch.cv.wait(lock);
+            continue;
+        }
+
+        // only requests with the same audio context size can share a graph
+        std::vector<whisper_encoder_batch::request *> requests;
+        for (auto * other : batch.pending) {
+            if (other->n_ctx == req.n_ctx && (int) requests.size() < batch.n_batch_max) {
+                requests.push_back(other);
+            }
+        }
+
+        const int64_t t_now_us = ggml_time_us();
+
+        if ((int) requests.size() < batch.n_batch_max && t_now_us < req.t_deadline_us) {
+            batch.cv.wait_for(lock, std::chrono::microseconds(req.t_deadline_us - t_now_us));
+            continue;
+        }
+
+        for (auto * other : requests) {
+            batch.pending.erase(std::find(batch.pending.begin(), batch.pending.end(), other));
+        }
+
+        batch.busy = true;
+
+        lock.unlock();
+
+        const bool ok = whisper_encoder_batch_compute(wctx, batch, requests, n_threads);
+
+        lock.lock();
+
+        for (auto * other : requests) {
+            other->ok   = ok;
+            other->done = true;
+        }
+
+        batch.busy = false;
+        batch.cv.notify_all();
+    }
+
+    return req.ok;
+}
+
 static struct ggml_cgraph * whisper_build_graph_decoder(
          whisper_context & wctx,
          whisper_state   & wstate,
@@ -2120,6 +2791,7 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
     const int n_tokens    = batch.n_tokens;
     const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_cross_ctx = whisper_kv_cross_n_ctx(wstate.kv_cross, n_audio_ctx);
 
     const int32_t n_kv     = worst_case ? n_ctx            : kv_self.n;
     const int32_t kv_head  = worst_case ? n_ctx - n_tokens : kv_self.head;
@@ -2150,6 +2822,14 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     ggml_set_name(KQ_mask, "KQ_mask");
     ggml_set_input(KQ_mask);
 
+    // masks the padding of a quantized cross-attention cache
+    struct ggml_tensor * KQ_mask_cross = nullptr;
+    if (n_cross_ctx > n_audio_ctx) {
+        KQ_mask_cross = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_cross_ctx);
+        ggml_set_name(KQ_mask_cross, "KQ_mask_cross");
+        ggml_set_input(KQ_mask_cross);
+    }
+
     // token encoding + position encoding
     struct ggml_tensor * cur =
         ggml_add(ctx0,
@@ -2204,7 +2884,7 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
                 Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state, ggml_row_size(kv_self.k->type, n_state)*(il*n_ctx + kv_head));
                 struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
                         (   n_ctx)*ggml_element_size(kv_self.v),
                         (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
@@ -2223,9 +2903,9 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
             struct ggml_tensor * K =
                 ggml_view_3d(ctx0, kv_self.k,
                         n_state/n_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state/n_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+                        ggml_row_size(kv_self.k->type, n_state),
+                        ggml_row_size(kv_self.k->type, n_state/n_head),
+                        ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
 
             // K * Q
             struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
@@ -2294,10 +2974,10 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
             // Kcross is already scaled
             struct ggml_tensor * Kcross =
                 ggml_view_3d(ctx0, wstate.kv_cross.k,
-                        n_state/n_head, n_audio_ctx, n_head,
-                        ggml_element_size(wstate.kv_cross.k)*n_state,
-                        ggml_element_size(wstate.kv_cross.k)*n_state/n_head,
-                        ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
+                        n_state/n_head, n_cross_ctx, n_head,
+                        ggml_row_size(wstate.kv_cross.k->type, n_state),
+                        ggml_row_size(wstate.kv_cross.k->type, n_state/n_head),
+                        ggml_row_size(wstate.kv_cross.k->type, n_state)*n_cross_ctx*il);
 
             //struct ggml_tensor * Vcross =
             //    ggml_reshape_3d(ctx0,
@@ -2311,10 +2991,10 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
             struct ggml_tensor * V =
                 ggml_view_3d(ctx0, wstate.kv_cross.v,
-                        n_audio_ctx, n_state/n_head, n_head,
-                        n_audio_ctx*ggml_element_size(wstate.kv_cross.v),
-                        n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state/n_head,
-                        n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state*il);
+                        n_cross_ctx, n_state/n_head, n_head,
+                        ggml_row_size(wstate.kv_cross.v->type, n_cross_ctx),
+                        ggml_row_size(wstate.kv_cross.v->type, n_cross_ctx)*n_state/n_head,
+                        ggml_row_size(wstate.kv_cross.v->type, n_cross_ctx)*n_state*il);
 
             // ------
 
@@ -2335,6 +3015,11 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
             // no masking for cross-attention
             //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
 
+            // except for the padding of a quantized cache
+            if (KQ_mask_cross) {
+                KQ = ggml_add(ctx0, KQ, KQ_mask_cross);
+            }
+
             struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ);
 
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
@@ -2463,7 +3148,20 @@ static bool whisper_decode_internal(
         auto & kv_self = wstate.kv_self;
 
         if (!whisper_kv_cache_find_slot(kv_self, batch)) {
-            return false;
+            // the cache starts with room for a single decoder and grows when more are used
+            const int n_ctx_new = kv_self.size + hparams.n_text_ctx/2;
+
+            if (!kv_cache_grow(hparams, kv_self, wctx.backend, n_ctx_new)) {
+                WHISPER_LOG_ERROR("%s: failed to grow the self-attention cache to %d cells\n", __func__, n_ctx_new);
+                return false;
+            }
+
+            WHISPER_LOG_DEBUG("%s: self-attention cache grown to %d cells (%7.2f MB)\n", __func__,
+                    n_ctx_new, ggml_backend_buffer_get_size(kv_self.buffer)/1e6);
+
+            if (!whisper_kv_cache_find_slot(kv_self, batch)) {
+                return false;
+            }
         }
 
         kv_self.n = whisper_kv_cache_cell_max(kv_self);
@@ -2523,6 +3221,15 @@ static bool whisper_decode_internal(
             ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
         }
 
+        if (struct ggml_tensor * KQ_mask_cross = ggml_graph_get_tensor(gf, "KQ_mask_cross")) {
+            const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+            std::vector<float> data(ggml_nelements(KQ_mask_cross), -INFINITY);
+            std::fill(data.begin(), data.begin() + n_audio_ctx, 0.0f);
+
+            ggml_backend_tensor_set(KQ_mask_cross, data.data(), 0, ggml_nbytes(KQ_mask_cross));
+        }
+
         logits = gf->nodes[gf->n_nodes - 1];
 
         if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
@@ -2676,6 +3383,230 @@ static void fft(const std::vector<float> & in, std::vector<float> & out) {
     }
 }
 
+static bool whisper_fft_plan_init(whisper_fft_plan & plan, int n) {
+    if (n < 2) {
+        return false;
+    }
+
+    plan.n     = n;
+    plan.n_c   = n % 2 == 0 ? n/2 : n;
+    plan.n_out = n/2 + 1;
+
+    // factorize the size of the complex transform, radix-4 stages first
+    plan.radix.clear();
+    {
+        int m = plan.n_c;
+        while (m % 4 == 0) { plan.radix.push_back(4); m /= 4; }
+        while (m % 2 == 0) { plan.radix.push_back(2); m /= 2; }
+        for (int f = 3; m > 1; f += 2) {
+            while (m % f == 0) { plan.radix.push_back(f); m /= f; }
+        }
+    }
+
+    const int n_stage = plan.radix.size();
+
+    // the stages are applied bottom-up, so the last radix splits the input first
+    plan.perm.resize(plan.n_c);
+    for (int i = 0; i < plan.n_c; ++i) {
+        int idx  = i;
+        int pos  = 0;
+        int span = plan.n_c;
+        for (int t = n_stage - 1; t >= 0; --t) {
+            const int r = plan.radix[t];
+            span /= r;
+            pos  += (idx % r)*span;
+            idx  /= r;
+        }
+        plan.perm[pos] = i;
+    }
+
+    // twiddles of stage t: W_len^(q*k) for k = 0 .. m - 1, q = 1 .. r - 1, where m is the size of the sub-transforms
+    plan.twiddle.clear();
+    for (int t = 0, m = 1; t < n_stage; m *= plan.radix[t], ++t) {
+        const int r   = plan.radix[t];
+        const int len = r*m;
+        for (int k = 0; k < m; ++k) {
+            for (int q = 1; q < r; ++q) {
+                const double theta = (2*M_PI*q*k)/len;
+                plan.twiddle.push_back( cos(theta));
+                plan.twiddle.push_back(-sin(theta));
+            }
+        }
+    }
+
+    plan.twiddle_r.resize(2*plan.n_out);
+    for (int k = 0; k < plan.n_out; ++k) {
+        const double theta = (2*M_PI*k)/n;
+        plan.twiddle_r[2*k + 0] =  cos(theta);
+        plan.twiddle_r[2*k + 1] = -sin(theta);
+    }
+
+    return true;
+}
+
+// real-input FFT using a precomputed plan, does not allocate
+// in:   plan.n real samples
+// out:  plan.n_out complex bins (re, im)
+// work: plan.n_work() floats of scratch memory
+static void whisper_fft(const whisper_fft_plan & plan, const float * in, float * out, float * work) {
+    const int n_c = plan.n_c;
+
+    float * z = work;
+
+    // load the input in digit-reversed order, pairs of real samples form one complex sample
+    if (plan.n != n_c) {
+        for (int p = 0; p < n_c; ++p) {
+            z[2*p + 0] = in[2*plan.perm[p] + 0];
+            z[2*p + 1] = in[2*plan.perm[p] + 1];
+        }
+    } else {
+        for (int p = 0; p < n_c; ++p) {
+            z[2*p + 0] = in[plan.perm[p]];
+            z[2*p + 1] = 0.0f;
+        }
+    }
+
+    const float * tw = plan.twiddle.data();
+
+    for (int t = 0, m = 1; t < (int) plan.radix.size(); m *= plan.radix[t], ++t) {
+        const int r   = plan.radix[t];
+        const int len = r*m;
+
+        for (int b = 0; b < n_c; b += len) {
+            for (int k = 0; k < m; ++k) {
+                float * x = z + 2*(b + k);
+                const float * w = tw + 2*k*(r - 1);
+
+                // multiply the inputs of the butterfly by the twiddle factors
+                float a[2*5];
+                float * ap = r <= 5 ? a : work + 2*n_c;
+
+                ap[0] = x[0];
+                ap[1] = x[1];
+                for (int q = 1; q < r; ++q) {
+                    const float re = x[2*q*m + 0];
+                    const float im = x[2*q*m + 1];
+                    const float wr = w[2*(q - 1) + 0];
+                    const float wi = w[2*(q - 1) + 1];
+                    ap[2*q + 0] = re*wr - im*wi;
+                    ap[2*q + 1] = re*wi + im*wr;
+                }
+
+                switch (r) {
+                    case 2:
+                        {
+                            x[0]       = ap[0] + ap[2];
+                            x[1]       = ap[1] + ap[3];
+                            x[2*m + 0] = ap[0] - ap[2];
+                            x[2*m + 1] = ap[1] - ap[3];
+                        } break;
+                    case 3:
+                        {
+                            const float s  = 0.86602540378443864676f; // sin(2*pi/3)
+                            const float t1r = ap[2] + ap[4], t1i = ap[3] + ap[5];
+                            const float t2r = ap[2] - ap[4], t2i = ap[3] - ap[5];
+                            const float br  = ap[0] - 0.5f*t1r;
+                            const float bi  = ap[1] - 0.5f*t1i;
+
+                            x[0]       = ap[0] + t1r;
+                            x[1]       = ap[1] + t1i;
+                            x[2*m + 0] = br + s*t2i;
+                            x[2*m + 1] = bi - s*t2r;
+                            x[4*m + 0] = br - s*t2i;
+                            x[4*m + 1] = bi + s*t2r;
+                        } break;
+                    case 4:
+                        {
+                            const float s0r = ap[0] + ap[4], s0i = ap[1] + ap[5];
+                            const float d0r = ap[0] - ap[4], d0i = ap[1] - ap[5];
+                            const float s1r = ap[2] + ap[6], s1i = ap[3] + ap[7];
+                            const float d1r = ap[2] - ap[6], d1i = ap[3] - ap[7];
+
+                            x[0]       = s0r + s1r;
+                            x[1]       = s0i + s1i;
+                            x[2*m + 0] = d0r + d1i;
+                            x[2*m + 1] = d0i - d1r;
+                            x[4*m + 0] = s0r - s1r;
+                            x[4*m + 1] = s0i - s1i;
+                            x[6*m + 0] = d0r - d1i;
+                            x[6*m + 1] = d0i + d1r;
+                        } break;
+                    case 5:
+                        {
+                            const float c1 =  0.30901699437494742410f; // cos(2*pi/5)
+                            const float c2 = -0.80901699437494742410f; // cos(4*pi/5)
+                            const float s1 =  0.95105651629515357212f; // sin(2*pi/5)
+                            const float s2 =  0.58778525229247312917f; // sin(4*pi/5)
+
+                            const float t1r = ap[2] + ap[8], t1i = ap[3] + ap[9];
+                            const float t2r = ap[4] + ap[6], t2i = ap[5] + ap[7];
+                            const float t3r = ap[2] - ap[8], t3i = ap[3] - ap[9];
+                            const float t4r = ap[4] - ap[6], t4i = ap[5] - ap[7];
+
+                            const float b1r = ap[0] + c1*t1r + c2*t2r, b1i = ap[1] + c1*t1i + c2*t2i;
+                            const float b2r = ap[0] + c2*t1r + c1*t2r, b2i = ap[1] + c2*t1i + c1*t2i;
+                            const float d1r = s1*t3r + s2*t4r,         d1i = s1*t3i + s2*t4i;
+                            const float d2r = s2*t3r - s1*t4r,         d2i = s2*t3i - s1*t4i;
+
+                            x[0]       = ap[0] + t1r + t2r;
+                            x[1]       = ap[1] + t1i + t2i;
+                            x[2*m + 0] = b1r + d1i;
+                            x[2*m + 1] = b1i - d1r;
+                            x[4*m + 0] = b2r + d2i;
+                            x[4*m + 1] = b2i - d2r;
+                            x[6*m + 0] = b2r - d2i;
+                            x[6*m + 1] = b2i + d2r;
+                            x[8*m + 0] = b1r - d1i;
+                            x[8*m + 1] = b1i + d1r;
+                        } break;
+                    default:
+                        {
+                            // generic radix-r DFT for other prime factors
+                            for (int j = 0; j < r; ++j) {
+                                float re = 0.0f;
+                                float im = 0.0f;
+                                for (int q = 0; q < r; ++q) {
+                                    const double theta = (2*M_PI*((q*j) % r))/r;
+                                    const float  wr = cos(theta);
+                                    const float  wi = -sin(theta);
+                                    re += ap[2*q + 0]*wr - ap[2*q + 1]*wi;
+                                    im += ap[2*q + 0]*wi + ap[2*q + 1]*wr;
+                                }
+                                x[2*j*m + 0] = re;
+                                x[2*j*m + 1] = im;
+                            }
+                        } break;
+                }
+            }
+        }
+
+        tw += 2*m*(r - 1);
+    }
+
+    if (plan.n == n_c) {
+        std::copy(z, z + 2*plan.n_out, out);
+        return;
+    }
+
+    // recover the spectrum of the real input from the transform of the packed samples
+    for (int k = 0; k < plan.n_out; ++k) {
+        const int k0 = k % n_c;
+        const int k1 = (n_c - k) % n_c;
+
+        const float ar = z[2*k0 + 0], ai = z[2*k0 + 1];
+        const float cr = z[2*k1 + 0], ci = z[2*k1 + 1];
+
+        const float er = 0.5f*(ar + cr), ei = 0.5f*(ai - ci);
+        const float orr = 0.5f*(ai + ci), oi = -0.5f*(ar - cr);
+
+        const float wr = plan.twiddle_r[2*k + 0];
+        const float wi = plan.twiddle_r[2*k + 1];
+
+        out[2*k + 0] = er + wr*orr - wi*oi;
+        out[2*k + 1] = ei + wr*oi  + wi*orr;
+    }
+}
+
 static bool hann_window(int length, bool periodic, std::vector<float> & output) {
     if (output.size() < static_cast<size_t>(length)) {
         output.resize(length);
@@ -2691,17 +3622,470 @@ static bool hann_window(int length, bool periodic, std::vector<float> & output)
     return true;
 }
 
-static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const std::vector<float> & samples,
-                                              int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
+static void whisper_worker_pool_loop(whisper_worker_pool & pool, int ith, uint64_t n_job) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.cv_job.wait(lock, [&] { return pool.stop || pool.n_job != n_job; });
+
+            if (pool.stop) {
+                return;
+            }
+
+            n_job = pool.n_job;
+
+            if (ith >= pool.n_active) {
+                continue;
+            }
+        }
+
+        (*pool.job)(ith);
+
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            if (--pool.n_pending == 0) {
+                pool.cv_done.notify_one();
+            }
+        }
+    }
+}
+
+// run job(ith) for ith in [0, n_threads) and wait for all of them to finish
+// threads are spawned on first use and kept alive until whisper_worker_pool_free()
+static void whisper_worker_pool_run(whisper_worker_pool & pool, int n_threads, const std::function<void(int)> & job) {
+    const int n_workers = std::max(0, n_threads - 1);
+
+    if (n_workers == 0) {
+        job(0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+
+        while ((int) pool.threads.size() < n_workers) {
+            const int ith = pool.threads.size() + 1;
+            pool.threads.emplace_back(whisper_worker_pool_loop, std::ref(pool), ith, pool.n_job);
+        }
+
+        pool.job       = &job;
+        pool.n_active  = n_threads;
+        pool.n_pending = n_workers;
+        pool.n_job++;
+    }
+
+    pool.cv_job.notify_all();
+
+    job(0);
+
+    {
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        pool.cv_done.wait(lock, [&] { return pool.n_pending == 0; });
+        pool.job = nullptr;
+    }
+}
+
+static void whisper_worker_pool_free(whisper_worker_pool & pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.stop = true;
+    }
+
+    pool.cv_job.notify_all();
+
+    for (auto & t : pool.threads) {
+        t.join();
+    }
+
+    pool.threads.clear();
+}
+
+// y[i] = |x[i]|^2 for n interleaved complex numbers
+static void whisper_vec_power_f32(int n, float * y, const float * x) {
+    int i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        const __m256 a = _mm256_loadu_ps(x + 2*i + 0);
+        const __m256 b = _mm256_loadu_ps(x + 2*i + 8);
+
+        // de-interleave per 128-bit lane, then restore the order of the lanes
+        const __m256 re = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m256 im = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+        const __m256 p = _mm256_add_ps(_mm256_mul_ps(re, re), _mm256_mul_ps(im, im));
+
+        _mm256_storeu_ps(y + i, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(p), _MM_SHUFFLE(3, 1, 2, 0))));
+    }
+#elif defined(__SSE__) || defined(_M_X64)
+    for (; i + 4 <= n; i += 4) {
+        const __m128 a = _mm_loadu_ps(x + 2*i + 0);
+        const __m128 b = _mm_loadu_ps(x + 2*i + 4);
+
+        const __m128 re = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 im = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        const float32x4x2_t v = vld2q_f32(x + 2*i);
+
+        vst1q_f32(y + i, vaddq_f32(vmulq_f32(v.val[0], v.val[0]), vmulq_f32(v.val[1], v.val[1])));
+    }
+#endif
+
+    for (; i < n; i++) {
+        y[i] = x[2*i + 0]*x[2*i + 0] + x[2*i + 1]*x[2*i + 1];
+    }
+}
+
+static float whisper_vec_dot_f32(int n, const float * x, const float * y) {
+    int i = 0;
+    float sum = 0.0f;
+
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc);
+    }
+    sum = _mm512_reduce_add_ps(acc);
+#elif defined(__AVX__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+#if defined(__FMA__)
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc);
+#else
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+#endif
+    }
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_add_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_add_ss(acc4, _mm_shuffle_ps(acc4, acc4, 1));
+    sum = _mm_cvtss_f32(acc4);
+#elif defined(__SSE__) || defined(_M_X64)
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(x + i), vld1q_f32(y + i));
+    }
+    sum = vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1) + vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+#endif
+
+    for (; i < n; i++) {
+        sum += x[i]*y[i];
+    }
+
+    return sum;
+}
+
+static float whisper_vec_max_f32(int n, const float * x, float vmax) {
+    int i = 0;
+
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_set1_ps(vmax);
+    for (; i + 16 <= n; i += 16) {
+        acc = _mm512_max_ps(acc, _mm512_loadu_ps(x + i));
+    }
+    vmax = _mm512_reduce_max_ps(acc);
+#elif defined(__AVX__)
+    __m256 acc = _mm256_set1_ps(vmax);
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_max_ps(acc, _mm256_loadu_ps(x + i));
+    }
+    __m128 acc4 = _mm_max_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_max_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_max_ss(acc4, _mm_shuffle_ps(acc4, acc4, 1));
+    vmax = _mm_cvtss_f32(acc4);
+#elif defined(__SSE__) || defined(_M_X64)
+    __m128 acc = _mm_set1_ps(vmax);
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_max_ps(acc, _mm_loadu_ps(x + i));
+    }
+    acc = _mm_max_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_max_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    vmax = _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(vmax);
+    for (; i + 4 <= n; i += 4) {
+        acc = vmaxq_f32(acc, vld1q_f32(x + i));
+    }
+    vmax = std::max(std::max(vgetq_lane_f32(acc, 0), vgetq_lane_f32(acc, 1)), std::max(vgetq_lane_f32(acc, 2), vgetq_lane_f32(acc, 3)));
+#endif
+
+    for (; i < n; i++) {
+        vmax = std::max(vmax, x[i]);
+    }
+
+    return vmax;
+}
+
+// exp(x) for the logits: exp(x) = 2^k*exp(r) with k = round(x/ln2), the polynomial for exp(r) is the one of Cephes expf
+// the relative error is below 2e-7, inputs below -87.3 (including -INFINITY) give exactly 0
+#define WHISPER_EXPF_LO -87.33654f
+#define WHISPER_EXPF_HI  88.0f
+#define WHISPER_EXPF_P0  1.9875691500e-4f
+#define WHISPER_EXPF_P1  1.3981999507e-3f
+#define WHISPER_EXPF_P2  8.3334519073e-3f
+#define WHISPER_EXPF_P3  4.1665795894e-2f
+#define WHISPER_EXPF_P4  1.6666665459e-1f
+#define WHISPER_EXPF_P5  5.0000001201e-1f
+
+#if defined(__AVX512F__)
+static inline __m512 whisper_v_expf(__m512 x) {
+    const __mmask16 zero = _mm512_cmp_ps_mask(x, _mm512_set1_ps(WHISPER_EXPF_LO), _CMP_LT_OQ);
+
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(WHISPER_EXPF_LO)), _mm512_set1_ps(WHISPER_EXPF_HI));
+
+    const __m512i k  = _mm512_cvtps_epi32(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504088896341f)));
+    const __m512  fk = _mm512_cvtepi32_ps(k);
+
+    __m512 r = _mm512_fnmadd_ps(fk, _mm512_set1_ps(0.693359375f), x);
+    r = _mm512_fnmadd_ps(fk, _mm512_set1_ps(-2.12194440e-4f), r);
+
+    __m512 y = _mm512_set1_ps(WHISPER_EXPF_P0);
+    y = _mm512_fmadd_ps(y, r, _mm512_set1_ps(WHISPER_EXPF_P1));
+    y = _mm512_fmadd_ps(y, r, _mm512_set1_ps(WHISPER_EXPF_P2));
+    y = _mm512_fmadd_ps(y, r, _mm512_set1_ps(WHISPER_EXPF_P3));
+    y = _mm512_fmadd_ps(y, r, _mm512_set1_ps(WHISPER_EXPF_P4));
+    y = _mm512_fmadd_ps(y, r, _mm512_set1_ps(WHISPER_EXPF_P5));
+    y = _mm512_fmadd_ps(_mm512_mul_ps(y, r), r, _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+
+    const __m512 pow2k = _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(k, _mm512_set1_epi32(127)), 23));
+
+    return _mm512_maskz_mov_ps(~zero, _mm512_mul_ps(y, pow2k));
+}
+#elif defined(__AVX2__)
+static inline __m256 whisper_v_expf(__m256 x) {
+    const __m256 zero = _mm256_cmp_ps(x, _mm256_set1_ps(WHISPER_EXPF_LO), _CMP_LT_OQ);
+
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(WHISPER_EXPF_LO)), _mm256_set1_ps(WHISPER_EXPF_HI));
+
+    const __m256i k  = _mm256_cvtps_epi32(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)));
+    const __m256  fk = _mm256_cvtepi32_ps(k);
+
+    __m256 r = _mm256_sub_ps(x, _mm256_mul_ps(fk, _mm256_set1_ps(0.693359375f)));
+    r = _mm256_sub_ps(r, _mm256_mul_ps(fk, _mm256_set1_ps(-2.12194440e-4f)));
+
+    __m256 y = _mm256_set1_ps(WHISPER_EXPF_P0);
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(WHISPER_EXPF_P1));
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(WHISPER_EXPF_P2));
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(WHISPER_EXPF_P3));
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(WHISPER_EXPF_P4));
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(WHISPER_EXPF_P5));
+    y = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(y, r), r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+    const __m256 pow2k = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(k, _mm256_set1_epi32(127)), 23));
+
+    return _mm256_andnot_ps(zero, _mm256_mul_ps(y, pow2k));
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+static inline __m128 whisper_v_expf(__m128 x) {
+    const __m128 zero = _mm_cmplt_ps(x, _mm_set1_ps(WHISPER_EXPF_LO));
+
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(WHISPER_EXPF_LO)), _mm_set1_ps(WHISPER_EXPF_HI));
+
+    const __m128i k  = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)));
+    const __m128  fk = _mm_cvtepi32_ps(k);
+
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(fk, _mm_set1_ps(0.693359375f)));
+    r = _mm_sub_ps(r, _mm_mul_ps(fk, _mm_set1_ps(-2.12194440e-4f)));
+
+    __m128 y = _mm_set1_ps(WHISPER_EXPF_P0);
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(WHISPER_EXPF_P1));
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(WHISPER_EXPF_P2));
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(WHISPER_EXPF_P3));
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(WHISPER_EXPF_P4));
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(WHISPER_EXPF_P5));
+    y = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(y, r), r), _mm_add_ps(r, _mm_set1_ps(1.0f)));
+
+    const __m128 pow2k = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(k, _mm_set1_epi32(127)), 23));
+
+    return _mm_andnot_ps(zero, _mm_mul_ps(y, pow2k));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static inline float32x4_t whisper_v_expf(float32x4_t x) {
+    const uint32x4_t zero = vcltq_f32(x, vdupq_n_f32(WHISPER_EXPF_LO));
+
+    x = vminq_f32(vmaxq_f32(x, vdupq_n_f32(WHISPER_EXPF_LO)), vdupq_n_f32(WHISPER_EXPF_HI));
+
+    const int32x4_t   k  = vcvtnq_s32_f32(vmulq_n_f32(x, 1.44269504088896341f));
+    const float32x4_t fk = vcvtq_f32_s32(k);
+
+    float32x4_t r = vmlsq_n_f32(x, fk, 0.693359375f);
+    r = vmlsq_n_f32(r, fk, -2.12194440e-4f);
+
+    float32x4_t y = vdupq_n_f32(WHISPER_EXPF_P0);
+    y = vmlaq_f32(vdupq_n_f32(WHISPER_EXPF_P1), y, r);
+    y = vmlaq_f32(vdupq_n_f32(WHISPER_EXPF_P2), y, r);
+    y = vmlaq_f32(vdupq_n_f32(WHISPER_EXPF_P3), y, r);
+    y = vmlaq_f32(vdupq_n_f32(WHISPER_EXPF_P4), y, r);
+    y = vmlaq_f32(vdupq_n_f32(WHISPER_EXPF_P5), y, r);
+    y = vmlaq_f32(vaddq_f32(r, vdupq_n_f32(1.0f)), vmulq_f32(y, r), r);
+
+    const float32x4_t pow2k = vreinterpretq_f32_s32(vshlq_n_s32(vaddq_s32(k, vdupq_n_s32(127)), 23));
+
+    return vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(vmulq_f32(y, pow2k)), zero));
+}
+#endif
+
+// log(sum(exp(x[i]))), -INFINITY if all x[i] are -INFINITY
+static float whisper_vec_logsumexp_f32(int n, const float * x) {
+    const float vmax = whisper_vec_max_f32(n, x, -INFINITY);
+    if (vmax == -INFINITY) {
+        return -INFINITY;
+    }
+
+    int i = 0;
+
+    float sum = 0.0f;
+
+#if defined(__AVX512F__)
+    const __m512 vmax16 = _mm512_set1_ps(vmax);
+    __m512 acc = _mm512_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        acc = _mm512_add_ps(acc, whisper_v_expf(_mm512_sub_ps(_mm512_loadu_ps(x + i), vmax16)));
+    }
+    sum = _mm512_reduce_add_ps(acc);
+#elif defined(__AVX2__)
+    const __m256 vmax8 = _mm256_set1_ps(vmax);
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_add_ps(acc, whisper_v_expf(_mm256_sub_ps(_mm256_loadu_ps(x + i), vmax8)));
+    }
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_add_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_add_ss(acc4, _mm_shuffle_ps(acc4, acc4, 1));
+    sum = _mm_cvtss_f32(acc4);
+#elif defined(__SSE2__) || defined(_M_X64)
+    const __m128 vmax4 = _mm_set1_ps(vmax);
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_add_ps(acc, whisper_v_expf(_mm_sub_ps(_mm_loadu_ps(x + i), vmax4)));
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t vmax4 = vdupq_n_f32(vmax);
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        acc = vaddq_f32(acc, whisper_v_expf(vsubq_f32(vld1q_f32(x + i), vmax4)));
+    }
+    sum = vaddvq_f32(acc);
+#endif
+
+    for (; i < n; i++) {
+        sum += expf(x[i] - vmax);
+    }
+
+    return logf(sum) + vmax;
+}
+
+// y[i] = exp(x[i])
+static void whisper_vec_exp_f32(int n, float * y, const float * x) {
+    int i = 0;
+
+#if defined(__AVX512F__)
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(y + i, whisper_v_expf(_mm512_loadu_ps(x + i)));
+    }
+#elif defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, whisper_v_expf(_mm256_loadu_ps(x + i)));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(y + i, whisper_v_expf(_mm_loadu_ps(x + i)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(y + i, whisper_v_expf(vld1q_f32(x + i)));
+    }
+#endif
+
+    for (; i < n; i++) {
+        y[i] = expf(x[i]);
+    }
+}
+
+// y[i] = x[i] - log(sum(exp(x[j]))), -INFINITY stays -INFINITY
+static void whisper_vec_log_softmax_f32(int n, float * y, const float * x) {
+    const float logsumexp = whisper_vec_logsumexp_f32(n, x);
+
+    if (logsumexp == -INFINITY) {
+        std::fill(y, y + n, -INFINITY);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        y[i] = x[i] - logsumexp;
+    }
+}
+
+// x[i] = (max(x[i], vmin) + 4)/4
+static void whisper_vec_mel_norm_f32(int n, float * x, float vmin) {
+    int i = 0;
+
+#if defined(__AVX512F__)
+    const __m512 vmin16 = _mm512_set1_ps(vmin);
+    const __m512 four16 = _mm512_set1_ps(4.0f);
+    const __m512 quar16 = _mm512_set1_ps(0.25f);
+    for (; i + 16 <= n; i += 16) {
+        const __m512 v = _mm512_max_ps(_mm512_loadu_ps(x + i), vmin16);
+        _mm512_storeu_ps(x + i, _mm512_mul_ps(_mm512_add_ps(v, four16), quar16));
+    }
+#elif defined(__AVX__)
+    const __m256 vmin8 = _mm256_set1_ps(vmin);
+    const __m256 four8 = _mm256_set1_ps(4.0f);
+    const __m256 quar8 = _mm256_set1_ps(0.25f);
+    for (; i + 8 <= n; i += 8) {
+        const __m256 v = _mm256_max_ps(_mm256_loadu_ps(x + i), vmin8);
+        _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_add_ps(v, four8), quar8));
+    }
+#elif defined(__SSE__) || defined(_M_X64)
+    const __m128 vmin4 = _mm_set1_ps(vmin);
+    const __m128 four4 = _mm_set1_ps(4.0f);
+    const __m128 quar4 = _mm_set1_ps(0.25f);
+    for (; i + 4 <= n; i += 4) {
+        const __m128 v = _mm_max_ps(_mm_loadu_ps(x + i), vmin4);
+        _mm_storeu_ps(x + i, _mm_mul_ps(_mm_add_ps(v, four4), quar4));
+    }
+#elif defined(__ARM_NEON)
+    const float32x4_t vmin4 = vdupq_n_f32(vmin);
+    const float32x4_t four4 = vdupq_n_f32(4.0f);
+    const float32x4_t quar4 = vdupq_n_f32(0.25f);
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t v = vmaxq_f32(vld1q_f32(x + i), vmin4);
+        vst1q_f32(x + i, vmulq_f32(vaddq_f32(v, four4), quar4));
+    }
+#endif
+
+    for (; i < n; i++) {
+        x[i] = (std::max(x[i], vmin) + 4.0f)*0.25f;
+    }
+}
+
+// computes the frames [0, n_frames) that overlap the signal, the silent padding frames are filled by the caller
+static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const float * samples,
+                                              int n_samples, int n_frames, int frame_size, int frame_step, int n_threads,
+                                              const whisper_filters & filters, const whisper_fft_plan & fft_plan, whisper_mel & mel) {
+    // all buffers are allocated once per call, the per-frame work does not allocate
     std::vector<float> fft_in(frame_size, 0.0);
-    std::vector<float> fft_out(2 * frame_step);
+    std::vector<float> fft_out(2 * fft_plan.n_out);
+    std::vector<float> fft_pow(fft_plan.n_out);
+    std::vector<float> fft_work(fft_plan.n_work());
     // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
     int n_fft = 1 + (frame_size / 2);
-    int i = ith;
 
-    // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
+    for (int i = ith; i < n_frames; i += n_threads) {
         const int offset = i * frame_step;
 
         // apply Hanning window (~10% faster)
@@ -2714,46 +4098,24 @@ static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float>
         }
 
         // FFT
-        fft(fft_in, fft_out);
+        whisper_fft(fft_plan, fft_in.data(), fft_out.data(), fft_work.data());
 
         // Calculate modulus^2 of complex numbers
         // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < frame_size; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
+        whisper_vec_power_f32(n_fft, fft_pow.data(), fft_out.data());
 
-        // mel spectrogram
+        // mel spectrogram - only the non-zero range of each filter is visited
         for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
+            const int beg = filters.beg[j];
+            const int end = std::min(filters.end[j], n_fft);
 
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
+            double sum = end > beg ? whisper_vec_dot_f32(end - beg, fft_pow.data() + beg, filters.sparse.data() + filters.offs[j]) : 0.0;
 
             sum = log10(std::max(sum, 1e-10));
 
             mel.data[j * mel.n_len + i] = sum;
         }
     }
-
-    // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
-    for (; i < mel.n_len; i += n_threads) {
-        for (int j = 0; j < mel.n_mel; j++) {
-            mel.data[j * mel.n_len + i] = sum;
-        }
-    }
 }
 
 // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
@@ -2767,6 +4129,7 @@ static bool log_mel_spectrogram(
               const int   n_mel,
               const int   n_threads,
               const whisper_filters & filters,
+              const whisper_fft_plan & fft_plan,
               const bool   debug,
               whisper_mel & mel) {
     const int64_t t_start_us = ggml_time_us();
@@ -2782,13 +4145,14 @@ static bool log_mel_spectrogram(
     int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
     int64_t stage_2_pad = frame_size / 2;
 
-    // Initialize a vector and copy data from C array to it.
-    std::vector<float> samples_padded;
-    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
+    // Only the signal and its reflective / zero pads are materialized. The 30 seconds of zeros that follow
+    // (480,000 samples) produce known-silent frames that are never read by the FFT.
+    std::vector<float> & samples_padded = wstate.mel_samples_padded;
+    samples_padded.resize(n_samples + stage_2_pad * 2);
     std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
 
-    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
-    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+    // zero pad 200 samples at the end of audio
+    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.end(), 0);
 
     // reflective pad 200 samples at the beginning of audio
     std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
@@ -2796,45 +4160,45 @@ static bool log_mel_spectrogram(
     mel.n_mel     = n_mel;
     // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
     // Calculate number of frames + remove the last frame
-    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
+    mel.n_len     = (n_samples + stage_1_pad + stage_2_pad * 2 - frame_size) / frame_step;
     // Calculate semi-padded sample length to ensure compatibility
     mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
     mel.data.resize(mel.n_mel * mel.n_len);
 
+    // frames past this point only see the zero padding
+    const int n_samples_pad = n_samples + stage_2_pad;
+    const int n_frames      = std::min(n_samples_pad / frame_step + 1, mel.n_len);
 
     {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples_padded,
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
-        }
+        const int n_threads_mel = std::max(1, std::min(n_threads, n_frames));
 
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+        const std::function<void(int)> job = [&](int ith) {
+            log_mel_spectrogram_worker_thread(ith, hann, samples_padded.data(), n_samples_pad, n_frames,
+                    frame_size, frame_step, n_threads_mel, filters, fft_plan, mel);
+        };
 
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
-        }
+        whisper_worker_pool_run(wstate.mel_workers, n_threads_mel, job);
     }
 
+    // the power spectrum of a silent frame is all zero
+    const float mel_silent = log10(1e-10);
+
     // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
-        }
+    float mmax = n_frames < mel.n_len ? mel_silent : -1e20f;
+    for (int j = 0; j < mel.n_mel; j++) {
+        mmax = whisper_vec_max_f32(n_frames, mel.data.data() + j*mel.n_len, mmax);
     }
 
-    mmax -= 8.0;
+    const float mmin = (double) mmax - 8.0;
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
+    const float mel_silent_norm = (std::max(mel_silent, mmin) + 4.0f)*0.25f;
+
+    for (int j = 0; j < mel.n_mel; j++) {
+        float * row = mel.data.data() + j*mel.n_len;
+
+        whisper_vec_mel_norm_f32(n_frames, row, mmin);
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+        std::fill(row + n_frames, row + mel.n_len, mel_silent_norm);
     }
 
     wstate.t_mel_us += ggml_time_us() - t_start_us;
@@ -2965,6 +4329,28 @@ static std::string whisper_openvino_get_path_cache(std::string path_bin) {
 }
 #endif
 
+size_t whisper_state_n_bytes(struct whisper_state * state) {
+    size_t n_bytes = 0;
+
+    for (const whisper_kv_cache * kv : { &state->kv_self, &state->kv_cross }) {
+        if (kv->buffer) {
+            n_bytes += ggml_backend_buffer_get_size(kv->buffer);
+        }
+    }
+
+    for (whisper_allocr * allocr : { &state->alloc_conv, &state->alloc_encode, &state->alloc_cross, &state->alloc_decode }) {
+        if (allocr->alloc) {
+            n_bytes += whisper_allocr_size(*allocr);
+        }
+    }
+
+    if (state->draft_state) {
+        n_bytes += whisper_state_n_bytes(state->draft_state);
+    }
+
+    return n_bytes;
+}
+
 struct whisper_state * whisper_init_state(whisper_context * ctx) {
     fill_sin_cos_table();
 
@@ -2977,11 +4363,26 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         return nullptr;
     }
 
-    // at this point, we don't know yet how many decoders will be used, so we overallocate 3x ctx
-    // in theory, there can be a case where this is not enough, but in practice it should always be enough
-    const int factor = 3;
+    const auto & hparams = ctx->model.hparams;
+
+    // the quantized K are viewed per attention head, so the head size must be a multiple of the block size
+    const bool kv_q8_ok = (hparams.n_text_state/hparams.n_text_head) % ggml_blck_size(GGML_TYPE_Q8_0) == 0;
+
+    if ((ctx->params.kv_self_q8 || ctx->params.kv_cross_q8) && !kv_q8_ok) {
+        WHISPER_LOG_WARN("%s: the attention head size %d does not allow Q8_0 KV caches, using %s\n", __func__,
+                hparams.n_text_state/hparams.n_text_head, ggml_type_name(ctx->itype));
+    }
+
+    const ggml_type type_self_k  = ctx->params.kv_self_q8  && kv_q8_ok ? GGML_TYPE_Q8_0 : ctx->itype;
+    const ggml_type type_cross_k = ctx->params.kv_cross_q8 && kv_q8_ok ? GGML_TYPE_Q8_0 : ctx->itype;
 
-    if (!kv_cache_init(ctx->model.hparams, state->kv_self, ctx->backend, ctx->itype, factor*ctx->model.hparams.n_text_ctx)) {
+    // the self-attention V is stored transposed and updated one position at a time, so it cannot be quantized
+    const ggml_type type_self_v  = ctx->itype;
+    const ggml_type type_cross_v = type_cross_k;
+
+    // at this point, we don't know yet how many decoders will be used, so the cache is sized for a single decoder
+    // (prompt and sampled tokens together are at most n_text_ctx) and grows in whisper_decode_internal() when needed
+    if (!kv_cache_init(hparams, state->kv_self, ctx->backend, type_self_k, type_self_v, hparams.n_text_ctx)) {
         WHISPER_LOG_ERROR("%s: kv_cache_init() failed for self-attention cache\n", __func__);
         whisper_free_state(state);
         return nullptr;
@@ -2989,10 +4390,11 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
     {
         const size_t memory_size = ggml_nbytes(state->kv_self.k) + ggml_nbytes(state->kv_self.v);
-        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
+        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB (%s / %s)\n", __func__, memory_size / 1e6, ggml_type_name(type_self_k), ggml_type_name(type_self_v));
     }
 
-    if (!kv_cache_init(ctx->model.hparams, state->kv_cross, ctx->backend, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
+    if (!kv_cache_init(hparams, state->kv_cross, ctx->backend, type_cross_k, type_cross_v,
+                GGML_PAD(hparams.n_audio_ctx, ggml_blck_size(type_cross_v)))) {
         WHISPER_LOG_ERROR("%s: kv_cache_init() failed for cross-attention cache\n", __func__);
         whisper_free_state(state);
         return nullptr;
@@ -3000,7 +4402,7 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
     {
         const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
-        WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1e6);
+        WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB (%s / %s)\n", __func__, memory_size / 1e6, ggml_type_name(type_cross_k), ggml_type_name(type_cross_v));
     }
 
 #ifdef WHISPER_USE_COREML
@@ -3107,22 +4509,31 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
         WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_allocr_size(state->alloc_decode) / 1e6);
     }
 
+    WHISPER_LOG_INFO("%s: state size = %7.2f MB\n", __func__, whisper_state_n_bytes(state) / 1e6);
+
     return state;
 }
 
-int whisper_ctx_init_openvino_encoder(
+int whisper_ctx_init_openvino_encoder_with_state(
         struct whisper_context * ctx,
+          struct whisper_state * state,
                     const char * model_path,
                     const char * device,
                     const char * cache_dir) {
 #ifndef WHISPER_USE_OPENVINO
     (void)(ctx);
+    (void)(state);
     (void)(model_path);
     (void)(device);
     (void)(cache_dir);
 
     return 1;
 #else
+    if (state == nullptr) {
+        WHISPER_LOG_ERROR("%s: no state to attach the OpenVINO encoder to\n", __func__);
+        return 1;
+    }
+
     if (!model_path && ctx->path_model.empty()) {
         WHISPER_LOG_ERROR("%s: model_path is nullptr, and ctx has no model_path set.\n", __func__);
         return 1;
@@ -3147,8 +4558,12 @@ int whisper_ctx_init_openvino_encoder(
     WHISPER_LOG_INFO("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
     WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
 
-    ctx->state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
-    if (!ctx->state->ctx_openvino) {
+    if (state->ctx_openvino != nullptr) {
+        whisper_openvino_free(state->ctx_openvino);
+    }
+
+    state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
+    if (!state->ctx_openvino) {
         WHISPER_LOG_ERROR("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
         return 1;
     } else {
@@ -3159,17 +4574,83 @@ int whisper_ctx_init_openvino_encoder(
 #endif
 }
 
+int whisper_ctx_init_openvino_encoder(
+        struct whisper_context * ctx,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir) {
+#ifdef WHISPER_USE_OPENVINO
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: ctx has no default state to attach the OpenVINO encoder to\n", __func__);
+        return 1;
+    }
+#endif
+
+    return whisper_ctx_init_openvino_encoder_with_state(ctx, ctx->state, model_path, device, cache_dir);
+}
+
 struct whisper_context_params whisper_context_default_params() {
     struct whisper_context_params result = {
-        /*.use_gpu    =*/ true,
-        /*.gpu_device =*/ 0,
+        /*.use_gpu       =*/ true,
+        /*.gpu_device    =*/ 0,
+        /*.use_mmap      =*/ true,
+        /*.mmap_prefetch =*/ true,
+        /*.kv_self_q8    =*/ false,
+        /*.kv_cross_q8   =*/ false,
+
+        /*.progress_callback           =*/ nullptr,
+        /*.progress_callback_user_data =*/ nullptr,
     };
     return result;
 }
 
+static struct whisper_context * whisper_init_with_params_no_state_impl(struct whisper_model_loader * loader, struct whisper_context_params params, whisper_mmap * mapping);
+
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
 
+    whisper_mmap * mapping = params.use_mmap ? whisper_mmap_init(path_model, params.mmap_prefetch) : nullptr;
+
+    if (mapping) {
+        whisper_model_loader loader = {};
+
+        loader.context = mapping;
+
+        // reads with a null output skip the data
+        loader.read = [](void * ctx, void * output, size_t read_size) {
+            whisper_mmap * mapping = (whisper_mmap *) ctx;
+
+            size_t size_to_copy = mapping->pos + read_size < mapping->size ? read_size : mapping->size - mapping->pos;
+
+            if (output) {
+                memcpy(output, (const char *) mapping->addr + mapping->pos, size_to_copy);
+            }
+            mapping->pos += size_to_copy;
+
+            return size_to_copy;
+        };
+
+        loader.eof = [](void * ctx) {
+            whisper_mmap * mapping = (whisper_mmap *) ctx;
+
+            return mapping->pos >= mapping->size;
+        };
+
+        loader.close = [](void * /*ctx*/) { };
+
+        auto ctx = whisper_init_with_params_no_state_impl(&loader, params, mapping);
+
+        if (ctx) {
+            ctx->path_model = path_model;
+        }
+
+        return ctx;
+    }
+
+    if (params.use_mmap) {
+        WHISPER_LOG_WARN("%s: failed to map '%s', reading it instead\n", __func__, path_model);
+    }
+
     auto fin = std::ifstream(path_model, std::ios::binary);
     if (!fin) {
         WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
@@ -3242,24 +4723,32 @@ struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * bu
     return whisper_init_with_params_no_state(&loader, params);
 }
 
-struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+static struct whisper_context * whisper_init_with_params_no_state_impl(struct whisper_model_loader * loader, struct whisper_context_params params, whisper_mmap * mapping) {
     ggml_time_init();
 
     whisper_context * ctx = new whisper_context;
-    ctx->params = params;
+    ctx->params  = params;
+    ctx->mapping = mapping;
 
     if (!whisper_model_load(loader, *ctx)) {
         loader->close(loader->context);
         WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
+        whisper_mmap_free(ctx->mapping);
         delete ctx;
         return nullptr;
     }
 
     loader->close(loader->context);
 
+    whisper_fft_plan_init(ctx->fft_plan, WHISPER_N_FFT);
+
     return ctx;
 }
 
+struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    return whisper_init_with_params_no_state_impl(loader, params, nullptr);
+}
+
 struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
     whisper_context * ctx = whisper_init_from_file_with_params_no_state(path_model, params);
     if (!ctx) {
@@ -3350,6 +4839,11 @@ void whisper_free_state(struct whisper_state * state) {
 
         whisper_batch_free(state->batch);
 
+        whisper_free_state(state->draft_state);
+
+        whisper_worker_pool_free(state->mel_workers);
+        whisper_worker_pool_free(state->decoder_workers);
+
         ggml_gallocr_free(state->alloc_conv.alloc);
         ggml_gallocr_free(state->alloc_encode.alloc);
         ggml_gallocr_free(state->alloc_cross.alloc);
@@ -3361,6 +4855,50 @@ void whisper_free_state(struct whisper_state * state) {
     }
 }
 
+static void whisper_encoder_batch_free(whisper_encoder_batch * batch) {
+    if (batch) {
+        ggml_gallocr_free(batch->alloc.alloc);
+        ggml_backend_free(batch->backend);
+
+        delete batch;
+    }
+}
+
+int whisper_ctx_init_encoder_batch(struct whisper_context * ctx, int n_batch_max, int t_wait_ms) {
+    whisper_encoder_batch_free(ctx->encoder_batch);
+    ctx->encoder_batch = nullptr;
+
+    if (n_batch_max <= 1) {
+        return 0;
+    }
+
+    if (n_batch_max > WHISPER_MAX_ENCODER_BATCH) {
+        WHISPER_LOG_WARN("%s: n_batch_max = %d is too large, using %d\n", __func__, n_batch_max, WHISPER_MAX_ENCODER_BATCH);
+        n_batch_max = WHISPER_MAX_ENCODER_BATCH;
+    }
+
+    auto * batch = new whisper_encoder_batch;
+
+    batch->n_batch_max   = n_batch_max;
+    batch->t_wait_max_us = std::max(0, t_wait_ms)*1000LL;
+
+    batch->backend = whisper_backend_init(ctx->params);
+    if (!batch->backend) {
+        WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
+        whisper_encoder_batch_free(batch);
+        return 1;
+    }
+
+    batch->alloc.alloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(batch->backend));
+    batch->alloc.meta.resize(ggml_tensor_overhead()*WHISPER_MAX_NODES + ggml_graph_overhead_custom(WHISPER_MAX_NODES, false));
+
+    ctx->encoder_batch = batch;
+
+    WHISPER_LOG_INFO("%s: batching up to %d encoder passes, waiting at most %d ms\n", __func__, n_batch_max, t_wait_ms);
+
+    return 0;
+}
+
 void whisper_free(struct whisper_context * ctx) {
     if (ctx) {
         ggml_free(ctx->model.ctx);
@@ -3369,6 +4907,14 @@ void whisper_free(struct whisper_context * ctx) {
 
         whisper_free_state(ctx->state);
 
+        for (auto * state : ctx->states_parallel) {
+            whisper_free_state(state);
+        }
+
+        whisper_encoder_batch_free(ctx->encoder_batch);
+
+        whisper_mmap_free(ctx->mapping);
+
         ggml_backend_free(ctx->backend);
 
         delete ctx;
@@ -3388,7 +4934,7 @@ void whisper_free_params(struct whisper_full_params * params) {
 }
 
 int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, ctx->fft_plan, false, state->mel)) {
         WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
         return -1;
     }
@@ -3402,7 +4948,10 @@ int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int
 
 // same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
 int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
+    whisper_fft_plan fft_plan;
+    whisper_fft_plan_init(fft_plan, 2 * WHISPER_N_FFT);
+
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, fft_plan, false, state->mel)) {
         WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
         return -1;
     }
@@ -3797,6 +5346,10 @@ void whisper_print_timings(struct whisper_context * ctx) {
         WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
         WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
         WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
+        if (ctx->state->n_draft > 0) {
+            WHISPER_LOG_INFO("%s:    draft time = %8.2f ms / %5d tokens, %5d accepted (%5.1f%%)\n", __func__, 1e-3f * ctx->state->t_draft_us,
+                    ctx->state->n_draft, ctx->state->n_draft_accept, 100.0f * ctx->state->n_draft_accept / ctx->state->n_draft);
+        }
     }
     WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
@@ -3815,7 +5368,33 @@ void whisper_reset_timings(struct whisper_context * ctx) {
         ctx->state->n_decode = 0;
         ctx->state->n_batchd = 0;
         ctx->state->n_prompt = 0;
-    }
+        ctx->state->t_draft_us = 0;
+        ctx->state->n_draft = 0;
+        ctx->state->n_draft_accept = 0;
+    }
+}
+
+struct whisper_timings whisper_get_timings_from_state(struct whisper_state * state) {
+    struct whisper_timings result = {
+        /*.t_mel_us       =*/ state->t_mel_us,
+        /*.t_sample_us    =*/ state->t_sample_us,
+        /*.t_encode_us    =*/ state->t_encode_us,
+        /*.t_decode_us    =*/ state->t_decode_us,
+        /*.t_batchd_us    =*/ state->t_batchd_us,
+        /*.t_prompt_us    =*/ state->t_prompt_us,
+        /*.t_draft_us     =*/ state->t_draft_us,
+
+        /*.n_sample       =*/ state->n_sample,
+        /*.n_encode       =*/ state->n_encode,
+        /*.n_decode       =*/ state->n_decode,
+        /*.n_batchd       =*/ state->n_batchd,
+        /*.n_prompt       =*/ state->n_prompt,
+        /*.n_fail_p       =*/ state->n_fail_p,
+        /*.n_fail_h       =*/ state->n_fail_h,
+        /*.n_draft        =*/ state->n_draft,
+        /*.n_draft_accept =*/ state->n_draft_accept,
+    };
+    return result;
 }
 
 static int whisper_has_coreml(void) {
@@ -4323,6 +5902,7 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.speed_up          =*/ false,
         /*.debug_mode        =*/ false,
         /*.audio_ctx         =*/ 0,
+        /*.audio_ctx_auto    =*/ false,
 
         /*.tdrz_enable       =*/ false,
 
@@ -4355,6 +5935,11 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
             /*.patience  =*/ -1.0f,
         },
 
+        /*.draft            =*/ {
+            /*.ctx     =*/ nullptr,
+            /*.n_draft =*/ 5,
+        },
+
         /*.new_segment_callback           =*/ nullptr,
         /*.new_segment_callback_user_data =*/ nullptr,
 
@@ -4622,44 +6207,15 @@ static void whisper_process_logits(
         }
 
         // populate the logprobs array (log_softmax)
-        {
-            const float logit_max = *std::max_element(logits.begin(), logits.end());
-            float logsumexp = 0.0f;
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logsumexp += expf(logits[i] - logit_max);
-                }
-            }
-            logsumexp = logf(logsumexp) + logit_max;
-
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logprobs[i] = logits[i] - logsumexp;
-                } else {
-                    logprobs[i] = -INFINITY;
-                }
-            }
-        }
+        whisper_vec_log_softmax_f32(n_logits, logprobs.data(), logits.data());
 
         // if sum of probability over timestamps is above any other token, sample timestamp
         // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
         {
             // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
+            const float timestamp_logprob = whisper_vec_logsumexp_f32(n_logits - vocab.token_beg, logprobs.data() + vocab.token_beg);
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+            const float max_text_token_logprob = whisper_vec_max_f32(vocab.token_beg, logprobs.data(), -INFINITY);
 
             //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
@@ -4673,39 +6229,14 @@ static void whisper_process_logits(
                     whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
 
                     // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
-
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
+                    whisper_vec_log_softmax_f32(n_logits, logprobs.data(), logits.data());
                 }
             }
         }
     }
 
-    // compute probs
-    {
-        for (int i = 0; i < n_logits; ++i) {
-            if (logits[i] == -INFINITY) {
-                probs[i] = 0.0f;
-            } else {
-                probs[i] = expf(logprobs[i]);
-            }
-        }
-    }
+    // compute probs, the suppressed tokens get 0
+    whisper_vec_exp_f32(n_logits, probs.data(), logprobs.data());
 
 #if 0
     // print first 100 logits - token string : logit
@@ -4871,90 +6402,315 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
     float pt    = 0.0;
     float ptsum = 0.0;
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
+
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
+            }
+
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                tid = i;
+            }
+        }
+
+        pt    = max_ts/(sum_ts + 1e-10);
+        ptsum = sum_ts;
+    }
+
+    std::discrete_distribution<> dist(probs.begin(), probs.end());
+
+    for (int i = 0; i < k; ++i) {
+        const auto id = dist(decoder.rng);
+        //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
+
+        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
+
+        if (result[i].id >= vocab.token_beg) {
+            result[i].tid = result[i].id;
+            result[i].pt  = result[i].p;
+        }
+    }
+
+    return result;
+}
+
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
+static void whisper_sequence_score(
+        const struct whisper_full_params & params,
+                        whisper_sequence & sequence) {
+    if (sequence.result_len == 0) {
+        return;
+    }
+
+    double result = 0.0f;
+
+    for (int i = 0; i < sequence.result_len; ++i) {
+        result += sequence.tokens[i].plog;
+    }
+
+    sequence.sum_logprobs = result;
+    sequence.avg_logprobs = result/sequence.result_len;
+
+    double penalty = sequence.result_len;
+
+    if (params.length_penalty > 0.0f) {
+        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
+    }
+
+    sequence.score = result/penalty;
+
+    // compute the entropy of the sequence of the last 32 tokens
+    {
+        const int n = 32;
+
+        int cnt = 0;
+        double entropy = 0.0f;
+
+        std::map<whisper_token, int> token_counts;
+        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
+            token_counts[sequence.tokens[i].id]++;
+            cnt++;
+        }
+
+        for (const auto & kv : token_counts) {
+            const auto p = kv.second/(double)cnt;
+            entropy -= p*log(p);
+
+            //WHISPER_LOG_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+        }
+
+        sequence.entropy = entropy;
+    }
+}
+
+// smallest audio context that covers n_frames mel frames plus ~1.3 s of trailing context
+// the sizes are bucketed so that only a few distinct encoder graphs are ever built
+static int whisper_audio_ctx_bucket(int n_audio_ctx, int n_frames) {
+    static const int buckets[] = { 256, 384, 512, 768, 1024, };
+
+    // the encoder convolutions halve the number of mel frames
+    const int n_needed = (n_frames + 1)/2 + 64;
+
+    for (int b : buckets) {
+        if (b >= n_audio_ctx) {
+            break;
+        }
+        if (b >= n_needed) {
+            return b;
+        }
+    }
+
+    return n_audio_ctx;
+}
+
+// speculative decoding
+// the draft model encodes the window itself and greedily proposes the next tokens of decoder 0,
+// which are then verified by the main model in a single batched decode
+
+// prepare the draft state for a new decoding pass of the window at seek
+static bool whisper_draft_begin(
+             struct whisper_state & state,
+        const whisper_full_params & params,
+   const std::vector<whisper_token> & prompt,
+                               int   seek) {
+    whisper_context & dctx = *params.draft.ctx;
+
+    if (state.draft_state == nullptr || state.draft_ctx != &dctx) {
+        whisper_free_state(state.draft_state);
+
+        state.draft_ctx   = &dctx;
+        state.draft_state = whisper_init_state(&dctx);
+        state.draft_seek  = -1;
+        if (state.draft_state == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to initialize the draft state\n", __func__);
+            return false;
+        }
+    }
+
+    whisper_state & dstate = *state.draft_state;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (state.draft_seek != seek) {
+        if (state.draft_seek < 0) {
+            dstate.mel = state.mel;
+        }
+
+        dstate.exp_n_audio_ctx = state.exp_n_audio_ctx;
+
+        if (!whisper_encode_internal(dctx, dstate, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+            WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+            return false;
+        }
+
+        state.draft_seek = seek;
+    }
+
+    whisper_kv_cache_clear(dstate.kv_self);
+
+    whisper_batch_prep_legacy(dstate.batch, prompt.data(), prompt.size(), 0, 0);
+
+    if (!whisper_decode_internal(dctx, dstate, dstate.batch, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+        return false;
+    }
+
+    state.draft_past.clear();
+    state.draft_pending.clear();
+    state.draft_next = 0;
+
+    state.t_draft_us += ggml_time_us() - t_start_us;
+
+    return true;
+}
+
+// propose up to n_draft tokens that continue the sequence of the decoder
+static bool whisper_draft_propose(
+             struct whisper_state & state,
+        const whisper_full_params & params,
+            const whisper_decoder & decoder,
+                               int   n_prompt,
+                               int   n_draft,
+       std::vector<whisper_token> & result) {
+    result.clear();
+
+    if (n_draft <= 0) {
+        return true;
+    }
+
+    whisper_context & dctx   = *state.draft_ctx;
+    whisper_state   & dstate = *state.draft_state;
+
+    const auto & tokens = decoder.sequence.tokens;
+
+    auto & past = state.draft_past;
+
+    // keep the part of the draft KV cache that agrees with the sequence - at least the last token is decoded again
+    size_t n_keep = 0;
+    while (n_keep < past.size() && n_keep + 1 < tokens.size() && past[n_keep] == tokens[n_keep].id) {
+        n_keep++;
+    }
+
+    whisper_kv_cache_seq_rm(dstate.kv_self, 0, n_prompt + n_keep, -1);
+
+    past.resize(n_keep);
+    for (size_t i = n_keep; i < tokens.size(); ++i) {
+        past.push_back(tokens[i].id);
+    }
+
+    // the draft decoder applies the same logit filters, so that its proposals can be accepted
+    auto & ddecoder = dstate.decoders[0];
+
+    ddecoder.sequence.tokens = tokens;
+    ddecoder.seek_delta      = decoder.seek_delta;
+    ddecoder.has_ts          = decoder.has_ts;
+    ddecoder.grammar         = {};
+
+    auto dparams = params;
+
+    dparams.logits_filter_callback           = nullptr;
+    dparams.logits_filter_callback_user_data = nullptr;
+
+    int n_past = n_prompt + n_keep;
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
+    whisper_batch_prep_legacy(dstate.batch, past.data() + n_keep, past.size() - n_keep, n_past, 0);
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                tid = i;
-            }
+    while (true) {
+        if (!whisper_decode_internal(dctx, dstate, dstate.batch, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+            WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+            return false;
         }
 
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
-    }
+        n_past += dstate.batch.n_tokens;
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
+        ddecoder.i_batch = dstate.batch.n_tokens - 1;
 
-    for (int i = 0; i < k; ++i) {
-        const auto id = dist(decoder.rng);
-        //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
+        whisper_process_logits(dctx, dstate, ddecoder, dparams, 0.0f);
 
-        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
+        const auto token = whisper_sample_token(dctx, ddecoder, true);
 
-        if (result[i].id >= vocab.token_beg) {
-            result[i].tid = result[i].id;
-            result[i].pt  = result[i].p;
+        result.push_back(token.id);
+
+        if ((int) result.size() == n_draft || token.id == whisper_token_eot(&dctx)) {
+            break;
         }
-    }
 
-    return result;
-}
+        ddecoder.sequence.tokens.push_back(token);
 
-// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
-static void whisper_sequence_score(
-        const struct whisper_full_params & params,
-                        whisper_sequence & sequence) {
-    if (sequence.result_len == 0) {
-        return;
-    }
+        if (token.id > whisper_token_beg(&dctx)) {
+            ddecoder.seek_delta = 2*(token.id - whisper_token_beg(&dctx));
+            ddecoder.has_ts     = true;
+        }
 
-    double result = 0.0f;
+        past.push_back(token.id);
 
-    for (int i = 0; i < sequence.result_len; ++i) {
-        result += sequence.tokens[i].plog;
+        whisper_batch_prep_legacy(dstate.batch, &token.id, 1, n_past, 0);
     }
 
-    sequence.sum_logprobs = result;
-    sequence.avg_logprobs = result/sequence.result_len;
+    return true;
+}
 
-    double penalty = sequence.result_len;
+// compute the logits of the next token of decoder 0, the last token of its sequence is at position n_past
+// if the token was proposed by the draft model, the logits are already available from the last decode
+// otherwise, the rejected proposals are removed from the KV cache and the token is decoded together with new ones
+static bool whisper_draft_decode(
+           struct whisper_context & ctx,
+             struct whisper_state & state,
+        const whisper_full_params & params,
+                               int   n_prompt,
+                               int   n_past,
+                               int   n_draft) {
+    auto & decoder = state.decoders[0];
+    auto & pending = state.draft_pending;
+
+    const whisper_token id = decoder.sequence.tokens.back().id;
+
+    if (state.draft_next < (int) pending.size() && pending[state.draft_next] == id) {
+        decoder.i_batch = ++state.draft_next;
+        state.n_draft_accept++;
+    } else {
+        whisper_kv_cache_seq_rm(state.kv_self, 0, n_past, -1);
 
-    if (params.length_penalty > 0.0f) {
-        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
-    }
+        const int64_t t_start_us = ggml_time_us();
 
-    sequence.score = result/penalty;
+        if (!whisper_draft_propose(state, params, decoder, n_prompt, n_draft, pending)) {
+            return false;
+        }
 
-    // compute the entropy of the sequence of the last 32 tokens
-    {
-        const int n = 32;
+        state.t_draft_us += ggml_time_us() - t_start_us;
+        state.n_draft    += pending.size();
+        state.draft_next  = 0;
 
-        int cnt = 0;
-        double entropy = 0.0f;
+        auto & batch = state.batch;
 
-        std::map<whisper_token, int> token_counts;
-        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
-            token_counts[sequence.tokens[i].id]++;
-            cnt++;
-        }
+        whisper_batch_prep_legacy(batch, nullptr, pending.size() + 1, n_past, 0);
 
-        for (const auto & kv : token_counts) {
-            const auto p = kv.second/(double)cnt;
-            entropy -= p*log(p);
+        batch.token[0] = id;
+        for (int i = 0; i < (int) pending.size(); ++i) {
+            batch.token[i + 1] = pending[i];
+        }
+        std::fill(batch.logits, batch.logits + batch.n_tokens, 1);
 
-            //WHISPER_LOG_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+        if (!whisper_decode_internal(ctx, state, batch, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+            WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+            return false;
         }
 
-        sequence.entropy = entropy;
+        decoder.i_batch = 0;
     }
+
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    whisper_process_logits(ctx, state, decoder, params, 0.0f);
+
+    state.t_sample_us += ggml_time_us() - t_start_sample_us;
+
+    return true;
 }
 
 int whisper_full_with_state(
@@ -5099,7 +6855,14 @@ int whisper_full_with_state(
         WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
         return -5;
     }
-    state->exp_n_audio_ctx = params.audio_ctx;
+    if (params.audio_ctx > 0) {
+        state->exp_n_audio_ctx = params.audio_ctx;
+    } else if (params.audio_ctx_auto) {
+        state->exp_n_audio_ctx = whisper_audio_ctx_bucket(whisper_n_audio_ctx(ctx), seek_end - seek_start);
+        WHISPER_LOG_DEBUG("%s: audio_ctx_auto - using audio_ctx = %d for %d ms of audio\n", __func__, state->exp_n_audio_ctx, (seek_end - seek_start)*10);
+    } else {
+        state->exp_n_audio_ctx = whisper_n_audio_ctx(ctx);
+    }
 
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
@@ -5146,6 +6909,19 @@ int whisper_full_with_state(
     std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
     std::vector<beam_candidate> beam_candidates;
 
+    // the draft model has to produce the same tokens from the same mel spectrogram
+    bool use_draft = params.draft.ctx != nullptr && params.draft.n_draft > 0 && params.strategy == WHISPER_SAMPLING_GREEDY;
+
+    if (use_draft && (
+            params.draft.ctx->vocab.n_vocab != ctx->vocab.n_vocab ||
+            params.draft.ctx->model.hparams.n_mels != ctx->model.hparams.n_mels ||
+            params.draft.ctx->model.hparams.n_text_ctx != ctx->model.hparams.n_text_ctx)) {
+        WHISPER_LOG_WARN("%s: the draft model is not compatible with the model - not using it\n", __func__);
+        use_draft = false;
+    }
+
+    state->draft_seek = -1;
+
     // main loop
     while (true) {
         if (params.progress_callback) {
@@ -5168,7 +6944,16 @@ int whisper_full_with_state(
         }
 
         // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        if (ctx->encoder_batch && !whisper_encode_external(*state)) {
+            if (!whisper_encode_batched(*ctx, *state, seek, params.n_threads)) {
+                WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
+                return -6;
+            }
+
+            if (params.abort_callback && params.abort_callback(params.abort_callback_user_data)) {
+                return -6;
+            }
+        } else if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
@@ -5205,6 +6990,8 @@ int whisper_full_with_state(
 
             n_decoders_cur = std::max(1, n_decoders_cur);
 
+            const bool use_draft_cur = use_draft && n_decoders_cur == 1 && t_cur < 1e-6f;
+
             WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
 
             // TAGS: WHISPER_DECODER_INIT
@@ -5283,6 +7070,10 @@ int whisper_full_with_state(
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
                 }
+
+                if (use_draft_cur && !whisper_draft_begin(*state, params, prompt, seek)) {
+                    return -7;
+                }
             }
 
             for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
@@ -5340,21 +7131,7 @@ int whisper_full_with_state(
 
                     const int n_threads = std::min(params.n_threads, n_decoders_cur);
 
-                    if (n_threads == 1) {
-                        process();
-                    } else {
-                        std::vector<std::thread> threads(n_threads - 1);
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t] = std::thread(process);
-                        }
-
-                        process();
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t].join();
-                        }
-                    }
+                    whisper_worker_pool_run(state->decoder_workers, n_threads, [&](int /*ith*/) { process(); });
                 }
 
                 beam_candidates.clear();
@@ -5531,7 +7308,16 @@ int whisper_full_with_state(
                 state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
                 // obtain logits for the next token
-                {
+                if (use_draft_cur) {
+                    const int n_past = prompt.size() + i;
+
+                    // do not propose tokens beyond the text context or the last iteration
+                    const int n_draft = std::min(params.draft.n_draft, std::min(whisper_n_text_ctx(ctx) - 1 - n_past, n_max - 1 - i));
+
+                    if (!whisper_draft_decode(*ctx, *state, params, prompt.size(), n_past, n_draft)) {
+                        return -8;
+                    }
+                } else {
                     auto & batch = state->batch;
 
                     batch.n_tokens = 0;
@@ -5590,21 +7376,7 @@ int whisper_full_with_state(
 
                         const int n_threads = std::min(params.n_threads, n_decoders_cur);
 
-                        if (n_threads == 1) {
-                            process();
-                        } else {
-                            std::vector<std::thread> threads(n_threads - 1);
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t] = std::thread(process);
-                            }
-
-                            process();
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t].join();
-                            }
-                        }
+                        whisper_worker_pool_run(state->decoder_workers, n_threads, [&](int /*ith*/) { process(); });
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
@@ -5817,37 +7589,166 @@ int whisper_full(
     return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
 }
 
-int whisper_full_parallel(
+// split [0, n_samples) into n_chunks pieces of similar length, cutting in pauses of the speech
+// the energy is the mean absolute amplitude of 10 ms frames (as in vad_simple), smoothed over ~300 ms
+// each cut is placed in the middle of the silent run (energy below vad_thold times the average) that is closest to
+// the ideal, equally spaced position, within +/- 25% of a chunk (at most 5 s); without a pause, the quietest frame is used
+// returns the n_chunks + 1 boundaries in samples, in_silence[i] tells if cut i was placed in a pause
+static std::vector<int> whisper_vad_split(const float * samples, int n_samples, int n_chunks, std::vector<bool> & in_silence) {
+    const float vad_thold = 0.6f;
+
+    const int n_frame  = WHISPER_SAMPLE_RATE/100;
+    const int n_frames = n_samples/n_frame;
+    const int n_smooth = 15;
+
+    std::vector<int> bounds = { 0 };
+    in_silence.clear();
+
+    if (n_chunks <= 1 || n_frames < 2*n_chunks) {
+        bounds.push_back(n_samples);
+        return bounds;
+    }
+
+    std::vector<float> energy(n_frames, 0.0f);
+    double energy_all = 0.0;
+
+    for (int f = 0; f < n_frames; ++f) {
+        float sum = 0.0f;
+        for (int i = 0; i < n_frame; ++i) {
+            sum += fabsf(samples[f*n_frame + i]);
+        }
+        energy[f] = sum/n_frame;
+        energy_all += energy[f];
+    }
+
+    energy_all /= n_frames;
+
+    // moving average via prefix sums
+    std::vector<double> prefix(n_frames + 1, 0.0);
+    for (int f = 0; f < n_frames; ++f) {
+        prefix[f + 1] = prefix[f] + energy[f];
+    }
+
+    std::vector<float> smooth(n_frames);
+    for (int f = 0; f < n_frames; ++f) {
+        const int f0 = std::max(0, f - n_smooth);
+        const int f1 = std::min(n_frames, f + n_smooth + 1);
+        smooth[f] = (prefix[f1] - prefix[f0])/(f1 - f0);
+    }
+
+    const float thold  = vad_thold*energy_all;
+    const int   n_per  = n_frames/n_chunks;
+    const int   radius = std::min(n_per/4, 500);
+
+    int prev = 0;
+
+    for (int k = 1; k < n_chunks; ++k) {
+        const int target = (int64_t) k*n_frames/n_chunks;
+
+        const int lo = std::max(prev + 1, target - radius);
+        const int hi = std::min(n_frames - 1, target + radius);
+
+        int  best   = -1;
+        bool silent = false;
+
+        // middle of the silent run closest to the target
+        for (int f = lo; f <= hi; ) {
+            if (smooth[f] >= thold) {
+                ++f;
+                continue;
+            }
+
+            int f_end = f;
+            while (f_end + 1 <= hi && smooth[f_end + 1] < thold) {
+                ++f_end;
+            }
+
+            const int mid = (f + f_end)/2;
+            if (best < 0 || std::abs(mid - target) < std::abs(best - target)) {
+                best = mid;
+            }
+
+            f = f_end + 1;
+        }
+
+        if (best >= 0) {
+            silent = true;
+        } else {
+            best = lo;
+            for (int f = lo; f <= hi; ++f) {
+                if (smooth[f] < smooth[best]) {
+                    best = f;
+                }
+            }
+        }
+
+        bounds.push_back(best*n_frame);
+        in_silence.push_back(silent);
+
+        prev = best;
+    }
+
+    bounds.push_back(n_samples);
+
+    return bounds;
+}
+
+// run whisper_full_with_state() on VAD-split chunks of the audio, one chunk per state, and merge the results into states[0]
+static int whisper_full_parallel_impl(
         struct whisper_context * ctx,
+        struct whisper_state ** states,
+        int n_states,
         struct whisper_full_params params,
         const float * samples,
-        int n_samples,
-        int n_processors) {
-    if (n_processors == 1) {
-        return whisper_full(ctx, params, samples, n_samples);
+        int n_samples) {
+    // do not split into chunks shorter than this
+    const int n_samples_min = 5*WHISPER_SAMPLE_RATE;
+
+    const int offset_samples = std::min(n_samples, (WHISPER_SAMPLE_RATE*params.offset_ms)/1000);
+    const int end_samples    = params.duration_ms > 0 ? std::min(n_samples, offset_samples + (WHISPER_SAMPLE_RATE*params.duration_ms)/1000) : n_samples;
+
+    const int n_chunks = std::max(1, std::min(n_states, (end_samples - offset_samples)/n_samples_min));
+
+    if (n_chunks == 1) {
+        return whisper_full_with_state(ctx, states[0], params, samples, n_samples);
     }
-    int ret = 0;
 
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
+    std::vector<bool> in_silence;
+    const std::vector<int> bounds = whisper_vad_split(samples + offset_samples, end_samples - offset_samples, n_chunks, in_silence);
+
+    // the helper states may have been used before - only their counters for this call are merged into states[0]
+    struct counters {
+        int64_t t_mel_us, t_sample_us, t_encode_us, t_decode_us, t_batchd_us, t_prompt_us, t_draft_us;
+        int32_t n_sample, n_encode, n_decode, n_batchd, n_prompt, n_draft, n_draft_accept;
+        int32_t n_fail_p, n_fail_h;
+    };
+
+    auto get_counters = [](const whisper_state * state) {
+        return counters {
+            state->t_mel_us, state->t_sample_us, state->t_encode_us, state->t_decode_us, state->t_batchd_us, state->t_prompt_us, state->t_draft_us,
+            state->n_sample, state->n_encode, state->n_decode, state->n_batchd, state->n_prompt, state->n_draft, state->n_draft_accept,
+            state->n_fail_p, state->n_fail_h,
+        };
+    };
 
-    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
-    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+    std::vector<counters> counters_start;
+    for (int i = 0; i < n_chunks; ++i) {
+        counters_start.push_back(get_counters(states[i]));
+    }
 
     // the calling thread will process the first chunk
     // while the other threads will process the remaining chunks
+    std::vector<int> rets(n_chunks, 0);
 
-    std::vector<std::thread> workers(n_processors - 1);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
-
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+    std::vector<std::thread> workers(n_chunks - 1);
+    for (int i = 0; i < n_chunks - 1; ++i) {
+        const int start_samples = offset_samples + bounds[i + 1];
+        const int n_samples_cur = bounds[i + 2] - bounds[i + 1];
 
         auto params_cur = params;
 
-        params_cur.offset_ms = 0;
+        params_cur.offset_ms   = 0;
+        params_cur.duration_ms = 0;
         params_cur.print_progress = false;
         params_cur.print_realtime = false;
 
@@ -5857,7 +7758,9 @@ int whisper_full_parallel(
         params_cur.progress_callback = nullptr;
         params_cur.progress_callback_user_data = nullptr;
 
-        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+        workers[i] = std::thread([=, &rets]() {
+            rets[i + 1] = whisper_full_with_state(ctx, states[i + 1], params_cur, samples + start_samples, n_samples_cur);
+        });
     }
 
     {
@@ -5865,71 +7768,156 @@ int whisper_full_parallel(
 
         // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
         params_cur.print_realtime = false;
+        params_cur.duration_ms    = 0;
 
-        // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
+        // Run the first transformation using the first state but only for the first chunk.
+        rets[0] = whisper_full_with_state(ctx, states[0], std::move(params_cur), samples, offset_samples + bounds[1]);
     }
 
-    for (int i = 0; i < n_processors - 1; ++i) {
+    for (int i = 0; i < n_chunks - 1; ++i) {
         workers[i].join();
     }
 
     const int64_t offset_t = (int64_t) params.offset_ms/10.0;
 
-    // combine results into result_state->result_all from all other states
-    for (int i = 0; i < n_processors - 1; ++i) {
-        auto& results_i = states[i]->result_all;
+    auto & result_all = states[0]->result_all;
 
-        for (auto& result : results_i) {
+    // combine results into states[0]->result_all from all other states
+    for (int i = 1; i < n_chunks; ++i) {
+        auto & results_i = states[i]->result_all;
+
+        for (auto & result : results_i) {
             // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+            result.t0 += 100*(int64_t) bounds[i]/WHISPER_SAMPLE_RATE + offset_t;
+            result.t1 += 100*(int64_t) bounds[i]/WHISPER_SAMPLE_RATE + offset_t;
 
             // make sure that segments are not overlapping
-            if (!ctx->state->result_all.empty()) {
-                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
+            if (!result_all.empty()) {
+                result.t0 = std::max(result.t0, result_all.back().t1);
             }
 
-            ctx->state->result_all.push_back(std::move(result));
+            result_all.push_back(std::move(result));
 
             // call the new_segment_callback for each segment
             if (params.new_segment_callback) {
-                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
+                params.new_segment_callback(ctx, states[0], 1, params.new_segment_callback_user_data);
             }
         }
 
-        ctx->state->t_mel_us += states[i]->t_mel_us;
+        results_i.clear();
+    }
 
-        ctx->state->t_sample_us += states[i]->t_sample_us;
-        ctx->state->t_encode_us += states[i]->t_encode_us;
-        ctx->state->t_decode_us += states[i]->t_decode_us;
-        ctx->state->t_batchd_us += states[i]->t_batchd_us;
-        ctx->state->t_prompt_us += states[i]->t_prompt_us;
+    // timings: the work of all chunks is summed up, the times of the main stages are averaged over the chunks
+    {
+        counters sum = {};
+        for (int i = 0; i < n_chunks; ++i) {
+            const counters c0 = counters_start[i];
+            const counters c1 = get_counters(states[i]);
 
-        ctx->state->n_sample += states[i]->n_sample;
-        ctx->state->n_encode += states[i]->n_encode;
-        ctx->state->n_decode += states[i]->n_decode;
-        ctx->state->n_batchd += states[i]->n_batchd;
-        ctx->state->n_prompt += states[i]->n_prompt;
+            sum.t_mel_us    += c1.t_mel_us    - c0.t_mel_us;
+            sum.t_sample_us += c1.t_sample_us - c0.t_sample_us;
+            sum.t_encode_us += c1.t_encode_us - c0.t_encode_us;
+            sum.t_decode_us += c1.t_decode_us - c0.t_decode_us;
+            sum.t_batchd_us += c1.t_batchd_us - c0.t_batchd_us;
+            sum.t_prompt_us += c1.t_prompt_us - c0.t_prompt_us;
+            sum.t_draft_us  += c1.t_draft_us  - c0.t_draft_us;
 
-        whisper_free_state(states[i]);
-    }
+            sum.n_sample += c1.n_sample - c0.n_sample;
+            sum.n_encode += c1.n_encode - c0.n_encode;
+            sum.n_decode += c1.n_decode - c0.n_decode;
+            sum.n_batchd += c1.n_batchd - c0.n_batchd;
+            sum.n_prompt += c1.n_prompt - c0.n_prompt;
 
-    // average the timings
-    ctx->state->t_mel_us    /= n_processors;
-    ctx->state->t_sample_us /= n_processors;
-    ctx->state->t_encode_us /= n_processors;
-    ctx->state->t_decode_us /= n_processors;
+            sum.n_draft        += c1.n_draft        - c0.n_draft;
+            sum.n_draft_accept += c1.n_draft_accept - c0.n_draft_accept;
+
+            sum.n_fail_p += c1.n_fail_p - c0.n_fail_p;
+            sum.n_fail_h += c1.n_fail_h - c0.n_fail_h;
+        }
+
+        whisper_state * state = states[0];
+        const counters & c0 = counters_start[0];
+
+        state->t_mel_us    = c0.t_mel_us    + sum.t_mel_us/n_chunks;
+        state->t_sample_us = c0.t_sample_us + sum.t_sample_us/n_chunks;
+        state->t_encode_us = c0.t_encode_us + sum.t_encode_us/n_chunks;
+        state->t_decode_us = c0.t_decode_us + sum.t_decode_us/n_chunks;
+        state->t_batchd_us = c0.t_batchd_us + sum.t_batchd_us;
+        state->t_prompt_us = c0.t_prompt_us + sum.t_prompt_us;
+        state->t_draft_us  = c0.t_draft_us  + sum.t_draft_us/n_chunks;
+
+        state->n_sample = c0.n_sample + sum.n_sample;
+        state->n_encode = c0.n_encode + sum.n_encode;
+        state->n_decode = c0.n_decode + sum.n_decode;
+        state->n_batchd = c0.n_batchd + sum.n_batchd;
+        state->n_prompt = c0.n_prompt + sum.n_prompt;
+
+        state->n_draft        = c0.n_draft        + sum.n_draft;
+        state->n_draft_accept = c0.n_draft_accept + sum.n_draft_accept;
+
+        state->n_fail_p = c0.n_fail_p + sum.n_fail_p;
+        state->n_fail_h = c0.n_fail_h + sum.n_fail_h;
+    }
 
     // print information about the audio boundaries
-    WHISPER_LOG_WARN("\n");
-    WHISPER_LOG_WARN("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        WHISPER_LOG_WARN("%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
+    int n_speech_cuts = 0;
+    for (int i = 0; i < n_chunks - 1; ++i) {
+        WHISPER_LOG_INFO("%s: split %d - %s (%s)\n", __func__, (i + 1),
+                to_timestamp(100*(int64_t) bounds[i + 1]/WHISPER_SAMPLE_RATE + offset_t).c_str(), in_silence[i] ? "pause" : "no pause found");
+        n_speech_cuts += in_silence[i] ? 0 : 1;
+    }
+    if (n_speech_cuts > 0) {
+        WHISPER_LOG_WARN("%s: %d of the %d splits are not in a pause - the transcription quality may be degraded near them\n", __func__, n_speech_cuts, n_chunks - 1);
+    }
+
+    for (int i = 0; i < n_chunks; ++i) {
+        if (rets[i] != 0) {
+            return rets[i];
+        }
+    }
+
+    return 0;
+}
+
+int whisper_full_parallel(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        int n_processors) {
+    if (n_processors == 1) {
+        return whisper_full(ctx, params, samples, n_samples);
+    }
+
+    // the helper states are kept in the context and reused by the next calls
+    while ((int) ctx->states_parallel.size() < n_processors - 1) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to initialize state\n", __func__);
+            return -7;
+        }
+        ctx->states_parallel.push_back(state);
+    }
+
+    std::vector<whisper_state *> states = { ctx->state };
+    states.insert(states.end(), ctx->states_parallel.begin(), ctx->states_parallel.begin() + n_processors - 1);
+
+    return whisper_full_parallel_impl(ctx, states.data(), states.size(), params, samples, n_samples);
+}
+
+int whisper_full_parallel_with_states(
+        struct whisper_context * ctx,
+        struct whisper_state ** states,
+        int n_states,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples) {
+    if (n_states < 1) {
+        WHISPER_LOG_ERROR("%s: at least one state is required\n", __func__);
+        return -7;
     }
-    WHISPER_LOG_WARN("%s: the transcription quality may be degraded near these boundaries\n", __func__);
 
-    return ret;
+    return whisper_full_parallel_impl(ctx, states, n_states, params, samples, n_samples);
 }
 
 int whisper_full_n_segments_from_state(struct whisper_state * state) {
@@ -5948,6 +7936,10 @@ int whisper_full_lang_id(struct whisper_context * ctx) {
     return ctx->state->lang_id;
 }
 
+int whisper_full_n_audio_ctx_from_state(struct whisper_state * state) {
+    return state->exp_n_audio_ctx;
+}
+
 int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment) {
     return state->result_all[i_segment].t0;
 }
@@ -6298,6 +8290,111 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
     return s.c_str();
 }
 
+WHISPER_API int whisper_bench_fft(int n_threads) {
+    fputs(whisper_bench_fft_str(n_threads), stderr);
+    return 0;
+}
+
+WHISPER_API const char * whisper_bench_fft_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+    fill_sin_cos_table();
+
+    // the FFT runs on a single thread per mel worker, so the thread count only scales the workload
+    const int n_workers = std::max(1, n_threads);
+
+    const int frame_size = WHISPER_N_FFT;
+
+    whisper_fft_plan plan;
+    whisper_fft_plan_init(plan, frame_size);
+
+    std::vector<float> hann;
+    hann_window(frame_size, true, hann);
+
+    // 1 s of pseudo-random audio, frames are taken from it in a round-robin fashion
+    std::vector<float> audio(WHISPER_SAMPLE_RATE);
+    {
+        uint32_t x = 12345;
+        for (size_t i = 0; i < audio.size(); i++) {
+            x = x*1664525u + 1013904223u;
+            audio[i] = ((x >> 8) & 0xFFFF)/32768.0f - 1.0f;
+        }
+    }
+
+    const int n_frames_max = (int) audio.size()/WHISPER_HOP_LENGTH - frame_size/WHISPER_HOP_LENGTH;
+
+    std::vector<float> fft_in(frame_size);
+    std::vector<float> fft_out_ref;
+    std::vector<float> fft_out(2*plan.n_out);
+    std::vector<float> fft_work(plan.n_work());
+
+    // max difference between the reference and the planned FFT, relative to the largest bin
+    double max_diff = 0.0;
+    for (int f = 0; f < n_frames_max; f++) {
+        for (int j = 0; j < frame_size; j++) {
+            fft_in[j] = hann[j]*audio[f*WHISPER_HOP_LENGTH + j];
+        }
+
+        fft(fft_in, fft_out_ref);
+        whisper_fft(plan, fft_in.data(), fft_out.data(), fft_work.data());
+
+        double max_ref = 0.0;
+        double max_d   = 0.0;
+        for (int j = 0; j < 2*plan.n_out; j++) {
+            max_ref = std::max(max_ref, (double) fabsf(fft_out_ref[j]));
+            max_d   = std::max(max_d,   (double) fabsf(fft_out_ref[j] - fft_out[j]));
+        }
+        max_diff = std::max(max_diff, max_d/std::max(max_ref, 1e-9));
+    }
+
+    snprintf(strbuf, sizeof(strbuf), "fft: n = %d, max rel diff vs reference = %.3e\n", frame_size, max_diff);
+    s += strbuf;
+
+    // 5 s and 30 s clips, one FFT per 10 ms hop
+    const int clip_sec[] = { 5, 30, };
+
+    for (int clip : clip_sec) {
+        const int n_frames = n_workers*clip*WHISPER_SAMPLE_RATE/WHISPER_HOP_LENGTH;
+
+        double sum = 0.0;
+
+        // reference recursive FFT, allocates on every call
+        const int64_t t0 = ggml_time_us();
+        for (int f = 0; f < n_frames; f++) {
+            const float * frame = audio.data() + (f % n_frames_max)*WHISPER_HOP_LENGTH;
+            for (int j = 0; j < frame_size; j++) {
+                fft_in[j] = hann[j]*frame[j];
+            }
+            fft(fft_in, fft_out_ref);
+            sum += fft_out_ref[2];
+        }
+        const int64_t t1 = ggml_time_us();
+
+        // planned FFT, no allocations
+        for (int f = 0; f < n_frames; f++) {
+            const float * frame = audio.data() + (f % n_frames_max)*WHISPER_HOP_LENGTH;
+            for (int j = 0; j < frame_size; j++) {
+                fft_in[j] = hann[j]*frame[j];
+            }
+            whisper_fft(plan, fft_in.data(), fft_out.data(), fft_work.data());
+            sum += fft_out[2];
+        }
+        const int64_t t2 = ggml_time_us();
+
+        const double t_ref  = (t1 - t0)*1e-3;
+        const double t_plan = (t2 - t1)*1e-3;
+
+        snprintf(strbuf, sizeof(strbuf), "fft: %2d s clip x %d (%6d frames): reference %8.2f ms | plan %8.2f ms | speedup %5.2fx (sum %g)\n",
+                clip, n_workers, n_frames, t_ref, t_plan, t_ref/std::max(t_plan, 1e-3), sum);
+        s += strbuf;
+    }
+
+    return s.c_str();
+}
+
 // =================================================================================================
 
 // =================================================================================================
@@ -84,9 +84,21 @@ extern "C" {
     typedef int32_t whisper_token;
     typedef int32_t whisper_seq_id;
 
+    // Called while the model weights are loaded, progress goes from 0.0 to 1.0
+    typedef void (*whisper_load_progress_callback)(float progress, void * user_data);
+
     struct whisper_context_params {
         bool  use_gpu;
         int   gpu_device;  // CUDA device
+
+        bool  use_mmap;      // map the model file instead of reading it (CPU backend, whisper_init_from_file_*)
+        bool  mmap_prefetch; // ask the kernel to read the mapped file ahead
+
+        bool  kv_self_q8;    // store the self-attention keys in Q8_0 (the values stay in F16)
+        bool  kv_cross_q8;   // store the cross-attention keys and values in Q8_0
+
+        whisper_load_progress_callback progress_callback;
+        void * progress_callback_user_data;
     };
 
     typedef struct whisper_token_data {
@@ -185,6 +197,10 @@ extern "C" {
 
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
+    // Memory used by the state: KV caches and compute buffers, in bytes.
+    // The self-attention cache grows when more decoders are used, so the value can increase after whisper_full().
+    WHISPER_API size_t whisper_state_n_bytes(struct whisper_state * state);
+
     // Given a context, enable use of OpenVINO for encode inference.
     // model_path: Optional path to OpenVINO encoder IR model. If set to nullptr,
     //                      the path will be generated from the ggml model path that was passed
@@ -202,6 +218,26 @@ extern "C" {
                     const char * device,
                     const char * cache_dir);
 
+    // Same as whisper_ctx_init_openvino_encoder, for a state created with whisper_init_state().
+    // Every state that should encode with OpenVINO needs its own call.
+    WHISPER_API int whisper_ctx_init_openvino_encoder_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir);
+
+    // Batch the encoder passes of concurrent whisper_full_with_state() calls on different states of this context.
+    // Passes with the same audio context size that start within t_wait_ms of each other are evaluated as a single
+    // graph of up to n_batch_max inputs, which reuses the encoder weights across requests.
+    // A pass waits at most t_wait_ms for other requests to join. n_batch_max <= 1 disables batching.
+    // Must not be called while the context is in use.
+    // Returns 0 on success.
+    WHISPER_API int whisper_ctx_init_encoder_batch(
+        struct whisper_context * ctx,
+                           int   n_batch_max,
+                           int   t_wait_ms);
+
     // Frees all allocated memory
     WHISPER_API void whisper_free      (struct whisper_context * ctx);
     WHISPER_API void whisper_free_state(struct whisper_state * state);
@@ -388,6 +424,30 @@ extern "C" {
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_reset_timings(struct whisper_context * ctx);
 
+    // The performance counters of a state, accumulated since it was created
+    // The difference of two snapshots gives the cost of the calls in between
+    struct whisper_timings {
+        int64_t t_mel_us;
+        int64_t t_sample_us;
+        int64_t t_encode_us;
+        int64_t t_decode_us;
+        int64_t t_batchd_us;
+        int64_t t_prompt_us;
+        int64_t t_draft_us;
+
+        int32_t n_sample;
+        int32_t n_encode;
+        int32_t n_decode;
+        int32_t n_batchd;
+        int32_t n_prompt;
+        int32_t n_fail_p;       // logprob threshold failures
+        int32_t n_fail_h;       // entropy threshold failures
+        int32_t n_draft;
+        int32_t n_draft_accept;
+    };
+
+    WHISPER_API struct whisper_timings whisper_get_timings_from_state(struct whisper_state * state);
+
     // Print system information
     WHISPER_API const char * whisper_print_system_info(void);
 
@@ -456,6 +516,7 @@ extern "C" {
         bool speed_up;          // speed-up the audio by 2x using Phase Vocoder
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        bool audio_ctx_auto;    // if audio_ctx == 0, use the smallest audio context bucket that covers the input
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
@@ -495,6 +556,14 @@ extern "C" {
             float patience; // TODO: not implemented, ref: https://arxiv.org/pdf/2204.05424.pdf
         } beam_search;
 
+        // speculative decoding: a smaller model with the same vocabulary proposes up to n_draft tokens,
+        // which this model verifies in a single batched decode
+        // only used for greedy sampling at temperature 0, the result is the same as without a draft model
+        struct {
+            struct whisper_context * ctx; // draft model, nullptr to disable
+            int n_draft;                  // max number of tokens proposed at a time
+        } draft;
+
         // called for every newly generated text segment
         whisper_new_segment_callback new_segment_callback;
         void * new_segment_callback_user_data;
@@ -544,10 +613,11 @@ extern "C" {
                                    int   n_samples);
 
     // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
+    // The chunks have similar lengths and are cut in pauses of the speech, found with a simple energy VAD.
+    // Chunks are at least 5 seconds long, so short inputs may use fewer than n_processors chunks.
     // Result is stored in the default state of the context
+    // The extra n_processors - 1 states are kept in the context and reused by the next calls.
     // Not thread safe if executed in parallel on the same context.
-    // It seems this approach can offer some speedup in some cases.
-    // However, the transcription accuracy can be worse at the beginning and end of each chunk.
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -555,6 +625,16 @@ extern "C" {
                                    int   n_samples,
                                    int   n_processors);
 
+    // Same as whisper_full_parallel(), but processes one chunk per provided state
+    // Result is stored in states[0]
+    WHISPER_API int whisper_full_parallel_with_states(
+                struct whisper_context * ctx,
+                  struct whisper_state ** states,
+                                   int   n_states,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples);
+
     // Number of generated text segments
     // A segment can be a few words, a sentence, or even a paragraph.
     WHISPER_API int whisper_full_n_segments           (struct whisper_context * ctx);
@@ -566,6 +646,9 @@ extern "C" {
     // Language id associated with the provided state
     WHISPER_API int whisper_full_lang_id_from_state(struct whisper_state * state);
 
+    // Audio context size used by the last whisper_full() call on the provided state
+    WHISPER_API int whisper_full_n_audio_ctx_from_state(struct whisper_state * state);
+
     // Get the start and end time of the specified segment
     WHISPER_API int64_t whisper_full_get_segment_t0           (struct whisper_context * ctx, int i_segment);
     WHISPER_API int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment);
@@ -609,6 +692,8 @@ extern "C" {
     WHISPER_API const char * whisper_bench_memcpy_str      (int n_threads);
     WHISPER_API int          whisper_bench_ggml_mul_mat    (int n_threads);
     WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads);
+    WHISPER_API int          whisper_bench_fft             (int n_threads);
+    WHISPER_API const char * whisper_bench_fft_str         (int n_threads);
 
     // Control logging output; default behavior is to print to stderr
 